@@ -45,3 +45,280 @@ EOF
     [ "$status" -ne 0 ]
     [[ "$output" =~ "command not found" ]]
 }
+
+@test "Test: background job runs and is reported" {
+    run "./dsh" <<EOF
+sleep 0.2 &
+jobs
+wait
+EOF
+
+    # Assertions
+    [ "$status" -eq 0 ]
+    [[ "$output" =~ "[1] " ]]
+    [[ "$output" =~ "Running" ]]
+}
+
+@test "Test: shell keeps accepting commands while a job runs" {
+    run "./dsh" <<EOF
+sleep 1 &
+echo still here
+EOF
+
+    # Assertions
+    [ "$status" -eq 0 ]
+    [[ "$output" =~ "still here" ]]
+}
+
+@test "Test: finished background job is announced at the next prompt" {
+    run "./dsh" <<EOF
+false &
+sleep 0.2
+echo done
+EOF
+
+    # Assertions
+    [ "$status" -eq 0 ]
+    [[ "$output" =~ "Exit 1" ]]
+}
+
+@test "Test: parallel keeps output in input order with -k" {
+    run "./dsh" <<EOF
+parallel -j 3 -k echo item ::: 1 2 3 4
+EOF
+
+    stripped_output=$(echo "$output" | tr -d '[:space:]')
+
+    # Assertions
+    [ "$status" -eq 0 ]
+    [[ "$stripped_output" =~ "item1item2item3item4" ]]
+    [[ "$output" =~ "4 items, 4 ok, 0 failed" ]]
+}
+
+@test "Test: parallel retries failed items and reports them" {
+    run "./dsh" <<EOF
+parallel -r 2 ls {} ::: /nonexistent_dir_for_dsh
+EOF
+
+    # Assertions, the shell exits with parallel's count of failed items
+    [ "$status" -eq 1 ]
+    [[ "$output" =~ "1 failed, 2 retried" ]]
+}
+
+@test "Test: parallel reads items from a pipe" {
+    run "./dsh" <<EOF
+ls dshlib.c dshlib.h | parallel -k echo got {}
+EOF
+
+    # Assertions
+    [ "$status" -eq 0 ]
+    [[ "$output" =~ "got dshlib.c" ]]
+    [[ "$output" =~ "got dshlib.h" ]]
+}
+
+@test "Test: time prefix reports every pipeline stage" {
+    run "./dsh" <<EOF
+time ls | grep dshlib.c
+EOF
+
+    # Assertions
+    [ "$status" -eq 0 ]
+    [[ "$output" =~ "MAXRSS" ]]
+    [[ "$output" =~ "total" ]]
+    [[ "$output" =~ "grep dshlib.c" ]]
+}
+
+@test "Test: set -o timing appends a summary line to timelog" {
+    rm -f timing_test.log
+    run "./dsh" <<EOF
+set -o timing
+set timelog=timing_test.log
+echo hello
+EOF
+
+    # Assertions
+    [ "$status" -eq 0 ]
+    grep -q 'dsh-time .*stages=1 .*cmd="echo hello"' timing_test.log
+    rm -f timing_test.log
+}
+
+@test "Test: -c runs commands without a prompt and returns their status" {
+    run "./dsh" -c "echo from dash c"
+
+    # Assertions
+    [ "$status" -eq 0 ]
+    [ "$output" = "from dash c" ]
+}
+
+@test "Test: script mode skips comments and stops on error with set -e" {
+    printf '#!/usr/bin/env dsh\n# comment\necho one\nset -e\nfalse\necho two\n' > script_test.dsh
+    run "./dsh" script_test.dsh
+    rm -f script_test.dsh
+
+    # Assertions
+    [ "$status" -eq 1 ]
+    [ "$output" = "one" ]
+}
+
+@test "Test: exit code from exit is returned in -c mode" {
+    run "./dsh" -c "exit 7"
+
+    # Assertions
+    [ "$status" -eq 7 ]
+}
+
+@test "Test: exit code from exit is returned at the interactive prompt" {
+    run_dsh "exit 7"
+
+    # Assertions
+    [ "$status" -eq 7 ]
+}
+
+@test "Test: set pipesz accepts size suffixes and pipelines still work" {
+    run "./dsh" -c "set pipesz=1M
+set
+ls | grep dshlib.c"
+
+    # Assertions
+    [ "$status" -eq 0 ]
+    [[ "$output" =~ "set pipesz=1048576" ]]
+    [[ "$output" =~ "dshlib.c" ]]
+}
+
+@test "Test: |~ meters a junction without changing the data" {
+    run "./dsh" -c "seq 1 20000 |~ wc -l"
+
+    # Assertions
+    [ "$status" -eq 0 ]
+    [[ "$output" =~ "20000" ]]
+    [[ "$output" =~ "flowmeter:" ]]
+    [[ "$output" =~ "1>2" ]]
+}
+
+@test "Test: in-process echo, printf and test honour redirection" {
+    run "./dsh" -c "echo first > fastbi_test.out
+printf \"%s-%d\n\" item 7 >> fastbi_test.out
+test -f fastbi_test.out
+cat fastbi_test.out"
+    rm -f fastbi_test.out
+
+    # Assertions
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "first" ]
+    [ "${lines[1]}" = "item-7" ]
+}
+
+@test "Test: in-process printf expands %b escapes and prints nothing for an empty %c" {
+    run "./dsh" -c "printf \"[%-4b][%c][%2c]\n\" \"a\tb\" \"\" x"
+
+    # Assertions
+    [ "$status" -eq 0 ]
+    [ "$output" = "$(printf '[a\tb ][][ x]')" ]
+}
+
+@test "Test: in-process built-ins work as pipeline stages and with forkall" {
+    run "./dsh" -c "printf \"%s\n\" a b c | wc -l
+set -o forkall
+echo forked | cat
+[ 2 -gt 3 ]"
+
+    # Assertions
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "3" ]
+    [ "${lines[1]}" = "forked" ]
+}
+
+@test "Test: a line of only a redirection creates the file and does not crash" {
+    run "./dsh" -c "> noargs_test.out
+echo x | > noargs_test2.out
+echo still here"
+    [ -f noargs_test.out ] && [ -f noargs_test2.out ]
+    created=$?
+    rm -f noargs_test.out noargs_test2.out
+
+    # Assertions
+    [ "$status" -eq 0 ]
+    [ "$created" -eq 0 ]
+    [ "$output" = "still here" ]
+}
+
+@test "Test: -z starts pipelines through the zygote" {
+    run "./dsh" -z -c "cd bats
+ls | grep student_tests
+head -1 < student_tests.sh
+false"
+
+    # Assertions
+    [ "$status" -eq 1 ]
+    [ "${lines[0]}" = "student_tests.sh" ]
+    [ "${lines[1]}" = "#!/usr/bin/env bats" ]
+}
+
+@test "Test: history persists across sessions and can be searched" {
+    rm -f hist_test.txt
+    DSH_HISTFILE=hist_test.txt run "./dsh" <<EOF
+echo alpha
+ls dshlib.c
+EOF
+    DSH_HISTFILE=hist_test.txt run "./dsh" <<EOF
+history -s alp
+history | grep dshlib
+EOF
+    rm -f hist_test.txt
+
+    # Assertions
+    [ "$status" -eq 0 ]
+    [[ "$output" =~ "1  echo alpha" ]]
+    [[ "$output" =~ "2  ls dshlib.c" ]]
+}
+
+@test "Test: plugins load from DSH_PLUGIN_DIR and work as pipeline stages" {
+    make -s plugins
+    printf '{"user":{"name":"ann"},"code":200}\n{"user":{"name":"bob"}}\n' > plugin_test.txt
+    DSH_PLUGIN_DIR=plugins run "./dsh" -c "cat plugin_test.txt | jget user.name code
+jget code < plugin_test.txt"
+    rm -f plugin_test.txt
+
+    # Assertions
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "$(printf 'ann\t200')" ]
+    [[ "${lines[1]}" == bob* ]]
+    [ "${lines[2]}" = "200" ]
+}
+
+@test "Test: command substitution, here-strings and here-documents" {
+    run "./dsh" -c "echo x\$(echo a b | tr a-z A-Z)y
+wc -l <<< \"\$(seq 1 5)\"
+tr a-z A-Z << END
+here \$(echo doc)
+END
+cat << \"RAW\"
+\$(not run)
+RAW
+echo done"
+
+    # Assertions
+    [ "$status" -eq 0 ]
+    [ "${lines[0]}" = "xA By" ]
+    [ "${lines[1]}" = "5" ]
+    [ "${lines[2]}" = "HERE DOC" ]
+    [ "${lines[3]}" = "\$(not run)" ]
+    [ "${lines[4]}" = "done" ]
+}
+
+@test "Test: a substitution with too many words reports the argument limit" {
+    run "./dsh" -c "echo \$(seq 1 100)"
+
+    # Assertions
+    [ "$status" -eq 2 ]
+    [ "$output" = "error: a command is limited to 30 words" ]
+}
+
+@test "Test: set tmout logs out of an idle prompt" {
+    run bash -c '(echo "set tmout=1"; sleep 3; echo "echo late") | ./dsh'
+
+    # Assertions
+    [ "$status" -eq 0 ]
+    [[ "$output" =~ "auto-logout" ]]
+    [[ ! "$output" =~ "late" ]]
+}
@@ -0,0 +1,49 @@
+#!/usr/bin/env bash
+#
+# builtin_bench.sh - script loop with and without the in-process built-ins
+#
+# Runs a generated dsh script made of the small commands scripts lean on
+# (echo, printf, test, [, pwd, true) once with `set -o forkall`, where
+# every line is fork+exec'd as before, and once with the fast path.
+# Reports the best wall time of a few runs and the cost per command.
+#
+# usage: bench/builtin_bench.sh [iterations] [runs]    (run from starter/)
+
+DSH=${DSH:-./dsh}
+ITERS=${1:-2000}
+RUNS=${2:-3}
+LINES_PER_ITER=6
+
+SCRIPT=$(mktemp /tmp/dsh_bi_bench.XXXXXX)
+trap 'rm -f "$SCRIPT" "$SCRIPT.fork"' EXIT
+
+for ((i = 0; i < ITERS; i++)); do
+    echo "echo line $i > /dev/null"
+    echo "printf \"%d %s\n\" $i item > /dev/null"
+    echo "test -f dshlib.c"
+    echo "[ $i -ge 0 ]"
+    echo "pwd > /dev/null"
+    echo "true"
+done > "$SCRIPT"
+{ echo "set -o forkall"; cat "$SCRIPT"; } > "$SCRIPT.fork"
+
+best_ms() {
+    local best=""
+    for ((r = 0; r < RUNS; r++)); do
+        local t0=$(date +%s%N)
+        $DSH "$1" > /dev/null
+        local ms=$(( ($(date +%s%N) - t0) / 1000000 ))
+        [ -z "$best" ] || [ "$ms" -lt "$best" ] && best=$ms
+    done
+    echo "$best"
+}
+
+CMDS=$((ITERS * LINES_PER_ITER))
+printf "%-12s %10s %12s\n" "mode" "best(ms)" "us/cmd"
+for mode in forkall inproc; do
+    file=$SCRIPT
+    [ "$mode" = "forkall" ] && file=$SCRIPT.fork
+    ms=$(best_ms "$file")
+    awk -v m="$mode" -v ms="$ms" -v n="$CMDS" \
+        'BEGIN { printf "%-12s %10d %12.1f\n", m, ms, ms * 1000 / n }'
+done
@@ -0,0 +1,39 @@
+#!/usr/bin/env bash
+#
+# pipesz_bench.sh - pipeline throughput at several pipe buffer sizes
+#
+# Pushes a large file through a three stage pipeline with each value of
+# `set pipesz=` and reports the best wall time of a few runs and the
+# throughput that gives.  dsh's own `time` support does the measuring,
+# the numbers are read back from the timelog line it appends.
+#
+# usage: bench/pipesz_bench.sh [size_mb] [runs]    (run from starter/)
+
+DSH=${DSH:-./dsh}
+SIZE_MB=${1:-512}
+RUNS=${2:-3}
+SIZES="0 64K 256K 1M"
+
+DATA=$(mktemp /tmp/dsh_pipesz.XXXXXX)
+LOG=$(mktemp /tmp/dsh_pipesz_log.XXXXXX)
+trap 'rm -f "$DATA" "$LOG"' EXIT
+
+# random-ish text so nothing along the way can shortcut the copy
+head -c $((SIZE_MB * 1024 * 1024)) /dev/urandom | base64 -w 120 > "$DATA"
+BYTES=$(stat -c %s "$DATA")
+
+printf "%-10s %12s %12s\n" "pipesz" "best(ms)" "MB/s"
+for sz in $SIZES; do
+    : > "$LOG"
+    for ((r = 0; r < RUNS; r++)); do
+        $DSH -c "set pipesz=$sz
+set timelog=$LOG
+time cat $DATA | cat | wc -c" > /dev/null 2>&1
+    done
+
+    best=$(sed -n 's/.*wall_ms=\([0-9.]*\).*/\1/p' "$LOG" | sort -n | head -1)
+    label=$sz
+    [ "$sz" = "0" ] && label="default"
+    awk -v l="$label" -v ms="$best" -v b="$BYTES" \
+        'BEGIN { printf "%-10s %12.1f %12.1f\n", l, ms, (b / 1048576) / (ms / 1000) }'
+done
@@ -0,0 +1,181 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+/*
+ * startup_bench - start-to-exit latency of a command, e.g. `dsh -c true`
+ *
+ *      startup_bench [-n RUNS] [-c] [-i FILE] CMD [ARGS...]
+ *
+ * Runs CMD RUNS times with fork+execv and waitpid, timing each run with
+ * CLOCK_MONOTONIC, and prints one line:
+ *
+ *      runs  min  median  p99  mean      (microseconds)
+ *
+ * -c makes every run a cold start.  Before each run the page cache is
+ * dropped when we are allowed to (root), otherwise the pages of CMD and
+ * of every shared library it loads are evicted with
+ * posix_fadvise(POSIX_FADV_DONTNEED).  The library list comes from
+ * running CMD once with LD_TRACE_LOADED_OBJECTS=1, which is what ldd does.
+ * Without root, pages some other process has mapped (libc, ld.so) stay
+ * resident, so that cold start is only as cold as the kernel allows.
+ *
+ * -i FILE feeds FILE to CMD on stdin, e.g. a lone `exit` for an
+ * interactive shell, the default is /dev/null.  Output goes to /dev/null.
+ *
+ * Built by `make bench/startup_bench`, bench/startup_bench.sh drives it
+ * over the build variants.  5-ShellP3 and 6-RShell each have their own
+ * makefile, variants and script around this program, so each has a copy.
+ * The copies are kept identical; a change goes into both.
+ */
+
+#define MAX_RUNS    100000
+#define MAX_FILES   64
+#define DROP_CACHES "/proc/sys/vm/drop_caches"
+
+static char *files[MAX_FILES];
+static int   nfiles = 0;
+static bool  can_drop = false;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static const char *in_path = "/dev/null";
+
+static pid_t spawn(char **argv, int out_fd, bool trace) {
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        int in_fd = open(in_path, O_RDONLY);
+        if (in_fd < 0) _exit(127);
+        dup2(in_fd, STDIN_FILENO);
+        if (trace) setenv("LD_TRACE_LOADED_OBJECTS", "1", 1);
+        dup2(out_fd, STDOUT_FILENO);
+        execv(argv[0], argv);
+        _exit(127);
+    }
+    return pid;
+}
+
+//the binary itself plus the "=> /path" entries of the loader trace
+static void find_files(char **argv) {
+    int fds[2];
+    char buff[8192];
+    size_t used = 0;
+    ssize_t n;
+
+    files[nfiles++] = argv[0];
+    if (pipe(fds) < 0) return;
+
+    pid_t pid = spawn(argv, fds[1], true);
+    close(fds[1]);
+    while ((n = read(fds[0], buff + used, sizeof(buff) - 1 - used)) > 0) {
+        used += n;
+    }
+    close(fds[0]);
+    waitpid(pid, NULL, 0);
+    buff[used] = '\0';
+
+    for (char *line = strtok(buff, "\n"); line && nfiles < MAX_FILES; line = strtok(NULL, "\n")) {
+        char *path = strstr(line, "=> /");
+        if (path) {
+            path += 3;
+        } else {
+            path = line + strspn(line, " \t");  // ld.so has no "=>"
+            if (*path != '/') continue;
+        }
+        path[strcspn(path, " ")] = '\0';
+        files[nfiles++] = strdup(path);
+    }
+}
+
+static void evict(void) {
+    if (can_drop) {
+        sync();
+        int fd = open(DROP_CACHES, O_WRONLY);
+        if (fd >= 0) {
+            if (write(fd, "3", 1) < 0) can_drop = false;
+            close(fd);
+            return;
+        }
+    }
+    for (int i = 0; i < nfiles; i++) {
+        int fd = open(files[i], O_RDONLY);
+        if (fd < 0) continue;
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-n RUNS] [-c] [-i FILE] CMD [ARGS...]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    int runs = 1000, opt;
+    bool cold = false;
+
+    while ((opt = getopt(argc, argv, "+n:ci:")) != -1) {
+        switch (opt) {
+            case 'n': runs = atoi(optarg); break;
+            case 'c': cold = true; break;
+            case 'i': in_path = optarg; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind >= argc || runs < 1 || runs > MAX_RUNS) usage(argv[0]);
+
+    char **cmd = argv + optind;
+    double *us = malloc(sizeof(double) * runs), sum = 0;
+    int null_fd = open("/dev/null", O_WRONLY);
+    if (!us || null_fd < 0) {
+        perror("startup_bench");
+        return 1;
+    }
+
+    if (cold) {
+        can_drop = access(DROP_CACHES, W_OK) == 0;
+        find_files(cmd);
+    } else {
+        //one untimed run so the warm numbers start warm
+        waitpid(spawn(cmd, null_fd, false), NULL, 0);
+    }
+
+    for (int r = 0; r < runs; r++) {
+        int status;
+
+        if (cold) evict();
+        double t0 = now_us();
+        pid_t pid = spawn(cmd, null_fd, false);
+        while (waitpid(pid, &status, 0) < 0 && errno == EINTR);
+        us[r] = now_us() - t0;
+        sum += us[r];
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) == 127) {
+            fprintf(stderr, "%s: could not run\n", cmd[0]);
+            return 1;
+        }
+    }
+
+    qsort(us, runs, sizeof(double), cmp_double);
+    int p99 = (int)(runs * 0.99);
+    if (p99 >= runs) p99 = runs - 1;
+    printf("%d %.1f %.1f %.1f %.1f\n", runs, us[0], us[runs / 2], us[p99], sum / runs);
+    return 0;
+}
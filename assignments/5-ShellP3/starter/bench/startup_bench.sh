@@ -0,0 +1,51 @@
+#!/usr/bin/env bash
+#
+# startup_bench.sh - `dsh -c true` start-to-exit time of each build variant
+#
+# dsh is started tens of thousands of times a day as a `-c` wrapper, so
+# most of its run time is the dynamic loader.  The variants from
+# `make variants` differ only in how calls into libc get bound:
+#
+#   dsh         default PIE: every libc call goes through a PLT stub that
+#               is resolved lazily on its first call, the behaviour
+#               demos/elf-comp-link/dl_printf.c walks through in gdb
+#   dsh-now     -Wl,-z,now: every symbol resolved up front at startup,
+#               more relocation work per start, none later
+#   dsh-noplt   -fno-plt: calls go straight through the GOT, no PLT stubs
+#               (which also means the symbols are bound at startup)
+#   dsh-lto     -O2 -flto: smaller, whole-program optimised code, same
+#               dynamic linking as dsh
+#   dsh-static  -static: no ld.so, no shared libc, no relocations at all
+#
+# For each binary it prints the loader's own view (LD_DEBUG=statistics:
+# relocations done and time spent in ld.so) and the cold and warm
+# startup latency from bench/startup_bench.  Cold runs evict the page
+# cache before each start, see startup_bench.c.
+#
+# usage: bench/startup_bench.sh [warm_runs] [cold_runs]    (run from starter/)
+
+WARM=${1:-2000}
+COLD=${2:-200}
+BENCH=bench/startup_bench
+VARIANTS="dsh dsh-now dsh-noplt dsh-lto dsh-static"
+
+make -s dsh variants "$BENCH" || exit 1
+
+# relocations and loader time as reported by ld.so itself
+ld_stats() {
+    LD_DEBUG=statistics "./$1" -c true 2>&1 >/dev/null |
+        awk '/total startup time in dynamic loader/ { t = $(NF-1) }
+             /number of relocations:/ { r = $NF }
+             END { printf "%s %s", (r == "" ? 0 : r), (t == "" ? "-" : t) }'
+}
+
+printf "%-11s %7s %10s | %9s %9s %9s | %9s %9s %9s\n" "binary" "relocs" "ld.so" \
+    "warm-p50" "warm-p99" "warm-min" "cold-p50" "cold-p99" "cold-min"
+for bin in $VARIANTS; do
+    read -r relocs ld_time <<< "$(ld_stats "$bin")"
+    read -r _ wmin wmed wp99 _ <<< "$($BENCH -n "$WARM" "./$bin" -c true)"
+    read -r _ cmin cmed cp99 _ <<< "$($BENCH -c -n "$COLD" "./$bin" -c true)"
+    printf "%-11s %7s %10s | %9s %9s %9s | %9s %9s %9s\n" "$bin" "$relocs" "$ld_time" \
+        "$wmed" "$wp99" "$wmin" "$cmed" "$cp99" "$cmin"
+done
+echo "(latencies in microseconds, ld.so time in CPU cycles)"
@@ -0,0 +1,423 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#include "dshlib.h"
+
+/*
+ * In-process fast path for small commands.
+ *
+ * echo, printf, pwd, true, false, test and [ are the commands scripts call
+ * over and over, and fork+exec costs far more than the work they do.
+ * These are run inside dsh instead:
+ *
+ *      on their own        no fork at all, < and > are honoured by dup'ing
+ *                          the redirected file over stdin/stdout and
+ *                          putting the saved fds back afterwards
+ *      as a pipeline stage the stage is still forked, the exec is skipped
+ *
+ * The commands are kept in a small open addressing hash table keyed by
+ * name, so looking one up costs one hash and usually one strcmp.  Plugin
+ * commands (see dsh_plugins.c) live in the same table.
+ * `set -o forkall` turns the fast path off for the commands that also
+ * exist as programs, e.g. to get the old behaviour back or to compare the
+ * two with bench/builtin_bench.sh.
+ */
+
+struct fast_bi {
+    const char      *name;
+    fast_bi_fn_t    fn;         // uses stdin/stdout
+    dsh_plugin_fn_t plugin_fn;  // gets the fds passed in
+};
+
+static fast_bi_t fast_bi_table[FAST_BI_SLOTS];
+static bool fast_bi_ready = false;
+
+//FNV-1a
+static unsigned int fast_bi_hash(const char *name) {
+    unsigned int h = 2166136261u;
+
+    while (*name) {
+        h ^= (unsigned char)*name++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static fast_bi_t *fast_bi_slot(const char *name) {
+    unsigned int slot = fast_bi_hash(name) & (FAST_BI_SLOTS - 1);
+
+    for (int probe = 0; probe < FAST_BI_SLOTS; probe++) {
+        fast_bi_t *bi = &fast_bi_table[slot];
+        if (!bi->name || strcmp(bi->name, name) == 0) return bi;
+        slot = (slot + 1) & (FAST_BI_SLOTS - 1);
+    }
+    return NULL;
+}
+
+int fast_bi_register(const char *name, fast_bi_fn_t fn) {
+    fast_bi_t *bi = fast_bi_slot(name);
+
+    if (!bi) return ERR_MEMORY;
+    bi->name = name;
+    bi->fn = fn;
+    bi->plugin_fn = NULL;
+    return OK;
+}
+
+//plugin commands replace a fast built-in of the same name
+int fast_bi_register_plugin(const char *name, dsh_plugin_fn_t fn) {
+    fast_bi_t *bi = fast_bi_slot(name);
+
+    if (!bi || !fn) return ERR_MEMORY;
+    if (!bi->name) {
+        bi->name = strdup(name);
+        if (!bi->name) return ERR_MEMORY;
+    }
+    bi->fn = NULL;
+    bi->plugin_fn = fn;
+    return OK;
+}
+
+//copy of the table, so a plugin that fails its init can be taken back out
+fast_bi_t *fast_bi_save(void) {
+    fast_bi_t *saved = malloc(sizeof(fast_bi_table));
+
+    if (saved) memcpy(saved, fast_bi_table, sizeof(fast_bi_table));
+    return saved;
+}
+
+//undo every registration made since fast_bi_save(), frees saved
+void fast_bi_restore(fast_bi_t *saved) {
+    for (int i = 0; i < FAST_BI_SLOTS; i++) {
+        //names that were new got strdup()ed by fast_bi_register_plugin()
+        if (fast_bi_table[i].name && !saved[i].name) free((char *)fast_bi_table[i].name);
+        fast_bi_table[i] = saved[i];
+    }
+    free(saved);
+}
+
+static int bi_true(cmd_buff_t *cmd) {
+    (void)cmd;
+    return 0;
+}
+
+static int bi_false(cmd_buff_t *cmd) {
+    (void)cmd;
+    return 1;
+}
+
+static int bi_echo(cmd_buff_t *cmd) {
+    bool newline = true;
+    int a = 1;
+
+    if (a < cmd->argc && strcmp(cmd->argv[a], "-n") == 0) {
+        newline = false;
+        a++;
+    }
+    for (; a < cmd->argc; a++) {
+        fputs(cmd->argv[a], stdout);
+        if (a + 1 < cmd->argc) putchar(' ');
+    }
+    if (newline) putchar('\n');
+    return 0;
+}
+
+static int bi_pwd(cmd_buff_t *cmd) {
+    char cwd[PATH_BUFF_SZ];
+    (void)cmd;
+
+    if (!getcwd(cwd, sizeof(cwd))) {
+        perror("pwd");
+        return 1;
+    }
+    puts(cwd);
+    return 0;
+}
+
+//prints the escape at *fmt to out, returns how many characters it used
+static int print_escape(FILE *out, const char *fmt) {
+    switch (*fmt) {
+        case 'n':  fputc('\n', out); return 1;
+        case 't':  fputc('\t', out); return 1;
+        case 'r':  fputc('\r', out); return 1;
+        case '\\': fputc('\\', out); return 1;
+        case '\0': fputc('\\', out); return 0;
+        default:   fputc('\\', out); fputc(*fmt, out); return 1;
+    }
+}
+
+/*
+ * printf FORMAT [ARGS...]
+ *      Supports %s %b %c %d %i %u %x %X %o and %%, with flags, width and
+ *      precision, plus the \n \t \r \\ escapes, which %b also expands in
+ *      its argument.  Like the shell printf the format is reused until all
+ *      the arguments are consumed.
+ */
+static int bi_printf(cmd_buff_t *cmd) {
+    if (cmd->argc < 2) {
+        fprintf(stderr, "usage: printf FORMAT [ARGS...]\n");
+        return 2;
+    }
+
+    const char *format = cmd->argv[1];
+    int a = 2, rc = 0;
+
+    do {
+        for (const char *f = format; *f; f++) {
+            if (*f == '\\') {
+                f += print_escape(stdout, f + 1);
+                continue;
+            }
+            if (*f != '%') {
+                putchar(*f);
+                continue;
+            }
+            if (f[1] == '%') {
+                putchar('%');
+                f++;
+                continue;
+            }
+
+            //copy the whole conversion so printf() can do flags and width,
+            //with room for '%', the flags, "ll", the conversion and '\0'
+            char spec[32];
+            size_t n = strspn(f + 1, "-+ #0123456789.");
+            if (n + 5 > sizeof(spec) || f[n + 1] == '\0') {
+                fprintf(stderr, "printf: bad format: %s\n", format);
+                return 2;
+            }
+            char conv = f[n + 1];
+            memcpy(spec, f, n + 1);
+
+            const char *arg = a < cmd->argc ? cmd->argv[a++] : NULL;
+            switch (conv) {
+                case 's':
+                    spec[n + 1] = 's';
+                    spec[n + 2] = '\0';
+                    printf(spec, arg ? arg : "");
+                    break;
+                case 'b': {
+                    //expand first, width and precision apply to the result
+                    char *expanded = NULL;
+                    size_t len = 0;
+                    FILE *out = open_memstream(&expanded, &len);
+                    if (!out) {
+                        perror("printf");
+                        return 1;
+                    }
+                    for (const char *e = arg ? arg : ""; *e; e++) {
+                        if (*e == '\\') {
+                            e += print_escape(out, e + 1);
+                        } else {
+                            fputc(*e, out);
+                        }
+                    }
+                    fclose(out);
+                    spec[n + 1] = 's';
+                    spec[n + 2] = '\0';
+                    printf(spec, expanded);
+                    free(expanded);
+                    break;
+                }
+                case 'c':
+                    //no character, only the padding, never a NUL byte
+                    spec[n + 1] = arg && arg[0] ? 'c' : 's';
+                    spec[n + 2] = '\0';
+                    if (arg && arg[0]) {
+                        printf(spec, arg[0]);
+                    } else {
+                        printf(spec, "");
+                    }
+                    break;
+                case 'd': case 'i': case 'u': case 'x': case 'X': case 'o': {
+                    char *end = NULL;
+                    long long val = arg ? strtoll(arg, &end, 0) : 0;
+                    if (arg && (*end != '\0' || end == arg)) {
+                        fprintf(stderr, "printf: %s: invalid number\n", arg);
+                        rc = 1;
+                    }
+                    spec[n + 1] = 'l';
+                    spec[n + 2] = 'l';
+                    spec[n + 3] = conv;
+                    spec[n + 4] = '\0';
+                    printf(spec, val);
+                    break;
+                }
+                default:
+                    fprintf(stderr, "printf: %%%c: invalid conversion\n", conv);
+                    return 2;
+            }
+            f += n + 1;
+        }
+    } while (a > 2 && a < cmd->argc);
+
+    return rc;
+}
+
+static bool test_file(const char *op, const char *path) {
+    struct stat st;
+
+    switch (op[1]) {
+        case 'e': return stat(path, &st) == 0;
+        case 'f': return stat(path, &st) == 0 && S_ISREG(st.st_mode);
+        case 'd': return stat(path, &st) == 0 && S_ISDIR(st.st_mode);
+        case 's': return stat(path, &st) == 0 && st.st_size > 0;
+        case 'L': return lstat(path, &st) == 0 && S_ISLNK(st.st_mode);
+        case 'r': return access(path, R_OK) == 0;
+        case 'w': return access(path, W_OK) == 0;
+        case 'x': return access(path, X_OK) == 0;
+        default:  return false;
+    }
+}
+
+//0 true, 1 false, 2 usage error
+static int test_expr(char **argv, int argc) {
+    if (argc > 0 && strcmp(argv[0], "!") == 0) {
+        int rc = test_expr(argv + 1, argc - 1);
+        return rc == 2 ? 2 : !rc;
+    }
+
+    switch (argc) {
+        case 0:
+            return 1;
+        case 1:
+            return argv[0][0] == '\0';
+        case 2:
+            if (strcmp(argv[0], "-n") == 0) return argv[1][0] == '\0';
+            if (strcmp(argv[0], "-z") == 0) return argv[1][0] != '\0';
+            if (argv[0][0] == '-' && strchr("efdsLrwx", argv[0][1]) && argv[0][2] == '\0') {
+                return !test_file(argv[0], argv[1]);
+            }
+            break;
+        case 3: {
+            const char *op = argv[1];
+            if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0) return strcmp(argv[0], argv[2]) != 0;
+            if (strcmp(op, "!=") == 0) return strcmp(argv[0], argv[2]) == 0;
+
+            const char *int_ops[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+            for (int i = 0; i < 6; i++) {
+                if (strcmp(op, int_ops[i]) != 0) continue;
+
+                char *end_l, *end_r;
+                long l = strtol(argv[0], &end_l, 10);
+                long r = strtol(argv[2], &end_r, 10);
+                if (*end_l != '\0' || *end_r != '\0' || end_l == argv[0] || end_r == argv[2]) {
+                    fprintf(stderr, "test: integer expression expected\n");
+                    return 2;
+                }
+                bool res[] = {l == r, l != r, l < r, l <= r, l > r, l >= r};
+                return !res[i];
+            }
+            break;
+        }
+        default:
+            break;
+    }
+
+    fprintf(stderr, "test: unsupported expression\n");
+    return 2;
+}
+
+static int bi_test(cmd_buff_t *cmd) {
+    int argc = cmd->argc - 1;
+
+    if (strcmp(cmd->argv[0], "[") == 0) {
+        if (argc == 0 || strcmp(cmd->argv[argc], "]") != 0) {
+            fprintf(stderr, "[: missing ]\n");
+            return 2;
+        }
+        argc--;
+    }
+    return test_expr(cmd->argv + 1, argc);
+}
+
+static void fast_bi_init(void) {
+    fast_bi_register("true", bi_true);
+    fast_bi_register("false", bi_false);
+    fast_bi_register("echo", bi_echo);
+    fast_bi_register("pwd", bi_pwd);
+    fast_bi_register("printf", bi_printf);
+    fast_bi_register("test", bi_test);
+    fast_bi_register("[", bi_test);
+    fast_bi_ready = true;
+    plugins_load();
+}
+
+const fast_bi_t *fast_bi_lookup(const char *name) {
+    if (!fast_bi_ready) fast_bi_init();
+
+    fast_bi_t *bi = fast_bi_slot(name);
+    if (!bi || !bi->name) return NULL;
+    if (bi->fn && dsh_opts.forkall) return NULL;
+    return bi;
+}
+
+/*
+ * fast_bi_call(bi, cmd)
+ *      Runs the command against whatever stdin/stdout currently are, this
+ *      is all a forked pipeline stage needs.  Returns its exit code.
+ */
+int fast_bi_call(const fast_bi_t *bi, cmd_buff_t *cmd) {
+    int rc = bi->fn ? bi->fn(cmd) : bi->plugin_fn(cmd, STDIN_FILENO, STDOUT_FILENO);
+
+    fflush(stdout);
+    return rc;
+}
+
+//points fd at the redirect target, the old fd is kept in *saved
+static int redirect_fd(int fd, int target, const char *what, int *saved) {
+    if (target < 0) {
+        perror(what);
+        return ERR_EXEC_CMD;
+    }
+
+    *saved = dup(fd);
+    if (*saved < 0 || dup2(target, fd) < 0) {
+        perror("dup");
+        close(target);
+        return ERR_EXEC_CMD;
+    }
+    close(target);
+    return OK;
+}
+
+static void restore_fd(int fd, int saved) {
+    if (saved < 0) return;
+    dup2(saved, fd);
+    close(saved);
+}
+
+/*
+ * fast_bi_run(bi, cmd)
+ *      Runs a fast built-in inside the shell process.  Redirections are
+ *      applied to the shell's own stdin/stdout for the duration of the
+ *      call.  Anything the shell already had buffered for stdout is
+ *      written out first so it still goes where it was meant to go.
+ *      Returns the exit code of the command.
+ */
+int fast_bi_run(const fast_bi_t *bi, cmd_buff_t *cmd) {
+    int saved_in = -1, saved_out = -1, rc;
+
+    fflush(stdout);
+    if (cmd->input_file &&
+        redirect_fd(STDIN_FILENO, open_input_file(cmd), "open input file", &saved_in) != OK) {
+        return 1;
+    }
+    if (cmd->output_file &&
+        redirect_fd(STDOUT_FILENO, open_output_file(cmd), "open output file", &saved_out) != OK) {
+        restore_fd(STDIN_FILENO, saved_in);
+        return 1;
+    }
+
+    rc = fast_bi_call(bi, cmd);
+
+    restore_fd(STDOUT_FILENO, saved_out);
+    restore_fd(STDIN_FILENO, saved_in);
+    return rc;
+}
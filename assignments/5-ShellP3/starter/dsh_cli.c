@@ -1,13 +1,49 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "dshlib.h"
 
-/* DO NOT EDIT
- * main() logic moved to exec_local_cmd_loop() in dshlib.c
+static void print_usage(const char *progname) {
+  printf("Usage: %s [-z] [-c CMDS | SCRIPT] [-h]\n", progname);
+  printf("  Default is to run %s interactively reading stdin\n", progname);
+  printf("  -c CMDS       Run the newline separated commands in CMDS and exit\n");
+  printf("  SCRIPT        Run the commands in the file SCRIPT and exit\n");
+  printf("  -z            Start commands from a zygote process forked at startup\n");
+  printf("  -h            Show this help message\n");
+}
+
+/*
+ * main() logic moved to exec_local_cmd_loop() in dshlib.c, -c and script
+ * mode run without a prompt.  Every mode exits with the status of the
+ * last command, or N from `exit N`.
 */
-int main(){
+int main(int argc, char *argv[]){
+  int opt;
+
+  while ((opt = getopt(argc, argv, "+c:hz")) != -1) {
+    switch (opt) {
+      case 'c':
+        return exec_cmd_string(optarg);
+      case 'z':
+        // must happen before anything else makes the shell bigger
+        zygote_start();
+        break;
+      case 'h':
+        print_usage(argv[0]);
+        return 0;
+      default:
+        print_usage(argv[0]);
+        return 2;
+    }
+  }
+
+  if (optind < argc) {
+    return exec_script_file(argv[optind]);
+  }
+
   int rc = exec_local_cmd_loop();
   printf("cmd loop returned %d\n", rc);
-}
\ No newline at end of file
+  return rc == OK ? dsh_last_rc : EXIT_FAILURE;
+}
@@ -0,0 +1,201 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <stdio_ext.h>
+
+#include "dshlib.h"
+
+/*
+ * Event loop core of the interactive shell.
+ *
+ * While dsh sits at the prompt it waits in epoll_wait() on three fds
+ * instead of blocking in a read of the terminal:
+ *
+ *      stdin           the user typed something
+ *      signalfd        SIGCHLD, owned by dsh_jobs.c; finished background
+ *                      jobs are reported right away instead of at the next
+ *                      prompt, then the line being typed is redrawn
+ *      timerfd         `set tmout=SECONDS`: the shell exits when no
+ *                      command was entered for that long
+ *
+ * Signals arrive as data on the signalfd, so the whole reaction happens
+ * in normal program flow and there is no handler that could interrupt
+ * the parser or stdio halfway.
+ *
+ * Both line readers wait here, hist_readline() before every key and
+ * ev_readline() (used when the editor is off) before every read().  The
+ * latter keeps its own input buffer instead of using fgets(), because data
+ * already sitting in a stdio buffer would not wake up epoll.
+ *
+ * A stdin that epoll refuses (a regular file) is simply always ready, so
+ * `dsh < cmds.txt` works as before.
+ */
+
+static int  ep_fd = -1;
+static int  timer_fd = -1;
+static bool stdin_pollable = false;
+
+static struct {
+    char    data[EV_READ_SZ];
+    size_t  start;
+    size_t  len;
+} in;
+
+static int ev_add(int fd) {
+    struct epoll_event ev = {.events = EPOLLIN, .data.fd = fd};
+    return epoll_ctl(ep_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+int ev_init(void) {
+    ep_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (ep_fd < 0) {
+        perror("epoll_create1");
+        return ERR_MEMORY;
+    }
+
+    timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd < 0 || ev_add(timer_fd) < 0 || ev_add(jobs_signal_fd()) < 0) {
+        perror("event loop");
+        ev_close();
+        return ERR_MEMORY;
+    }
+
+    stdin_pollable = ev_add(STDIN_FILENO) == 0;
+    return OK;
+}
+
+void ev_close(void) {
+    if (timer_fd >= 0) close(timer_fd);
+    if (ep_fd >= 0) close(ep_fd);
+    timer_fd = ep_fd = -1;
+    stdin_pollable = false;
+}
+
+/*
+ * ev_set_timeout(secs)
+ *      Arms the idle timer, 0 disarms it.  The prompt loop arms it before
+ *      reading a command and disarms it once one was read.
+ */
+void ev_set_timeout(long secs) {
+    struct itimerspec its = {0};
+
+    if (timer_fd < 0) return;
+    its.it_value.tv_sec = secs;
+    timerfd_settime(timer_fd, 0, &its, NULL);
+}
+
+//prints the finished jobs over whatever is on the current line
+static bool ev_notify_jobs(void) {
+    if (!jobs_pending()) return false;
+
+    if (isatty(STDOUT_FILENO)) printf("\r\033[K");
+    jobs_notify();
+    fflush(stdout);
+    return true;
+}
+
+/*
+ * ev_wait_input()
+ *      Blocks until stdin can be read without blocking, handling signals
+ *      and timers meanwhile.
+ *
+ *  Returns:
+ *      EV_INPUT        stdin is ready
+ *      EV_REDRAW       something was printed, the caller should redraw its
+ *                      prompt and line and call again
+ *      EV_TIMEOUT      `set tmout` expired, treat it like end of input
+ */
+int ev_wait_input(void) {
+    struct epoll_event evs[EV_MAX_EVENTS];
+
+    if (ep_fd < 0 || !stdin_pollable) return EV_INPUT;
+
+    while (1) {
+        int n = epoll_wait(ep_fd, evs, EV_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return EV_INPUT;    // let the read find out what is wrong
+        }
+
+        bool input = false, redraw = false;
+        for (int i = 0; i < n; i++) {
+            int fd = evs[i].data.fd;
+
+            if (fd == STDIN_FILENO) {
+                input = true;
+            } else if (fd == jobs_signal_fd()) {
+                redraw |= ev_notify_jobs();
+            } else if (fd == timer_fd) {
+                uint64_t expirations;
+                if (read(timer_fd, &expirations, sizeof(expirations)) > 0) {
+                    printf(CMD_MSG_TMOUT);
+                    fflush(stdout);
+                    return EV_TIMEOUT;
+                }
+            }
+        }
+
+        if (redraw) return EV_REDRAW;
+        if (input) return EV_INPUT;
+    }
+}
+
+//hands out the next buffered line like fgets() would, NULL if there is none
+static char *take_line(char *buff, int size, bool eof) {
+    char *line = in.data + in.start;
+    size_t avail = in.len - in.start;
+    char *nl = memchr(line, '\n', avail);
+    size_t len = nl ? (size_t)(nl - line) + 1 : avail;
+
+    if (avail == 0 || (!nl && !eof && avail < sizeof(in.data) && len < (size_t)size - 1)) {
+        return NULL;
+    }
+    if (len > (size_t)size - 1) len = size - 1;
+
+    memcpy(buff, line, len);
+    buff[len] = '\0';
+    in.start += len;
+    return buff;
+}
+
+/*
+ * ev_readline(prompt, buff, size)
+ *      fgets() replacement for the prompt loop when the line editor is not
+ *      in use.  Prints the prompt and returns the next line, newline
+ *      included, or NULL at end of input or on a timeout.
+ */
+char *ev_readline(const char *prompt, char *buff, int size) {
+    printf("%s", prompt);
+
+    while (1) {
+        if (take_line(buff, size, false)) return buff;
+
+        if (in.start > 0) {
+            memmove(in.data, in.data + in.start, in.len - in.start);
+            in.len -= in.start;
+            in.start = 0;
+        }
+
+        //stdin reads flush a line buffered stdout, so the prompt shows
+        if (__flbf(stdout)) fflush(stdout);
+
+        int ev = ev_wait_input();
+        if (ev == EV_TIMEOUT) return NULL;
+        if (ev == EV_REDRAW) {
+            printf("%s", prompt);
+            continue;
+        }
+
+        ssize_t n = read(STDIN_FILENO, in.data + in.len, sizeof(in.data) - in.len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return take_line(buff, size, true);
+        in.len += n;
+    }
+}
@@ -0,0 +1,364 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <stdio_ext.h>
+
+#include "dshlib.h"
+
+/*
+ * Command substitution, here-strings and here-documents.
+ *
+ * These are expanded on the raw command line before it is parsed:
+ *
+ *      $(cmds)         cmds run in a forked copy of the shell, its output
+ *                      replaces the $(...) with trailing newlines removed
+ *      <<< word        word (quoted or not) plus a newline becomes stdin
+ *      << DELIM        the following input lines up to one that is exactly
+ *                      DELIM become stdin, $(...) in them is expanded
+ *                      unless DELIM was written in quotes
+ *
+ * The output of a substitution is read through a pipe into a buffer that
+ * doubles when it fills up, so capturing a lot of output costs a
+ * logarithmic number of reallocs rather than one per read.
+ *
+ * Here-string and here-document text is written to a memfd_create() file,
+ * it never touches a filesystem.  The operator is rewritten to a plain
+ * `< /proc/self/fd/N` redirect, which every way of starting a command
+ * (fork, zygote, in-process built-in) already knows how to open, and the
+ * memfd is closed once the command line is done.
+ *
+ * The substituted text is parsed like anything typed by hand, so output
+ * that contains `|`, `<`, `>` or `"` is taken as shell syntax.  Text that
+ * goes into a here-string or here-document is not parsed again.
+ */
+
+typedef struct strbuf {
+    char    *data;
+    size_t  len;
+    size_t  cap;
+} strbuf_t;
+
+static line_source_fn more_input = NULL;
+static void *more_input_ctx = NULL;
+
+//room for at least extra more bytes and the terminating '\0'
+static int sb_reserve(strbuf_t *sb, size_t extra) {
+    if (sb->len + extra + 1 <= sb->cap) return OK;
+
+    size_t cap = sb->cap ? sb->cap : SUBST_READ_SZ;
+    while (sb->len + extra + 1 > cap) cap *= 2;
+
+    char *grown = realloc(sb->data, cap);
+    if (!grown) return ERR_MEMORY;
+    sb->data = grown;
+    sb->cap = cap;
+    return OK;
+}
+
+static int sb_append(strbuf_t *sb, const char *p, size_t len) {
+    if (sb_reserve(sb, len) != OK) return ERR_MEMORY;
+    memcpy(sb->data + sb->len, p, len);
+    sb->len += len;
+    sb->data[sb->len] = '\0';
+    return OK;
+}
+
+/*
+ * expand_set_source(fn, ctx)
+ *      Tells the expander where the lines of a here-document come from,
+ *      each input mode (prompt loop, script, -c) installs its own reader.
+ *      fn gets ctx back and works like fgets().  NULL means there is none.
+ */
+void expand_set_source(line_source_fn fn, void *ctx) {
+    more_input = fn;
+    more_input_ctx = ctx;
+}
+
+bool expand_needed(const char *line) {
+    return strstr(line, SUBST_OPEN) || strstr(line, HEREDOC_OP);
+}
+
+//p is just past "$(", returns the matching ')' or NULL
+static const char *subst_end(const char *p) {
+    bool in_quotes = false;
+    int depth = 1;
+
+    for (; *p; p++) {
+        if (*p == '"') {
+            in_quotes = !in_quotes;
+        } else if (!in_quotes && *p == '(') {
+            depth++;
+        } else if (!in_quotes && *p == ')' && --depth == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * Runs cmds in a forked copy of the shell and appends what it writes to
+ * stdout to out, minus trailing newlines.  The child goes through
+ * exec_cmd_line() so built-ins, pipelines and nested $(...) all work.
+ */
+static int run_subst(const char *cmds, size_t len, strbuf_t *out) {
+    int fds[2], status;
+    pid_t pid;
+
+    char *line = strndup(cmds, len);
+    if (!line) return ERR_MEMORY;
+
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        free(line);
+        return ERR_EXEC_CMD;
+    }
+
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        free(line);
+        return ERR_EXEC_CMD;
+    }
+    if (pid == 0) {
+        __fpurge(stdin);
+        close(fds[0]);
+        dup2(fds[1], STDOUT_FILENO);
+        close(fds[1]);
+        exec_cmd_line(line);
+        fflush(stdout);
+        _exit(dsh_last_rc);
+    }
+
+    free(line);
+    close(fds[1]);
+
+    size_t start = out->len;
+    int rc = OK;
+    while (1) {
+        if (sb_reserve(out, SUBST_READ_SZ) != OK) {
+            rc = ERR_MEMORY;
+            break;
+        }
+        ssize_t n = read(fds[0], out->data + out->len, out->cap - out->len - 1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        out->len += n;
+    }
+    close(fds[0]);
+
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+        // keep waiting
+    }
+
+    while (out->len > start && out->data[out->len - 1] == '\n') out->len--;
+    if (out->data) out->data[out->len] = '\0';
+    return rc;
+}
+
+//copies text to out, running every $(...) in it
+static int expand_subst(const char *text, size_t len, strbuf_t *out) {
+    const char *p = text, *end = text + len;
+
+    while (p < end) {
+        const char *open = memmem(p, end - p, SUBST_OPEN, strlen(SUBST_OPEN));
+        if (!open) return sb_append(out, p, end - p);
+
+        if (sb_append(out, p, open - p) != OK) return ERR_MEMORY;
+
+        const char *close = subst_end(open + strlen(SUBST_OPEN));
+        if (!close || close >= end) {
+            fprintf(stderr, CMD_ERR_SUBST);
+            return ERR_CMD_ARGS_BAD;
+        }
+        int rc = run_subst(open + strlen(SUBST_OPEN), close - open - strlen(SUBST_OPEN), out);
+        if (rc != OK) return rc;
+        p = close + 1;
+    }
+    return OK;
+}
+
+/*
+ * Finds the word starting at *p, which may be in double quotes and may
+ * contain $(...).  *start and *len get the word without its quotes, the
+ * return value points just past it.
+ */
+static const char *read_word(const char *p, const char **start, size_t *len, bool *quoted) {
+    while (isspace((unsigned char)*p)) p++;
+
+    *quoted = *p == '"';
+    if (*quoted) p++;
+    *start = p;
+
+    while (*p) {
+        if (strncmp(p, SUBST_OPEN, strlen(SUBST_OPEN)) == 0) {
+            const char *close = subst_end(p + strlen(SUBST_OPEN));
+            if (!close) break;
+            p = close + 1;
+            continue;
+        }
+        if (*quoted ? *p == '"' : (isspace((unsigned char)*p) || *p == PIPE_CHAR)) break;
+        p++;
+    }
+
+    *len = p - *start;
+    if (*quoted && *p == '"') p++;
+    return p;
+}
+
+//puts text in a fresh memfd and emits a redirect from it in its place
+static int emit_memfd(expansion_t *exp, const char *text, size_t len, strbuf_t *out) {
+    char redirect[64];
+
+    if (exp->nfds >= EXPAND_FDS_MAX) {
+        fprintf(stderr, CMD_ERR_HEREDOC_MAX, EXPAND_FDS_MAX);
+        return ERR_CMD_ARGS_BAD;
+    }
+
+    int fd = memfd_create(HEREDOC_MEMFD_NAME, MFD_CLOEXEC);
+    if (fd < 0) {
+        perror("memfd_create");
+        return ERR_EXEC_CMD;
+    }
+    exp->fds[exp->nfds++] = fd;
+
+    while (len > 0) {
+        ssize_t n = write(fd, text, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("memfd");
+            return ERR_EXEC_CMD;
+        }
+        text += n;
+        len -= n;
+    }
+
+    int n = snprintf(redirect, sizeof(redirect), " < /proc/self/fd/%d ", fd);
+    return sb_append(out, redirect, n);
+}
+
+//<<< word, p is just past the operator
+static const char *here_string(const char *p, expansion_t *exp, strbuf_t *out, int *rc) {
+    strbuf_t text = {0};
+    const char *word;
+    size_t len;
+    bool quoted;
+
+    p = read_word(p, &word, &len, &quoted);
+    *rc = expand_subst(word, len, &text);
+    if (*rc == OK) *rc = sb_append(&text, "\n", 1);
+    if (*rc == OK) *rc = emit_memfd(exp, text.data, text.len, out);
+
+    free(text.data);
+    return p;
+}
+
+//<< DELIM, p is just past the operator
+static const char *here_doc(const char *p, expansion_t *exp, strbuf_t *out, int *rc) {
+    char line[SH_CMD_MAX];
+    strbuf_t text = {0};
+    const char *word;
+    size_t len;
+    bool quoted, found = false;
+
+    p = read_word(p, &word, &len, &quoted);
+    if (len == 0) {
+        fprintf(stderr, CMD_ERR_HEREDOC_DELIM);
+        *rc = ERR_CMD_ARGS_BAD;
+        return p;
+    }
+
+    char *delim = strndup(word, len);
+    if (!delim) {
+        *rc = ERR_MEMORY;
+        return p;
+    }
+
+    *rc = OK;
+    while (*rc == OK && more_input && more_input(line, sizeof(line), more_input_ctx)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (strcmp(line, delim) == 0) {
+            found = true;
+            break;
+        }
+        *rc = quoted ? sb_append(&text, line, strlen(line)) : expand_subst(line, strlen(line), &text);
+        if (*rc == OK) *rc = sb_append(&text, "\n", 1);
+    }
+
+    if (*rc == OK && !found) fprintf(stderr, CMD_WARN_HEREDOC_EOF, delim);
+    if (*rc == OK) *rc = emit_memfd(exp, text.data ? text.data : "", text.len, out);
+
+    free(delim);
+    free(text.data);
+    return p;
+}
+
+/*
+ * expand_line(line, exp)
+ *      Expands $(...), <<< and << in line into exp->line, which the caller
+ *      parses instead of line.  exp->fds are the memfds the rewritten
+ *      redirects point at, they must stay open until the command line has
+ *      run, expand_free() closes them.
+ *
+ *  Returns:
+ *      OK                  exp->line is ready
+ *      ERR_CMD_ARGS_BAD    bad syntax, already reported
+ *      ERR_MEMORY / ERR_EXEC_CMD
+ */
+int expand_line(const char *line, expansion_t *exp) {
+    strbuf_t out = {0};
+    bool in_quotes = false;
+    const char *p = line;
+    int rc = OK;
+
+    memset(exp, 0, sizeof(expansion_t));
+
+    while (*p && rc == OK) {
+        if (strncmp(p, SUBST_OPEN, strlen(SUBST_OPEN)) == 0) {
+            const char *close = subst_end(p + strlen(SUBST_OPEN));
+            if (!close) {
+                fprintf(stderr, CMD_ERR_SUBST);
+                rc = ERR_CMD_ARGS_BAD;
+                break;
+            }
+            rc = expand_subst(p, close + 1 - p, &out);
+            p = close + 1;
+            continue;
+        }
+
+        if (!in_quotes && strncmp(p, HERESTR_OP, strlen(HERESTR_OP)) == 0) {
+            p = here_string(p + strlen(HERESTR_OP), exp, &out, &rc);
+            continue;
+        }
+        if (!in_quotes && strncmp(p, HEREDOC_OP, strlen(HEREDOC_OP)) == 0) {
+            p = here_doc(p + strlen(HEREDOC_OP), exp, &out, &rc);
+            continue;
+        }
+
+        if (*p == '"') in_quotes = !in_quotes;
+        rc = sb_append(&out, p++, 1);
+    }
+
+    if (rc == OK) rc = sb_append(&out, "", 0);
+    exp->line = out.data;
+    if (rc != OK) expand_free(exp);
+    return rc;
+}
+
+void expand_free(expansion_t *exp) {
+    for (int i = 0; i < exp->nfds; i++) {
+        close(exp->fds[i]);
+    }
+    exp->nfds = 0;
+    free(exp->line);
+    exp->line = NULL;
+}
@@ -0,0 +1,290 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+
+#include "dshlib.h"
+
+/*
+ * Pipeline flow meter.
+ *
+ * A junction between two stages is monitored when it is written as `|~`
+ * or when `set -o flowmeter` is on.  Instead of one pipe, a monitored
+ * junction gets two, with a relay in the middle:
+ *
+ *   stage i --pipe--> [relay] --relay pipe--> stage i+1
+ *
+ * One relay process serves every monitored junction of the pipeline.  It
+ * moves the data with splice(), so bytes go pipe to pipe inside the kernel
+ * and never get copied into user space.  For each junction it keeps:
+ *
+ *      bytes           total moved and average throughput
+ *      read blocked    time the junction sat with nothing to read, the
+ *                      upstream stage is not producing fast enough
+ *      write blocked   time it had data but the downstream pipe was full,
+ *                      the downstream stage is not consuming fast enough
+ *      queue depth     bytes sitting in the downstream pipe (FIONREAD),
+ *                      sampled every time the relay wakes up
+ *
+ * A live status line is redrawn on stderr when stderr is a terminal, and a
+ * summary is printed when the last junction sees EOF.
+ */
+
+typedef enum {
+    FLOW_WAIT_NONE,
+    FLOW_WAIT_READ,
+    FLOW_WAIT_WRITE,
+} flow_wait_t;
+
+typedef struct junction {
+    int         in_fd;          // read end of the pipe from stage i
+    int         out_fd;         // write end of the pipe to stage i+1
+    bool        open;
+    flow_wait_t waiting;
+    long long   bytes;
+    double      read_blocked_ms;
+    double      write_blocked_ms;
+    long        queue_max;
+    double      queue_sum;
+    long        queue_samples;
+} junction_t;
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static void fmt_bytes(double bytes, char *buff, size_t len) {
+    const char *units[] = {"B", "K", "M", "G", "T"};
+    int u = 0;
+
+    while (bytes >= 1024 && u < 4) {
+        bytes /= 1024;
+        u++;
+    }
+    snprintf(buff, len, "%.1f%s", bytes, units[u]);
+}
+
+bool flow_junction_monitored(command_list_t *clist, int i) {
+    return dsh_opts.flowmeter || clist->commands[i + 1].flow_in;
+}
+
+int flow_setup(flow_t *flow, command_list_t *clist) {
+    memset(flow, 0, sizeof(flow_t));
+    flow->num = clist->num - 1;
+
+    for (int i = 0; i < flow->num; i++) {
+        flow->relay[i][0] = flow->relay[i][1] = -1;
+        if (!flow_junction_monitored(clist, i)) continue;
+
+        if (pipe(flow->relay[i]) < 0) {
+            perror("pipe");
+            flow_close(flow);
+            return ERR_EXEC_CMD;
+        }
+        if (dsh_opts.pipe_size > 0) {
+            set_pipe_size(flow->relay[i][1], dsh_opts.pipe_size);
+        }
+        flow->monitored[i] = true;
+        flow->active = true;
+    }
+    return OK;
+}
+
+//the fd stage i+1 should read from
+int flow_stage_input(flow_t *flow, int pipes[][2], int junction) {
+    return flow->monitored[junction] ? flow->relay[junction][0] : pipes[junction][0];
+}
+
+void flow_close(flow_t *flow) {
+    for (int i = 0; i < flow->num; i++) {
+        for (int e = 0; e < 2; e++) {
+            if (flow->relay[i][e] >= 0) {
+                close(flow->relay[i][e]);
+                flow->relay[i][e] = -1;
+            }
+        }
+    }
+}
+
+static void sample_queue(junction_t *j) {
+    int queued = 0;
+
+    if (ioctl(j->out_fd, FIONREAD, &queued) == 0) {
+        if (queued > j->queue_max) j->queue_max = queued;
+        j->queue_sum += queued;
+        j->queue_samples++;
+    }
+}
+
+//move as much as the pipes allow without blocking, sets j->waiting
+static void pump(junction_t *j) {
+    while (j->open) {
+        ssize_t n = splice(j->in_fd, NULL, j->out_fd, NULL, FLOW_SPLICE_SZ,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            j->bytes += n;
+            continue;
+        }
+        if (n == 0 || (errno != EAGAIN && errno != EINTR)) {
+            //EOF from upstream or downstream went away (EPIPE)
+            close(j->in_fd);
+            close(j->out_fd);
+            j->open = false;
+            j->waiting = FLOW_WAIT_NONE;
+            return;
+        }
+        if (errno == EINTR) continue;
+
+        //EAGAIN - either nothing to read or no room to write
+        int avail = 0;
+        ioctl(j->in_fd, FIONREAD, &avail);
+        j->waiting = avail > 0 ? FLOW_WAIT_WRITE : FLOW_WAIT_READ;
+        return;
+    }
+}
+
+static void print_status(junction_t *js, int *ids, int n, double elapsed_ms) {
+    char buff[FLOW_LINE_MAX], moved[16], queue[16];
+    size_t used = 0;
+
+    for (int k = 0; k < n && used < sizeof(buff); k++) {
+        junction_t *j = &js[k];
+        fmt_bytes((double)j->bytes, moved, sizeof(moved));
+        fmt_bytes(j->queue_samples ? j->queue_sum / j->queue_samples : 0, queue, sizeof(queue));
+        used += snprintf(buff + used, sizeof(buff) - used, "%s%d>%d %s %.1fM/s q:%s%s",
+                         k ? " | " : "", ids[k] + 1, ids[k] + 2, moved,
+                         j->bytes / 1048576.0 / (elapsed_ms / 1000.0), queue,
+                         j->open ? "" : " done");
+    }
+    fprintf(stderr, "\r[flow] %s\033[K", buff);
+}
+
+static void print_summary(junction_t *js, int *ids, int n, double elapsed_ms) {
+    char moved[16], qavg[16], qmax[16];
+
+    fprintf(stderr, "flowmeter: %.1f ms\n", elapsed_ms);
+    fprintf(stderr, "  %-5s %10s %10s %12s %12s %9s %9s  %s\n", "JUNC", "BYTES", "MB/s",
+            "RD-BLK(ms)", "WR-BLK(ms)", "Q-AVG", "Q-MAX", "BOTTLENECK");
+    for (int k = 0; k < n; k++) {
+        junction_t *j = &js[k];
+        const char *verdict = "-";
+
+        if (j->read_blocked_ms > 2 * j->write_blocked_ms) {
+            verdict = "upstream";
+        } else if (j->write_blocked_ms > 2 * j->read_blocked_ms) {
+            verdict = "downstream";
+        }
+
+        fmt_bytes((double)j->bytes, moved, sizeof(moved));
+        fmt_bytes(j->queue_samples ? j->queue_sum / j->queue_samples : 0, qavg, sizeof(qavg));
+        fmt_bytes((double)j->queue_max, qmax, sizeof(qmax));
+        fprintf(stderr, "  %d>%-3d %10s %10.1f %12.1f %12.1f %9s %9s  %s\n", ids[k] + 1, ids[k] + 2,
+                moved, j->bytes / 1048576.0 / (elapsed_ms / 1000.0), j->read_blocked_ms,
+                j->write_blocked_ms, qavg, qmax, verdict);
+    }
+}
+
+static void relay_main(flow_t *flow, int pipes[][2]) {
+    junction_t js[CMD_MAX - 1];
+    int ids[CMD_MAX - 1];
+    struct pollfd pfds[CMD_MAX - 1];
+    int n = 0, open_count;
+    bool live = isatty(STDERR_FILENO);
+    double start = now_ms(), last_status = start;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    //keep only our ends, otherwise the stages never see EOF
+    for (int i = 0; i < flow->num; i++) {
+        close(pipes[i][1]);
+        if (flow->monitored[i]) {
+            close(flow->relay[i][0]);
+            memset(&js[n], 0, sizeof(junction_t));
+            js[n].in_fd = pipes[i][0];
+            js[n].out_fd = flow->relay[i][1];
+            js[n].open = true;
+            fcntl(js[n].in_fd, F_SETFL, O_NONBLOCK);
+            fcntl(js[n].out_fd, F_SETFL, O_NONBLOCK);
+            ids[n++] = i;
+        } else {
+            close(pipes[i][0]);
+        }
+    }
+    open_count = n;
+
+    while (open_count > 0) {
+        int npfds = 0;
+
+        for (int k = 0; k < n; k++) {
+            if (!js[k].open) continue;
+            pump(&js[k]);
+            if (!js[k].open) {
+                open_count--;
+                continue;
+            }
+            sample_queue(&js[k]);
+        }
+
+        int map[CMD_MAX - 1];
+        for (int k = 0; k < n; k++) {
+            if (!js[k].open) continue;
+            pfds[npfds].fd = js[k].waiting == FLOW_WAIT_WRITE ? js[k].out_fd : js[k].in_fd;
+            pfds[npfds].events = js[k].waiting == FLOW_WAIT_WRITE ? POLLOUT : POLLIN;
+            map[npfds++] = k;
+        }
+        if (npfds == 0) break;
+
+        double before = now_ms();
+        int rc = poll(pfds, npfds, live ? FLOW_STATUS_MS : -1);
+        double after = now_ms();
+        if (rc < 0 && errno != EINTR) break;
+
+        //charge the time we slept to whatever each junction waited on
+        for (int p = 0; p < npfds; p++) {
+            junction_t *j = &js[map[p]];
+            if (j->waiting == FLOW_WAIT_READ) j->read_blocked_ms += after - before;
+            if (j->waiting == FLOW_WAIT_WRITE) j->write_blocked_ms += after - before;
+        }
+
+        if (live && after - last_status >= FLOW_STATUS_MS) {
+            print_status(js, ids, n, after - start);
+            last_status = after;
+        }
+    }
+
+    if (live) fprintf(stderr, "\r\033[K");
+    print_summary(js, ids, n, now_ms() - start);
+    _exit(0);
+}
+
+/*
+ * Forks the relay process.  Must be called after every pipe exists and
+ * before the parent closes them.  Returns the relay pid, or 0 when no
+ * junction is monitored.
+ */
+pid_t flow_start(flow_t *flow, int pipes[][2], pid_t pgid) {
+    if (!flow->active) return 0;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return 0;
+    }
+    if (pid == 0) {
+        jobs_child_setup(pgid, true);
+        relay_main(flow, pipes);
+    }
+
+    jobs_set_pgid(pid, pgid);
+    return pid;
+}
@@ -0,0 +1,601 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <termios.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#include "dshlib.h"
+
+/*
+ * Persistent command history.
+ *
+ * The history file ($DSH_HISTFILE, default ~/.dsh_history) is a plain
+ * append-only file with one command per line.  It is kept for terminal
+ * sessions, and for any interactive session when DSH_HISTFILE is set.
+ *
+ *      start       the file is mmap'd, the lines are found with memchr()
+ *                  and point straight into the mapping, nothing is copied
+ *      new lines   go into a small arena and a pending batch, the batch
+ *                  is appended to the file every HIST_BATCH_LINES commands
+ *                  and at exit
+ *      sharing     appends happen under flock(LOCK_EX) with O_APPEND.
+ *                  Whatever other shells appended since our last look is
+ *                  mapped and picked up in the same critical section
+ *
+ * Searching uses an inverted trigram index: every 3 byte sequence maps to
+ * the ascending list of history entries containing it.  A query walks the
+ * shortest posting list of its trigrams from the newest entry backwards
+ * and confirms each candidate with memmem(), so it only ever looks at
+ * lines that can match.  Queries shorter than a trigram fall back to a
+ * scan from the newest entry, which stops at the first hit.  The index is
+ * built the first time it is needed, so startup only pays for the mmap.
+ */
+
+typedef struct hist_ent {
+    const char  *text;          // not NUL terminated
+    uint32_t    len;
+} hist_ent_t;
+
+typedef struct posting {
+    uint32_t    key;            // trigram + 1, 0 marks a free slot
+    uint32_t    n;
+    uint32_t    cap;
+    uint32_t    *ids;
+} posting_t;
+
+typedef struct hist_map {
+    void        *addr;
+    size_t      len;
+} hist_map_t;
+
+static int          hist_fd = -1;
+static off_t        hist_file_sz;           // how much of the file we have seen
+
+static hist_ent_t   *ents;
+static uint32_t     ents_n, ents_cap;
+
+static hist_map_t   *maps;
+static uint32_t     maps_n, maps_cap;
+
+static char         *arena;                 // current arena chunk
+static size_t       arena_used = HIST_ARENA_SZ;
+
+static char         *pending;               // batch not written out yet
+static uint32_t     pending_len, pending_cap;
+static int          pending_lines;
+
+static posting_t    *grams;
+static uint32_t     grams_slots, grams_used;
+static uint32_t     indexed_n;              // entries already in the index
+
+static int grow(void **arr, uint32_t *cap, uint32_t need, size_t elem) {
+    if (need <= *cap) return OK;
+
+    uint32_t new_cap = *cap ? *cap : 16;
+    while (new_cap < need) new_cap *= 2;
+
+    void *grown = realloc(*arr, new_cap * elem);
+    if (!grown) return ERR_MEMORY;
+    *arr = grown;
+    *cap = new_cap;
+    return OK;
+}
+
+static int add_ent(const char *text, size_t len) {
+    if (grow((void **)&ents, &ents_cap, ents_n + 1, sizeof(hist_ent_t)) != OK) {
+        return ERR_MEMORY;
+    }
+    ents[ents_n].text = text;
+    ents[ents_n].len = len;
+    ents_n++;
+    return OK;
+}
+
+//maps [from, to) of the history file and adds every line in it
+static int ingest(off_t from, off_t to) {
+    long page = sysconf(_SC_PAGESIZE);
+    off_t base = from - from % page;
+    size_t len = to - base;
+
+    if (to <= from) return OK;
+
+    void *addr = mmap(NULL, len, PROT_READ, MAP_SHARED, hist_fd, base);
+    if (addr == MAP_FAILED) return ERR_MEMORY;
+    madvise(addr, len, MADV_RANDOM);
+
+    if (grow((void **)&maps, &maps_cap, maps_n + 1, sizeof(hist_map_t)) != OK) {
+        munmap(addr, len);
+        return ERR_MEMORY;
+    }
+    maps[maps_n].addr = addr;
+    maps[maps_n].len = len;
+    maps_n++;
+
+    const char *p = (const char *)addr + (from - base), *end = (const char *)addr + len;
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+        const char *line_end = nl ? nl : end;
+        if (line_end > p && add_ent(p, line_end - p) != OK) return ERR_MEMORY;
+        p = line_end + 1;
+    }
+    return OK;
+}
+
+int hist_init(void) {
+    char path[PATH_BUFF_SZ];
+    const char *file = getenv(HIST_FILE_ENV);
+    struct stat st;
+
+    if (hist_fd >= 0) return OK;
+
+    if (file && *file) {
+        snprintf(path, sizeof(path), "%s", file);
+    } else if (isatty(STDIN_FILENO) && getenv("HOME")) {
+        snprintf(path, sizeof(path), "%s/%s", getenv("HOME"), HIST_FILE_NAME);
+    } else {
+        return OK;      // no history for piped input unless asked for
+    }
+
+    hist_fd = open(path, O_RDWR | O_APPEND | O_CREAT | O_CLOEXEC, 0600);
+    if (hist_fd < 0) {
+        perror(path);
+        return ERR_EXEC_CMD;
+    }
+
+    flock(hist_fd, LOCK_SH);
+    if (fstat(hist_fd, &st) == 0) {
+        hist_file_sz = st.st_size;
+        ingest(0, hist_file_sz);
+    }
+    flock(hist_fd, LOCK_UN);
+    return OK;
+}
+
+bool hist_enabled(void) {
+    return hist_fd >= 0;
+}
+
+/*
+ * Writes the pending batch with a single write() while holding the file
+ * lock, after picking up anything other shells appended in the meantime.
+ */
+int hist_flush(void) {
+    struct stat st;
+    int rc = OK;
+
+    if (hist_fd < 0 || pending_len == 0) return OK;
+
+    flock(hist_fd, LOCK_EX);
+    if (fstat(hist_fd, &st) == 0 && st.st_size > hist_file_sz) {
+        ingest(hist_file_sz, st.st_size);
+        hist_file_sz = st.st_size;
+    }
+
+    ssize_t n = write(hist_fd, pending, pending_len);
+    if (n != (ssize_t)pending_len) {
+        rc = ERR_EXEC_CMD;
+    } else {
+        hist_file_sz += n;
+    }
+    flock(hist_fd, LOCK_UN);
+
+    pending_len = 0;
+    pending_lines = 0;
+    return rc;
+}
+
+void hist_add(const char *line) {
+    size_t len = strlen(line);
+
+    if (hist_fd < 0 || len == 0 || len >= HIST_ARENA_SZ) return;
+
+    //skip a command repeated straight away
+    if (ents_n > 0 && ents[ents_n - 1].len == len && memcmp(ents[ents_n - 1].text, line, len) == 0) {
+        return;
+    }
+
+    //arena chunks are never moved or freed, entries point into them
+    if (arena_used + len > HIST_ARENA_SZ) {
+        arena = malloc(HIST_ARENA_SZ);
+        if (!arena) return;
+        arena_used = 0;
+    }
+    memcpy(arena + arena_used, line, len);
+    if (add_ent(arena + arena_used, len) != OK) return;
+    arena_used += len;
+
+    if (grow((void **)&pending, &pending_cap, pending_len + len + 1, 1) != OK) return;
+    memcpy(pending + pending_len, line, len);
+    pending[pending_len + len] = '\n';
+    pending_len += len + 1;
+
+    if (++pending_lines >= HIST_BATCH_LINES) {
+        hist_flush();
+    }
+}
+
+void hist_close(void) {
+    if (hist_fd < 0) return;
+
+    hist_flush();
+    for (uint32_t i = 0; i < maps_n; i++) {
+        munmap(maps[i].addr, maps[i].len);
+    }
+    close(hist_fd);
+    hist_fd = -1;
+}
+
+int hist_count(void) {
+    return ents_n;
+}
+
+const char *hist_line(int id, int *len) {
+    if (id < 0 || (uint32_t)id >= ents_n) return NULL;
+    *len = ents[id].len;
+    return ents[id].text;
+}
+
+static uint32_t gram_key(const char *p) {
+    return ((uint32_t)(unsigned char)p[0] << 16 | (uint32_t)(unsigned char)p[1] << 8 |
+            (unsigned char)p[2]) + 1;
+}
+
+static posting_t *gram_find(uint32_t key, bool create) {
+    if (grams_slots == 0) {
+        if (!create) return NULL;
+        grams = calloc(HIST_GRAM_SLOTS, sizeof(posting_t));
+        if (!grams) return NULL;
+        grams_slots = HIST_GRAM_SLOTS;
+    }
+
+    uint32_t mask = grams_slots - 1, slot = (key * 2654435761u) & mask;
+    while (grams[slot].key != 0 && grams[slot].key != key) {
+        slot = (slot + 1) & mask;
+    }
+    if (grams[slot].key == key) return &grams[slot];
+    if (!create) return NULL;
+
+    //keep the table at most half full, rehash into a bigger one
+    if ((grams_used + 1) * 2 > grams_slots) {
+        posting_t *old = grams;
+        uint32_t old_slots = grams_slots;
+
+        grams = calloc(old_slots * 2, sizeof(posting_t));
+        if (!grams) {
+            grams = old;
+            return NULL;
+        }
+        grams_slots = old_slots * 2;
+        mask = grams_slots - 1;
+        for (uint32_t i = 0; i < old_slots; i++) {
+            if (old[i].key == 0) continue;
+            uint32_t s = (old[i].key * 2654435761u) & mask;
+            while (grams[s].key != 0) s = (s + 1) & mask;
+            grams[s] = old[i];
+        }
+        free(old);
+        return gram_find(key, true);
+    }
+
+    grams[slot].key = key;
+    grams_used++;
+    return &grams[slot];
+}
+
+//brings the index up to date with every entry we know about
+static void index_update(void) {
+    for (; indexed_n < ents_n; indexed_n++) {
+        hist_ent_t *e = &ents[indexed_n];
+
+        for (uint32_t i = 0; i + HIST_NGRAM <= e->len; i++) {
+            posting_t *p = gram_find(gram_key(e->text + i), true);
+            if (!p) return;
+            //a trigram seen twice in one line is only listed once
+            if (p->n > 0 && p->ids[p->n - 1] == indexed_n) continue;
+            if (grow((void **)&p->ids, &p->cap, p->n + 1, sizeof(uint32_t)) != OK) return;
+            p->ids[p->n++] = indexed_n;
+        }
+    }
+}
+
+static bool ent_matches(uint32_t id, const char *q, size_t qlen) {
+    return memmem(ents[id].text, ents[id].len, q, qlen) != NULL;
+}
+
+/*
+ * hist_search(q, before)
+ *      Finds the newest entry older than `before` that contains q.  Pass
+ *      hist_count() to start from the newest entry.  Returns the entry id,
+ *      or -1 if there is none.
+ */
+int hist_search(const char *q, int before) {
+    size_t qlen = strlen(q);
+
+    if (before > (int)ents_n) before = ents_n;
+    if (qlen == 0 || before <= 0) return -1;
+
+    if (qlen < HIST_NGRAM) {
+        for (int id = before - 1; id >= 0; id--) {
+            if (ent_matches(id, q, qlen)) return id;
+        }
+        return -1;
+    }
+
+    index_update();
+
+    //the rarest trigram of the query gives the fewest candidates
+    posting_t *best = NULL;
+    for (size_t i = 0; i + HIST_NGRAM <= qlen; i++) {
+        posting_t *p = gram_find(gram_key(q + i), false);
+        if (!p) return -1;
+        if (!best || p->n < best->n) best = p;
+    }
+
+    //first posting at or after `before`
+    uint32_t lo = 0, hi = best->n;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+        if (best->ids[mid] < (uint32_t)before) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    while (lo-- > 0) {
+        if (ent_matches(best->ids[lo], q, qlen)) return best->ids[lo];
+    }
+    return -1;
+}
+
+static void print_ent(FILE *out, int id) {
+    fprintf(out, "%5d  %.*s\n", id + 1, (int)ents[id].len, ents[id].text);
+}
+
+/*
+ * history             list every entry
+ * history N           the last N entries
+ * history -s TEXT     entries containing TEXT, using the index
+ */
+int history_builtin(cmd_buff_t *cmd) {
+    int first = 0;
+
+    if (cmd->argc >= 3 && strcmp(cmd->argv[1], "-s") == 0) {
+        int n = 0, *hits = malloc(sizeof(int) * (ents_n ? ents_n : 1));
+        if (!hits) return 1;
+
+        for (int id = hist_search(cmd->argv[2], ents_n); id >= 0; id = hist_search(cmd->argv[2], id)) {
+            hits[n++] = id;
+        }
+        while (n-- > 0) print_ent(stdout, hits[n]);
+        free(hits);
+        return 0;
+    }
+
+    if (cmd->argc == 2) {
+        char *end;
+        long n = strtol(cmd->argv[1], &end, 10);
+        if (*end != '\0' || n < 0) {
+            fprintf(stderr, CMD_ERR_HIST_USAGE);
+            return 2;
+        }
+        if (n < (long)ents_n) first = ents_n - n;
+    } else if (cmd->argc > 2) {
+        fprintf(stderr, CMD_ERR_HIST_USAGE);
+        return 2;
+    }
+
+    for (uint32_t id = first; id < ents_n; id++) {
+        print_ent(stdout, id);
+    }
+    return 0;
+}
+
+/*
+ * Line editor used when stdin is a terminal.
+ *
+ *      Up / Down       walk through history
+ *      CTRL-R          reverse incremental search: type to narrow, CTRL-R
+ *                      again for the next older match, Enter runs it, ESC
+ *                      or CTRL-G gives the original line back, anything
+ *                      else keeps the match for editing
+ *      CTRL-C          throw the line away
+ *      CTRL-D          end of input on an empty line
+ *
+ * Editing only happens at the end of the line.
+ */
+
+#define KEY_CTRL(c) ((c) & 0x1f)
+#define KEY_ESC     0x1b
+#define KEY_DEL     0x7f
+
+static void redraw(const char *prompt, const char *buff) {
+    printf("\r\033[K%s%s", prompt, buff);
+    fflush(stdout);
+}
+
+static void redraw_search(const char *q, int id, bool failed) {
+    int len = 0;
+    const char *text = id >= 0 ? hist_line(id, &len) : "";
+
+    printf("\r\033[K(%sreverse-i-search)`%s': %.*s", failed ? "failed " : "", q, len, text);
+    fflush(stdout);
+}
+
+static void set_line(char *buff, int size, int id) {
+    int len = 0;
+    const char *text = hist_line(id, &len);
+
+    if (!text) {
+        buff[0] = '\0';
+        return;
+    }
+    if (len >= size) len = size - 1;
+    memcpy(buff, text, len);
+    buff[len] = '\0';
+}
+
+static int read_key(void) {
+    unsigned char c;
+    ssize_t n;
+
+    while ((n = read(STDIN_FILENO, &c, 1)) < 0 && errno == EINTR);
+    return n == 1 ? c : -1;
+}
+
+//read_key() for the line editor, waits in the event loop (dsh_events.c)
+//and redraws the line if a job notification was printed over it
+static int next_key(const char *prompt, const char *buff) {
+    while (1) {
+        switch (ev_wait_input()) {
+            case EV_INPUT:
+                return read_key();
+            case EV_REDRAW:
+                redraw(prompt, buff);
+                break;
+            default:
+                return -1;
+        }
+    }
+}
+
+//after ESC: returns 'A'/'B'/... for arrow keys, 0 for anything else
+static int read_escape(void) {
+    struct termios t;
+    int c = 0;
+
+    //a lone ESC must not block, wait a tenth of a second for the rest
+    tcgetattr(STDIN_FILENO, &t);
+    t.c_cc[VMIN] = 0;
+    t.c_cc[VTIME] = 1;
+    tcsetattr(STDIN_FILENO, TCSANOW, &t);
+
+    if (read_key() == '[') c = read_key();
+
+    t.c_cc[VMIN] = 1;
+    t.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSANOW, &t);
+    return c > 0 ? c : 0;
+}
+
+//returns the key that ended the search, buff holds the chosen line
+static int search_mode(char *buff, int size) {
+    char q[SH_CMD_MAX] = "", saved[SH_CMD_MAX];
+    int qlen = 0, id = -1, key;
+
+    snprintf(saved, sizeof(saved), "%s", buff);
+    redraw_search(q, id, false);
+
+    while ((key = read_key()) >= 0) {
+        if (key == KEY_CTRL('R')) {
+            if (qlen > 0) {
+                int older = hist_search(q, id >= 0 ? id : hist_count());
+                if (older >= 0) id = older;
+            }
+        } else if (key == KEY_DEL || key == KEY_CTRL('H')) {
+            if (qlen > 0) q[--qlen] = '\0';
+            id = qlen ? hist_search(q, hist_count()) : -1;
+        } else if (key >= ' ' && key < KEY_DEL && qlen < (int)sizeof(q) - 1) {
+            q[qlen++] = key;
+            q[qlen] = '\0';
+            //a longer query can only match the current line or older ones
+            id = hist_search(q, id >= 0 ? id + 1 : hist_count());
+        } else {
+            break;
+        }
+        redraw_search(q, id, qlen > 0 && id < 0);
+    }
+
+    if (key == KEY_ESC || key == KEY_CTRL('G') || key == KEY_CTRL('C')) {
+        if (key == KEY_ESC) read_escape();
+        snprintf(buff, size, "%s", saved);
+    } else if (id >= 0) {
+        set_line(buff, size, id);
+    }
+    return key;
+}
+
+/*
+ * hist_readline(prompt, buff, size)
+ *      Prints the prompt and reads one line into buff with the editor
+ *      above.  The terminal is only in raw mode while a line is read, so
+ *      commands run with the normal settings.  Returns buff, or NULL at
+ *      end of input.
+ */
+char *hist_readline(const char *prompt, char *buff, int size) {
+    struct termios orig, raw;
+    int len = 0, browse = hist_count(), key;
+    char *result = buff;
+
+    if (tcgetattr(STDIN_FILENO, &orig) < 0) {
+        printf("%s", prompt);
+        return fgets(buff, size, stdin);
+    }
+    raw = orig;
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_iflag &= ~(IXON | ICRNL);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+
+    buff[0] = '\0';
+    redraw(prompt, buff);
+
+    while (1) {
+        key = next_key(prompt, buff);
+        if (key == KEY_CTRL('R')) {
+            key = search_mode(buff, size);
+            len = strlen(buff);
+            redraw(prompt, buff);
+            if (key == '\r' || key == '\n') break;
+            if (key == KEY_ESC || key == KEY_CTRL('G') || key == KEY_CTRL('C')) continue;
+            //any other key is handled as if typed on the line
+        }
+
+        if (key < 0 || (key == KEY_CTRL('D') && len == 0)) {
+            result = NULL;
+            break;
+        } else if (key == '\r' || key == '\n') {
+            break;
+        } else if (key == KEY_CTRL('C')) {
+            printf("^C\n");
+            buff[len = 0] = '\0';
+            browse = hist_count();
+            redraw(prompt, buff);
+        } else if (key == KEY_DEL || key == KEY_CTRL('H')) {
+            if (len > 0) buff[--len] = '\0';
+            redraw(prompt, buff);
+        } else if (key == KEY_ESC) {
+            int arrow = read_escape();
+            if (arrow == 'A' && browse > 0) {
+                set_line(buff, size, --browse);
+            } else if (arrow == 'B' && browse < hist_count()) {
+                browse++;
+                set_line(buff, size, browse);
+            }
+            len = strlen(buff);
+            redraw(prompt, buff);
+        } else if (key >= ' ' && key != KEY_DEL && len < size - 2) {
+            buff[len++] = key;
+            buff[len] = '\0';
+            putchar(key);
+            fflush(stdout);
+        }
+    }
+
+    tcsetattr(STDIN_FILENO, TCSAFLUSH, &orig);
+    if (result) {
+        printf("\n");
+        fflush(stdout);
+    }
+    return result;
+}
@@ -0,0 +1,479 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/signalfd.h>
+
+#include "dshlib.h"
+
+/*
+ * Job control for dsh.
+ *
+ * Every pipeline execute_pipeline() starts is recorded in a small, fixed
+ * size job table.  Foreground jobs are waited on directly with waitpid(),
+ * background jobs (command line ending in '&') are left running and the
+ * shell goes straight back to the prompt.
+ *
+ * Background children are reaped asynchronously.  SIGCHLD is blocked and
+ * read from a non-blocking signalfd instead of being delivered to a
+ * handler; the main loop later calls jobs_reap() which drains the
+ * signalfd and collects every child that changed state with
+ * waitpid(-1, WNOHANG).  With no handler at all nothing can interrupt the
+ * parser or printf(), and the interactive loop can wait for the signalfd
+ * in the same epoll set as the terminal (see dsh_events.c).
+ *
+ * When stdin is a terminal each job gets its own process group so that
+ * CTRL-C / CTRL-Z only hit the foreground job, and the terminal is handed
+ * back and forth with tcsetpgrp().
+ */
+
+static job_t jobs[JOBS_MAX];
+static int   sigchld_fd = -1;
+static bool  job_control = false;
+static bool  report_jobs = true;
+static pid_t shell_pgid;
+
+int jobs_init(bool interactive) {
+    sigset_t mask;
+
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &mask, NULL);
+
+    sigchld_fd = signalfd(sigchld_fd, &mask, SFD_NONBLOCK | SFD_CLOEXEC);
+    if (sigchld_fd < 0) {
+        perror("signalfd");
+        return ERR_MEMORY;
+    }
+
+    //only do terminal job control when a user is actually typing at us,
+    //scripts also reap finished jobs quietly
+    report_jobs = interactive;
+    job_control = interactive && isatty(STDIN_FILENO);
+    if (job_control) {
+        signal(SIGINT, SIG_IGN);
+        signal(SIGQUIT, SIG_IGN);
+        signal(SIGTSTP, SIG_IGN);
+        signal(SIGTTIN, SIG_IGN);
+        signal(SIGTTOU, SIG_IGN);
+
+        shell_pgid = getpid();
+        if (getpgrp() != shell_pgid && setpgid(0, shell_pgid) < 0) {
+            job_control = false;
+        } else {
+            tcsetpgrp(STDIN_FILENO, shell_pgid);
+        }
+    }
+
+    return OK;
+}
+
+/*
+ * Called in the child right after fork() and before any redirection, puts
+ * the child in the job's process group and undoes the shell's signal setup.
+ */
+void jobs_child_setup(pid_t pgid, bool background) {
+    if (job_control) {
+        setpgid(0, pgid);
+        if (!background) {
+            tcsetpgrp(STDIN_FILENO, pgid ? pgid : getpid());
+        }
+    }
+    jobs_child_signals();
+}
+
+//ignored signals survive exec, so every child has to put them back
+void jobs_child_signals(void) {
+    if (job_control) {
+        signal(SIGINT, SIG_DFL);
+        signal(SIGQUIT, SIG_DFL);
+        signal(SIGTSTP, SIG_DFL);
+        signal(SIGTTIN, SIG_DFL);
+        signal(SIGTTOU, SIG_DFL);
+    }
+    signal(SIGCHLD, SIG_DFL);
+
+    //the blocked mask survives exec too
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &mask, NULL);
+}
+
+//whether children get their own process group and the terminal
+bool jobs_have_control(void) {
+    return job_control;
+}
+
+//parent side of the process group setup, see jobs_child_setup()
+void jobs_set_pgid(pid_t pid, pid_t pgid) {
+    if (job_control) {
+        setpgid(pid, pgid);
+    }
+}
+
+static job_t *find_job_by_pid(pid_t pid, int *stage) {
+    for (int j = 0; j < JOBS_MAX; j++) {
+        if (jobs[j].state == JOB_FREE) continue;
+        for (int i = 0; i < jobs[j].num; i++) {
+            if (jobs[j].pids[i] == pid) {
+                *stage = i;
+                return &jobs[j];
+            }
+        }
+    }
+    return NULL;
+}
+
+static bool job_all_reaped(job_t *job) {
+    for (int i = 0; i < job->num; i++) {
+        if (!job->reaped[i]) return false;
+    }
+    return true;
+}
+
+//record everything we know about a stage that just exited
+static void job_stage_done(job_t *job, int stage, int status, struct rusage *ru) {
+    job->status[stage] = status;
+    job->reaped[stage] = true;
+    job->rusage[stage] = *ru;
+    clock_gettime(CLOCK_MONOTONIC, &job->end[stage]);
+}
+
+static int job_exit_code(job_t *job) {
+    int status = job->status[job->num - 1];
+
+    if (WIFEXITED(status)) return WEXITSTATUS(status);
+    if (WIFSIGNALED(status)) return 128 + WTERMSIG(status);
+    return 0;
+}
+
+//the most recently started job that is still around, used as the default
+//for fg/bg and flagged with '+' in the jobs listing
+static job_t *current_job(void) {
+    job_t *cur = NULL;
+    for (int j = 0; j < JOBS_MAX; j++) {
+        if (jobs[j].state == JOB_FREE || jobs[j].state == JOB_DONE) continue;
+        if (!cur || jobs[j].id > cur->id) cur = &jobs[j];
+    }
+    return cur;
+}
+
+static void describe_cmd(cmd_buff_t *cmd, char *buff, size_t len) {
+    size_t used = 0;
+
+    buff[0] = '\0';
+    for (int a = 0; a < cmd->argc && used < len; a++) {
+        used += snprintf(buff + used, len - used, "%s%s", a ? " " : "", cmd->argv[a]);
+    }
+}
+
+static void describe_job(job_t *job, command_list_t *clist) {
+    size_t used = 0, len = sizeof(job->cmd_line);
+
+    job->cmd_line[0] = '\0';
+    for (int i = 0; i < clist->num; i++) {
+        describe_cmd(&clist->commands[i], job->stage_cmds[i], sizeof(job->stage_cmds[i]));
+        if (used < len) {
+            used += snprintf(job->cmd_line + used, len - used, "%s%s", i ? " | " : "",
+                             job->stage_cmds[i]);
+        }
+    }
+}
+
+job_t *job_add(command_list_t *clist, pid_t *pids, pid_t pgid, struct timespec *start) {
+    job_t *slot = NULL;
+    int next_id = 1;
+
+    for (int j = 0; j < JOBS_MAX; j++) {
+        if (jobs[j].state == JOB_FREE) {
+            if (!slot) slot = &jobs[j];
+        } else if (jobs[j].id >= next_id) {
+            next_id = jobs[j].id + 1;
+        }
+    }
+    if (!slot) {
+        fprintf(stderr, CMD_ERR_JOBS_FULL, JOBS_MAX);
+        return NULL;
+    }
+
+    memset(slot, 0, sizeof(job_t));
+    slot->id = next_id;
+    slot->state = JOB_RUNNING;
+    slot->background = clist->background;
+    slot->timed = clist->timed || dsh_opts.timing;
+    slot->pgid = pgid;
+    slot->num = clist->num;
+    slot->start = *start;
+    memcpy(slot->pids, pids, sizeof(pid_t) * clist->num);
+    describe_job(slot, clist);
+
+    if (slot->background) {
+        printf("[%d] %d\n", slot->id, (int)pids[clist->num - 1]);
+    }
+    return slot;
+}
+
+static void job_continue(job_t *job) {
+    if (job_control) {
+        kill(-job->pgid, SIGCONT);
+    } else {
+        for (int i = 0; i < job->num; i++) {
+            if (!job->reaped[i]) kill(job->pids[i], SIGCONT);
+        }
+    }
+    job->state = JOB_RUNNING;
+}
+
+/*
+ * Blocks until every stage of the job exits, or until the job is stopped
+ * with CTRL-Z in which case it becomes a background job.  Returns the exit
+ * code of the last stage of the pipeline.
+ */
+int job_wait_fg(job_t *job) {
+    int status;
+    pid_t pid;
+    struct rusage ru;
+
+    job->background = false;
+    if (job_control) tcsetpgrp(STDIN_FILENO, job->pgid);
+
+    for (int i = 0; i < job->num && job->state == JOB_RUNNING; i++) {
+        if (job->reaped[i]) continue;
+
+        do {
+            pid = wait4(job->pids[i], &status, job_control ? WUNTRACED : 0, &ru);
+        } while (pid < 0 && errno == EINTR);
+
+        if (pid < 0) {
+            //already collected somewhere else, nothing more to learn
+            job->reaped[i] = true;
+        } else if (WIFSTOPPED(status)) {
+            job->state = JOB_STOPPED;
+        } else {
+            job_stage_done(job, i, status, &ru);
+        }
+    }
+
+    if (job_control) tcsetpgrp(STDIN_FILENO, shell_pgid);
+
+    if (job->state == JOB_STOPPED) {
+        job->background = true;
+        printf("\n[%d]+  Stopped                 %s\n", job->id, job->cmd_line);
+        return 128 + SIGTSTP;
+    }
+
+    job->exit_code = job_exit_code(job);
+    if (job->timed) timing_report(job);
+    job->state = JOB_FREE;
+    return job->exit_code;
+}
+
+//the signalfd the event loop waits on, see dsh_events.c
+int jobs_signal_fd(void) {
+    return sigchld_fd;
+}
+
+/*
+ * Collects every child that changed state since the last call.  Cheap when
+ * nothing happened: the signalfd is empty and waitpid() is never called.
+ */
+void jobs_reap(void) {
+    struct signalfd_siginfo drain[8];
+    bool woken = false;
+    int status, stage;
+    pid_t pid;
+    job_t *job;
+    struct rusage ru;
+
+    while (sigchld_fd >= 0 && read(sigchld_fd, drain, sizeof(drain)) > 0) {
+        woken = true;
+    }
+    if (!woken) return;
+
+    while ((pid = wait4(-1, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0) {
+        job = find_job_by_pid(pid, &stage);
+        if (!job) continue;
+
+        if (WIFSTOPPED(status)) {
+            job->state = JOB_STOPPED;
+        } else if (WIFCONTINUED(status)) {
+            job->state = JOB_RUNNING;
+        } else {
+            job_stage_done(job, stage, status, &ru);
+            if (job_all_reaped(job)) job->state = JOB_DONE;
+        }
+    }
+}
+
+//reaps, then tells whether jobs_notify() has anything to report
+bool jobs_pending(void) {
+    jobs_reap();
+
+    for (int j = 0; j < JOBS_MAX; j++) {
+        if (jobs[j].state == JOB_DONE) return true;
+    }
+    return false;
+}
+
+/*
+ * Prints a line for each background job that finished since the last
+ * prompt and releases its slot.  Non-interactive shells only release.
+ */
+void jobs_notify(void) {
+    jobs_reap();
+
+    for (int j = 0; j < JOBS_MAX; j++) {
+        if (jobs[j].state != JOB_DONE) continue;
+
+        int rc = job_exit_code(&jobs[j]);
+        jobs[j].exit_code = rc;
+        if (!report_jobs) {
+            //nothing to print
+        } else if (rc == 0) {
+            printf("[%d]+  Done                    %s\n", jobs[j].id, jobs[j].cmd_line);
+        } else {
+            printf("[%d]+  Exit %-3d                %s\n", jobs[j].id, rc, jobs[j].cmd_line);
+        }
+        if (jobs[j].timed) timing_report(&jobs[j]);
+        jobs[j].state = JOB_FREE;
+    }
+}
+
+//accepts "%N", "N" or nothing (the current job)
+static job_t *parse_job_spec(cmd_buff_t *cmd, int arg) {
+    if (arg >= cmd->argc) return current_job();
+
+    const char *spec = cmd->argv[arg];
+    if (*spec == '%') spec++;
+    int id = atoi(spec);
+
+    for (int j = 0; j < JOBS_MAX; j++) {
+        if (jobs[j].state != JOB_FREE && jobs[j].id == id) return &jobs[j];
+    }
+    return NULL;
+}
+
+static const char *state_name(job_state_t state) {
+    switch (state) {
+        case JOB_RUNNING: return "Running";
+        case JOB_STOPPED: return "Stopped";
+        case JOB_DONE:    return "Done";
+        default:          return "";
+    }
+}
+
+static int builtin_jobs(void) {
+    job_t *cur;
+
+    jobs_reap();
+    cur = current_job();
+    for (int j = 0; j < JOBS_MAX; j++) {
+        if (jobs[j].state == JOB_FREE) continue;
+        printf("[%d]%c  %-22s  %s%s\n", jobs[j].id, &jobs[j] == cur ? '+' : ' ',
+               state_name(jobs[j].state), jobs[j].cmd_line,
+               jobs[j].state == JOB_RUNNING ? " &" : "");
+    }
+    return OK;
+}
+
+static int builtin_fg(cmd_buff_t *cmd) {
+    job_t *job = parse_job_spec(cmd, 1);
+    if (!job) {
+        fprintf(stderr, CMD_ERR_NO_JOB, cmd->argv[0]);
+        return 1;
+    }
+
+    printf("%s\n", job->cmd_line);
+    fflush(stdout);
+    if (job->state == JOB_DONE) {
+        int rc = job_exit_code(job);
+        job->state = JOB_FREE;
+        return rc;
+    }
+    job_continue(job);
+    return job_wait_fg(job);
+}
+
+static int builtin_bg(cmd_buff_t *cmd) {
+    job_t *job = parse_job_spec(cmd, 1);
+    if (!job || job->state == JOB_DONE) {
+        fprintf(stderr, CMD_ERR_NO_JOB, cmd->argv[0]);
+        return 1;
+    }
+
+    job->background = true;
+    job_continue(job);
+    printf("[%d]+ %s &\n", job->id, job->cmd_line);
+    return OK;
+}
+
+static int wait_job(job_t *job) {
+    int status;
+    pid_t pid;
+    struct rusage ru;
+
+    for (int i = 0; i < job->num; i++) {
+        if (job->reaped[i]) continue;
+        do {
+            pid = wait4(job->pids[i], &status, 0, &ru);
+        } while (pid < 0 && errno == EINTR);
+
+        if (pid > 0) {
+            job_stage_done(job, i, status, &ru);
+        } else {
+            job->reaped[i] = true;
+        }
+    }
+
+    job->exit_code = job_exit_code(job);
+    if (job->timed) timing_report(job);
+    job->state = JOB_FREE;
+    return job->exit_code;
+}
+
+//wait with no arguments waits for every background job
+static int builtin_wait(cmd_buff_t *cmd) {
+    int rc = 0;
+
+    if (cmd->argc < 2) {
+        for (int j = 0; j < JOBS_MAX; j++) {
+            if (jobs[j].state == JOB_RUNNING || jobs[j].state == JOB_DONE) {
+                rc = wait_job(&jobs[j]);
+            }
+        }
+        return rc;
+    }
+
+    for (int a = 1; a < cmd->argc; a++) {
+        job_t *job = parse_job_spec(cmd, a);
+        if (!job) {
+            fprintf(stderr, CMD_ERR_NO_JOB, cmd->argv[a]);
+            rc = 127;
+            continue;
+        }
+        rc = wait_job(job);
+    }
+    return rc;
+}
+
+int jobs_builtin(Built_In_Cmds cmd_type, cmd_buff_t *cmd) {
+    switch (cmd_type) {
+        case BI_CMD_JOBS:
+            return builtin_jobs();
+        case BI_CMD_FG:
+            return builtin_fg(cmd);
+        case BI_CMD_BG:
+            return builtin_bg(cmd);
+        case BI_CMD_WAIT:
+            return builtin_wait(cmd);
+        default:
+            return ERR_CMD_ARGS_BAD;
+    }
+}
@@ -0,0 +1,147 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "dshlib.h"
+
+/*
+ * Shell options and the `set` built-in.
+ *
+ *      set                     list every option and its value
+ *      set -o NAME             turn a boolean option on
+ *      set +o NAME             turn a boolean option off
+ *      set NAME=VALUE          set a valued option, sizes take a K/M/G
+ *                              suffix, e.g. set pipesz=1M
+ *      set -e / set +e         short form of set -o errexit / set +o errexit
+ *
+ * All options live in the global dsh_opts structure so the rest of the
+ * shell can just read a field.  Adding an option means adding a field and
+ * a row to opt_table below.
+ */
+
+dsh_opts_t dsh_opts;
+
+typedef enum {
+    OPT_BOOL,
+    OPT_STR,
+    OPT_SIZE,
+} opt_type_t;
+
+typedef struct opt_desc {
+    const char  *name;
+    opt_type_t  type;
+    void        *value;
+    size_t      size;       // buffer size for OPT_STR
+} opt_desc_t;
+
+static const opt_desc_t opt_table[] = {
+    {"errexit", OPT_BOOL, &dsh_opts.errexit, 0},
+    {"timing",  OPT_BOOL, &dsh_opts.timing,  0},
+    {"timelog", OPT_STR,  dsh_opts.time_log, sizeof(dsh_opts.time_log)},
+    {"pipesz",  OPT_SIZE, &dsh_opts.pipe_size, 0},
+    {"flowmeter", OPT_BOOL, &dsh_opts.flowmeter, 0},
+    {"forkall", OPT_BOOL, &dsh_opts.forkall, 0},
+    {"tmout",   OPT_SIZE, &dsh_opts.tmout, 0},     // seconds
+};
+
+#define OPT_TABLE_SZ (int)(sizeof(opt_table) / sizeof(opt_table[0]))
+
+static const opt_desc_t *find_opt(const char *name, size_t len) {
+    for (int i = 0; i < OPT_TABLE_SZ; i++) {
+        if (strlen(opt_table[i].name) == len && strncmp(opt_table[i].name, name, len) == 0) {
+            return &opt_table[i];
+        }
+    }
+    return NULL;
+}
+
+static void print_opts(void) {
+    for (int i = 0; i < OPT_TABLE_SZ; i++) {
+        const opt_desc_t *opt = &opt_table[i];
+        if (opt->type == OPT_BOOL) {
+            printf("set %co %s\n", *(bool *)opt->value ? '-' : '+', opt->name);
+        } else if (opt->type == OPT_SIZE) {
+            printf("set %s=%ld\n", opt->name, *(long *)opt->value);
+        } else {
+            printf("set %s=%s\n", opt->name, (char *)opt->value);
+        }
+    }
+    //stdout may be a pipe, the next command's children write straight to it
+    fflush(stdout);
+}
+
+static int set_bool_opt(const char *name, bool on) {
+    const opt_desc_t *opt = find_opt(name, strlen(name));
+    if (!opt || opt->type != OPT_BOOL) {
+        fprintf(stderr, CMD_ERR_SET_OPT, name);
+        return ERR_CMD_ARGS_BAD;
+    }
+    *(bool *)opt->value = on;
+    return OK;
+}
+
+//"64K", "1M", "65536" -> bytes, -1 if it does not parse
+static long parse_size(const char *str) {
+    char *end;
+    long val = strtol(str, &end, 10);
+
+    if (end == str || val < 0) return -1;
+    switch (*end) {
+        case 'k': case 'K': val *= 1024; end++; break;
+        case 'm': case 'M': val *= 1024 * 1024; end++; break;
+        case 'g': case 'G': val *= 1024 * 1024 * 1024; end++; break;
+        default: break;
+    }
+    return *end == '\0' ? val : -1;
+}
+
+static int set_value_opt(const char *assignment) {
+    const char *eq = strchr(assignment, '=');
+    const opt_desc_t *opt = find_opt(assignment, eq - assignment);
+
+    if (opt && opt->type == OPT_SIZE) {
+        long val = parse_size(eq + 1);
+        if (val < 0) {
+            fprintf(stderr, CMD_ERR_SET_OPT, assignment);
+            return ERR_CMD_ARGS_BAD;
+        }
+        *(long *)opt->value = val;
+        return OK;
+    }
+    if (!opt || opt->type != OPT_STR) {
+        fprintf(stderr, CMD_ERR_SET_OPT, assignment);
+        return ERR_CMD_ARGS_BAD;
+    }
+    if (strlen(eq + 1) >= opt->size) {
+        fprintf(stderr, CMD_ERR_SET_OPT, assignment);
+        return ERR_CMD_OR_ARGS_TOO_BIG;
+    }
+    strcpy((char *)opt->value, eq + 1);
+    return OK;
+}
+
+int set_builtin(cmd_buff_t *cmd) {
+    int rc = OK;
+
+    if (cmd->argc == 1) {
+        print_opts();
+        return OK;
+    }
+
+    for (int a = 1; a < cmd->argc && rc == OK; a++) {
+        const char *arg = cmd->argv[a];
+
+        if ((strcmp(arg, "-o") == 0 || strcmp(arg, "+o") == 0) && a + 1 < cmd->argc) {
+            rc = set_bool_opt(cmd->argv[++a], arg[0] == '-');
+        } else if (strcmp(arg, "-e") == 0 || strcmp(arg, "+e") == 0) {
+            rc = set_bool_opt("errexit", arg[0] == '-');
+        } else if (strchr(arg, '=')) {
+            rc = set_value_opt(arg);
+        } else {
+            fprintf(stderr, CMD_ERR_SET_OPT, arg);
+            rc = ERR_CMD_ARGS_BAD;
+        }
+    }
+    return rc;
+}
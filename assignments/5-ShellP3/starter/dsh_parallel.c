@@ -0,0 +1,395 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+
+#include "dshlib.h"
+
+/*
+ * parallel [-j N] [-k] [-r RETRIES] cmd [args...] [::: item ...]
+ *
+ * Runs cmd once per item keeping at most N children busy at a time, the
+ * default N being the number of online cores.  Items come from the
+ * arguments after ":::" or, when there is no ":::", one per line from
+ * stdin.  Every "{}" in the command is replaced with the item; if the
+ * command has no "{}" the item is appended as the last argument.
+ *
+ * The stdout and stderr of each child are captured through a pipe into a
+ * per-item buffer so output from different items never interleaves.  The
+ * buffer is printed when the item completes, or in input order with -k.
+ * Items that exit non-zero are put back on the run queue up to RETRIES
+ * times.  A summary with the exit code, attempts and wall time of every
+ * item is printed on stderr at the end.
+ *
+ * The scheduler is a simple poll() loop over the output pipes of the
+ * running children, a child is reaped once its pipe reports EOF.
+ */
+
+typedef enum {
+    PAR_PENDING,
+    PAR_RUNNING,
+    PAR_DONE,
+} par_state_t;
+
+typedef struct par_item {
+    char        *arg;
+    par_state_t state;
+    pid_t       pid;
+    int         out_fd;
+    char        *out;
+    size_t      out_len;
+    size_t      out_cap;
+    int         attempts;
+    int         exit_code;
+    struct timespec start;
+    double      wall_ms;        // summed over every attempt
+} par_item_t;
+
+typedef struct par_opts {
+    int     jobs;
+    int     retries;
+    bool    keep_order;
+    char    **tmpl;             // command template, points into cmd->argv
+    int     tmpl_argc;
+} par_opts_t;
+
+static double elapsed_ms(struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000.0 +
+           (now.tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+//replace every "{}" in tmpl with item, returns a malloc'd string
+static char *expand_arg(const char *tmpl, const char *item) {
+    size_t item_len = strlen(item);
+    size_t len = strlen(tmpl) + 1;
+    const char *p;
+
+    for (p = strstr(tmpl, PAR_ITEM_MARK); p; p = strstr(p + 2, PAR_ITEM_MARK)) {
+        len += item_len;
+    }
+
+    char *out = malloc(len);
+    char *o = out;
+    if (!out) return NULL;
+
+    while ((p = strstr(tmpl, PAR_ITEM_MARK)) != NULL) {
+        memcpy(o, tmpl, p - tmpl);
+        o += p - tmpl;
+        memcpy(o, item, item_len);
+        o += item_len;
+        tmpl = p + 2;
+    }
+    strcpy(o, tmpl);
+    return out;
+}
+
+static void par_exec_child(par_opts_t *opts, par_item_t *item, int out_fd) {
+    char *argv[CMD_ARGV_MAX + 1];
+    bool substituted = false;
+    int argc = 0;
+
+    jobs_child_signals();
+    dup2(out_fd, STDOUT_FILENO);
+    dup2(out_fd, STDERR_FILENO);
+    close(out_fd);
+
+    for (int i = 0; i < opts->tmpl_argc; i++) {
+        if (strstr(opts->tmpl[i], PAR_ITEM_MARK)) {
+            argv[argc++] = expand_arg(opts->tmpl[i], item->arg);
+            substituted = true;
+        } else {
+            argv[argc++] = opts->tmpl[i];
+        }
+    }
+    if (!substituted) argv[argc++] = item->arg;
+    argv[argc] = NULL;
+
+    execvp(argv[0], argv);
+    perror(argv[0]);
+    _exit(127);
+}
+
+static int par_spawn(par_opts_t *opts, par_item_t *item) {
+    int fds[2];
+
+    if (pipe(fds) < 0) {
+        perror("pipe");
+        return ERR_EXEC_CMD;
+    }
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+    item->pid = fork();
+    if (item->pid < 0) {
+        perror("fork");
+        close(fds[0]);
+        close(fds[1]);
+        return ERR_EXEC_CMD;
+    }
+    if (item->pid == 0) {
+        close(fds[0]);
+        par_exec_child(opts, item, fds[1]);
+    }
+
+    close(fds[1]);
+    item->out_fd = fds[0];
+    item->out_len = 0;
+    item->state = PAR_RUNNING;
+    item->attempts++;
+    clock_gettime(CLOCK_MONOTONIC, &item->start);
+    return OK;
+}
+
+//drain whatever the child has written so far, returns false on EOF
+static bool par_collect(par_item_t *item) {
+    ssize_t n;
+
+    if (item->out_cap - item->out_len < PAR_READ_SZ) {
+        size_t cap = item->out_cap ? item->out_cap * 2 : PAR_READ_SZ * 2;
+        char *grown = realloc(item->out, cap);
+        if (!grown) return false;
+        item->out = grown;
+        item->out_cap = cap;
+    }
+
+    do {
+        n = read(item->out_fd, item->out + item->out_len, item->out_cap - item->out_len);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) return false;
+    item->out_len += n;
+    return true;
+}
+
+static void par_write_all(int fd, const char *buff, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(fd, buff, len);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        buff += n;
+        len -= n;
+    }
+}
+
+static void par_print_summary(par_item_t *items, int n, int retried, double total_ms) {
+    int failed = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (items[i].exit_code != 0) failed++;
+    }
+
+    fprintf(stderr, "parallel: %d items, %d ok, %d failed, %d retried, %.1f ms wall\n",
+            n, n - failed, failed, retried, total_ms);
+    fprintf(stderr, "  %-5s %-5s %-10s %s\n", "EXIT", "TRIES", "WALL(ms)", "ITEM");
+    for (int i = 0; i < n; i++) {
+        fprintf(stderr, "  %-5d %-5d %-10.1f %s\n", items[i].exit_code,
+                items[i].attempts, items[i].wall_ms, items[i].arg);
+    }
+}
+
+static int par_parse_opts(cmd_buff_t *cmd, par_opts_t *opts, int *items_at) {
+    int a = 1;
+
+    opts->jobs = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (opts->jobs < 1) opts->jobs = 1;
+    opts->retries = PAR_DEF_RETRIES;
+    opts->keep_order = false;
+
+    for (; a < cmd->argc && cmd->argv[a][0] == '-'; a++) {
+        if (strcmp(cmd->argv[a], "-k") == 0) {
+            opts->keep_order = true;
+        } else if (strcmp(cmd->argv[a], "-j") == 0 && a + 1 < cmd->argc) {
+            opts->jobs = atoi(cmd->argv[++a]);
+        } else if (strcmp(cmd->argv[a], "-r") == 0 && a + 1 < cmd->argc) {
+            opts->retries = atoi(cmd->argv[++a]);
+        } else {
+            return ERR_CMD_ARGS_BAD;
+        }
+    }
+    if (opts->jobs < 1 || opts->retries < 0) return ERR_CMD_ARGS_BAD;
+
+    opts->tmpl = &cmd->argv[a];
+    opts->tmpl_argc = 0;
+    *items_at = -1;
+    for (; a < cmd->argc; a++) {
+        if (strcmp(cmd->argv[a], PAR_ITEMS_SEP) == 0) {
+            *items_at = a + 1;
+            break;
+        }
+        opts->tmpl_argc++;
+    }
+    return opts->tmpl_argc > 0 ? OK : ERR_CMD_ARGS_BAD;
+}
+
+//one item per non-empty line of in
+static par_item_t *par_read_items(FILE *in, int *count) {
+    par_item_t *items = NULL;
+    int n = 0, cap = 0;
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t len;
+
+    while ((len = getline(&line, &line_cap, in)) >= 0) {
+        if (len > 0 && line[len - 1] == '\n') line[--len] = '\0';
+        if (len == 0) continue;
+
+        if (n == cap) {
+            cap = cap ? cap * 2 : 64;
+            par_item_t *grown = realloc(items, sizeof(par_item_t) * cap);
+            if (!grown) break;
+            items = grown;
+        }
+        memset(&items[n], 0, sizeof(par_item_t));
+        items[n++].arg = strdup(line);
+    }
+    free(line);
+    *count = n;
+    return items;
+}
+
+int parallel_builtin(cmd_buff_t *cmd) {
+    par_opts_t opts;
+    par_item_t *items;
+    int n = 0, items_at;
+
+    if (par_parse_opts(cmd, &opts, &items_at) != OK) {
+        fprintf(stderr, CMD_ERR_PAR_USAGE);
+        return 2;
+    }
+
+    if (items_at >= 0) {
+        n = cmd->argc - items_at;
+        items = calloc(n > 0 ? n : 1, sizeof(par_item_t));
+        for (int i = 0; items && i < n; i++) {
+            items[i].arg = strdup(cmd->argv[items_at + i]);
+        }
+    } else if (cmd->input_file) {
+        FILE *in = fopen(cmd->input_file, "r");
+        if (!in) {
+            perror(cmd->input_file);
+            return 1;
+        }
+        items = par_read_items(in, &n);
+        fclose(in);
+    } else {
+        items = par_read_items(stdin, &n);
+    }
+
+    if (n == 0) {
+        free(items);
+        return 0;
+    }
+
+    //run queue, an item is on it at most once so n slots are enough
+    int *queue = malloc(sizeof(int) * n);
+    //one poll slot per job, pidx[s] is the item running in slot s and a
+    //free slot has fd -1, which poll() skips
+    int slots = opts.jobs < n ? opts.jobs : n;
+    struct pollfd *pfds = malloc(sizeof(struct pollfd) * slots);
+    int *pidx = malloc(sizeof(int) * slots);
+    if (!items || !queue || !pfds || !pidx) {
+        free(items);
+        free(queue);
+        free(pfds);
+        free(pidx);
+        return ERR_MEMORY;
+    }
+
+    int q_head = 0, q_len = n, running = 0, done = 0, next_print = 0, retried = 0;
+    struct timespec start;
+
+    for (int i = 0; i < n; i++) queue[i] = i;
+    for (int s = 0; s < slots; s++) pfds[s].fd = -1;
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    while (done < n) {
+        //keep every slot busy
+        for (int s = 0; s < slots && q_len > 0; s++) {
+            while (pfds[s].fd < 0 && q_len > 0) {
+                int i = queue[q_head];
+                par_item_t *item = &items[i];
+                q_head = (q_head + 1) % n;
+                q_len--;
+
+                if (par_spawn(&opts, item) != OK) {
+                    item->state = PAR_DONE;
+                    item->exit_code = 127;
+                    done++;
+                    continue;
+                }
+                pfds[s].fd = item->out_fd;
+                pfds[s].events = POLLIN;
+                pidx[s] = i;
+                running++;
+            }
+        }
+        if (running == 0) continue;
+
+        if (poll(pfds, slots, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("poll");
+            break;
+        }
+
+        for (int p = 0; p < slots; p++) {
+            if (pfds[p].fd < 0 || !(pfds[p].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+            par_item_t *item = &items[pidx[p]];
+            if (par_collect(item)) continue;
+
+            //EOF on the pipe, the child is finishing
+            int status = 0;
+            close(item->out_fd);
+            pfds[p].fd = -1;
+            while (waitpid(item->pid, &status, 0) < 0 && errno == EINTR);
+            item->wall_ms += elapsed_ms(&item->start);
+            item->exit_code = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            running--;
+
+            if (item->exit_code != 0 && item->attempts <= opts.retries) {
+                item->state = PAR_PENDING;
+                queue[(q_head + q_len) % n] = pidx[p];
+                q_len++;
+                retried++;
+                continue;
+            }
+
+            item->state = PAR_DONE;
+            done++;
+            if (!opts.keep_order) {
+                par_write_all(STDOUT_FILENO, item->out, item->out_len);
+            }
+        }
+
+        //with -k flush the longest finished prefix
+        while (opts.keep_order && next_print < n && items[next_print].state == PAR_DONE) {
+            par_write_all(STDOUT_FILENO, items[next_print].out, items[next_print].out_len);
+            next_print++;
+        }
+    }
+
+    par_print_summary(items, n, retried, elapsed_ms(&start));
+
+    int failed = 0;
+    for (int i = 0; i < n; i++) {
+        if (items[i].exit_code != 0) failed++;
+        free(items[i].arg);
+        free(items[i].out);
+    }
+    free(items);
+    free(queue);
+    free(pfds);
+    free(pidx);
+
+    return failed > PAR_MAX_RC ? PAR_MAX_RC : failed;
+}
@@ -0,0 +1,111 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <limits.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <errno.h>
+
+#include "dshlib.h"
+
+/*
+ * Built-in command plugins.
+ *
+ * Every *.so in the plugin directory ($DSH_PLUGIN_DIR, default
+ * ~/.dsh/plugins) is loaded with dlopen() the first time dsh looks up a
+ * command, in name order.  A plugin exports one function:
+ *
+ *      int dsh_plugin_init(const dsh_plugin_api_t *api);
+ *
+ * which checks api->abi against the DSH_PLUGIN_ABI it was built with and
+ * calls api->register_builtin(name, fn) for each command it provides.
+ * A non-zero return rejects the plugin and drops whatever it registered.
+ * Commands are entered in the same hash table as the in-process built-ins,
+ * so they run without a fork on their own and without an exec as a
+ * pipeline stage:
+ *
+ *      int fn(cmd_buff_t *cmd, int in_fd, int out_fd);
+ *
+ * reads from in_fd, writes to out_fd and returns the exit code.  See
+ * plugins/ for an example and `make plugins` to build it.
+ */
+
+#ifndef DSH_STATIC
+
+static const dsh_plugin_api_t plugin_api = {
+    .abi = DSH_PLUGIN_ABI,
+    .register_builtin = fast_bi_register_plugin,
+};
+
+static int is_plugin_file(const struct dirent *ent) {
+    size_t len = strlen(ent->d_name);
+    return len > 3 && strcmp(ent->d_name + len - 3, ".so") == 0;
+}
+
+static void load_plugin(const char *path) {
+    void *handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+        fprintf(stderr, CMD_ERR_PLUGIN, path, dlerror());
+        return;
+    }
+
+    dsh_plugin_init_fn_t init = (dsh_plugin_init_fn_t)dlsym(handle, PLUGIN_INIT_SYM);
+    if (!init) {
+        fprintf(stderr, CMD_ERR_PLUGIN, path, "no " PLUGIN_INIT_SYM "()");
+        dlclose(handle);
+        return;
+    }
+    //a plugin may register some commands before it gives up, those have
+    //to come out of the table before their code is unmapped
+    fast_bi_t *saved = fast_bi_save();
+    if (!saved) {
+        fprintf(stderr, CMD_ERR_PLUGIN, path, strerror(ENOMEM));
+        dlclose(handle);
+        return;
+    }
+    if (init(&plugin_api) != 0) {
+        fprintf(stderr, CMD_ERR_PLUGIN, path, "rejected by the plugin, ABI mismatch?");
+        fast_bi_restore(saved);
+        dlclose(handle);
+        return;
+    }
+    free(saved);
+    //loaded plugins stay mapped for the life of the shell
+}
+
+void plugins_load(void) {
+    char dir[PATH_BUFF_SZ], path[PATH_BUFF_SZ + NAME_MAX + 2];
+    const char *env = getenv(PLUGIN_DIR_ENV);
+    struct dirent **ents;
+    int n;
+
+    if (env) {
+        snprintf(dir, sizeof(dir), "%s", env);
+    } else if (getenv("HOME")) {
+        snprintf(dir, sizeof(dir), "%s/%s", getenv("HOME"), PLUGIN_DIR_DEF);
+    } else {
+        return;
+    }
+    if (dir[0] == '\0') return;
+
+    n = scandir(dir, &ents, is_plugin_file, alphasort);
+    if (n < 0) return;     // no plugin directory is fine
+
+    for (int i = 0; i < n; i++) {
+        snprintf(path, sizeof(path), "%s/%s", dir, ents[i]->d_name);
+        load_plugin(path);
+        free(ents[i]);
+    }
+    free(ents);
+}
+
+#else
+
+//the static build (make dsh-static) has no dynamic loader to share libc
+//with a plugin, so it does without them
+void plugins_load(void) {
+}
+
+#endif
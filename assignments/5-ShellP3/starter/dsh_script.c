@@ -0,0 +1,163 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "dshlib.h"
+
+/*
+ * Non-interactive execution: `dsh -c "cmds"` and `dsh script.dsh`.
+ *
+ * Neither mode prints a prompt or the "no commands" warning, and both
+ * honour `set -e` by stopping at the first command that exits non-zero.
+ * Blank lines and lines starting with '#' (including a "#!" line) are
+ * skipped.
+ *
+ * A script is mapped into memory with mmap() and walked line by line with
+ * memchr(), so there is no per-line read() or stdio call at all.  Files
+ * that cannot be mapped (pipes, /dev/stdin, ...) are slurped into one
+ * growable buffer with large read() calls instead.
+ *
+ * The lines of a here-document (<< DELIM) are taken from the script or
+ * the -c string itself, the same way the prompt loop reads them from
+ * the user.
+ *
+ * Both return the exit code of the last command, which main() hands back
+ * to whoever started dsh.
+ */
+
+typedef struct script_src {
+    const char  *line;          // start of the next line
+    const char  *end;
+    int         line_no;
+} script_src_t;
+
+//steps over the next line, *len is its length without the newline
+static const char *next_line(script_src_t *src, size_t *len) {
+    const char *line = src->line;
+
+    if (line >= src->end) return NULL;
+
+    const char *nl = memchr(line, '\n', src->end - line);
+    *len = (nl ? nl : src->end) - line;
+    src->line = nl ? nl + 1 : src->end;
+    src->line_no++;
+    return line;
+}
+
+//here-document lines come from the script itself, see dsh_expand.c
+static char *read_more_input(char *buff, int size, void *ctx) {
+    size_t len;
+    const char *line = next_line(ctx, &len);
+
+    if (!line) return NULL;
+    if (len >= (size_t)size) len = size - 1;
+    memcpy(buff, line, len);
+    buff[len] = '\0';
+    return buff;
+}
+
+static int run_lines(const char *name, const char *buff, size_t len) {
+    char cmd_buffer[SH_CMD_MAX];
+    script_src_t src = {buff, buff + len, 0};
+    const char *line;
+    size_t line_len;
+
+    jobs_init(false);
+    dsh_last_rc = 0;
+    expand_set_source(read_more_input, &src);
+
+    while ((line = next_line(&src, &line_len))) {
+        if (line_len >= SH_CMD_MAX) {
+            fprintf(stderr, CMD_ERR_LINE_LONG, name, src.line_no, SH_CMD_MAX - 1);
+            dsh_last_rc = 2;
+            if (dsh_opts.errexit) break;
+            continue;
+        }
+
+        memcpy(cmd_buffer, line, line_len);
+        cmd_buffer[line_len] = '\0';
+
+        trim_whitespace(cmd_buffer);
+        if (*cmd_buffer == '\0' || *cmd_buffer == SCRIPT_COMMENT_CHAR) continue;
+
+        jobs_notify();
+        if (exec_cmd_line(cmd_buffer) == OK_EXIT) break;
+        if (dsh_opts.errexit && dsh_last_rc != 0) break;
+    }
+
+    expand_set_source(NULL, NULL);
+    fflush(stdout);
+    return dsh_last_rc;
+}
+
+int exec_cmd_string(const char *cmds) {
+    return run_lines("-c", cmds, strlen(cmds));
+}
+
+//fallback for anything mmap() refuses
+static char *slurp_fd(int fd, size_t *len) {
+    size_t cap = SCRIPT_READ_SZ, used = 0;
+    char *buff = malloc(cap);
+    ssize_t n;
+
+    while (buff && (n = read(fd, buff + used, cap - used)) > 0) {
+        used += n;
+        if (used == cap) {
+            char *grown = realloc(buff, cap * 2);
+            if (!grown) {
+                free(buff);
+                return NULL;
+            }
+            buff = grown;
+            cap *= 2;
+        }
+    }
+    *len = used;
+    return buff;
+}
+
+int exec_script_file(const char *path) {
+    struct stat st;
+    char *buff;
+    size_t len = 0;
+    bool mapped = false;
+    int rc;
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        perror(path);
+        return 127;
+    }
+
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+        len = st.st_size;
+        buff = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (buff != MAP_FAILED) {
+            madvise(buff, len, MADV_SEQUENTIAL);
+            mapped = true;
+        }
+    }
+    if (!mapped) {
+        buff = slurp_fd(fd, &len);
+    }
+    close(fd);
+
+    if (!buff) {
+        fprintf(stderr, "%s: out of memory\n", path);
+        return ERR_MEMORY;
+    }
+
+    rc = run_lines(path, buff, len);
+
+    if (mapped) {
+        munmap(buff, len);
+    } else {
+        free(buff);
+    }
+    return rc;
+}
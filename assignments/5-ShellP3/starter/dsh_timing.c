@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <sys/resource.h>
+
+#include "dshlib.h"
+
+/*
+ * Per-stage resource accounting, used by the `time` prefix and by
+ * `set -o timing`.
+ *
+ * The job code collects a struct rusage for every stage with wait4() and
+ * records when each stage was reaped.  timing_report() turns that into a
+ * table on stderr, one row per stage plus a total for the pipeline:
+ *
+ *      wall            fork of the first stage until the stage was reaped
+ *      user/sys        CPU time, ru_utime / ru_stime
+ *      maxrss          peak resident set, ru_maxrss (KB)
+ *      vcsw/ivcsw      voluntary / involuntary context switches
+ *      minflt/majflt   page faults that did not / did need I/O
+ *
+ * When `set timelog=FILE` is set the same numbers for the whole pipeline
+ * are also appended to FILE as one key=value line, e.g. for profiling runs
+ * that get post-processed with awk.
+ */
+
+static double ts_diff_ms(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000.0 +
+           (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static double tv_ms(const struct timeval *tv) {
+    return tv->tv_sec * 1000.0 + tv->tv_usec / 1000.0;
+}
+
+typedef struct stage_times {
+    double  wall_ms;
+    double  user_ms;
+    double  sys_ms;
+    long    maxrss_kb;
+    long    nvcsw;
+    long    nivcsw;
+    long    minflt;
+    long    majflt;
+} stage_times_t;
+
+static void stage_times(job_t *job, int i, stage_times_t *st) {
+    struct rusage *ru = &job->rusage[i];
+
+    st->wall_ms = ts_diff_ms(&job->start, &job->end[i]);
+    st->user_ms = tv_ms(&ru->ru_utime);
+    st->sys_ms = tv_ms(&ru->ru_stime);
+    st->maxrss_kb = ru->ru_maxrss;
+    st->nvcsw = ru->ru_nvcsw;
+    st->nivcsw = ru->ru_nivcsw;
+    st->minflt = ru->ru_minflt;
+    st->majflt = ru->ru_majflt;
+}
+
+static void add_times(stage_times_t *total, stage_times_t *st) {
+    if (st->wall_ms > total->wall_ms) total->wall_ms = st->wall_ms;
+    total->user_ms += st->user_ms;
+    total->sys_ms += st->sys_ms;
+    if (st->maxrss_kb > total->maxrss_kb) total->maxrss_kb = st->maxrss_kb;
+    total->nvcsw += st->nvcsw;
+    total->nivcsw += st->nivcsw;
+    total->minflt += st->minflt;
+    total->majflt += st->majflt;
+}
+
+static void print_row(const char *label, stage_times_t *st, const char *cmd) {
+    fprintf(stderr, "%-6s %9.2f %9.2f %9.2f %9ld %7ld %7ld %8ld %7ld  %s\n",
+            label, st->wall_ms, st->user_ms, st->sys_ms, st->maxrss_kb,
+            st->nvcsw, st->nivcsw, st->minflt, st->majflt, cmd);
+}
+
+static void append_time_log(job_t *job, stage_times_t *total) {
+    FILE *log = fopen(dsh_opts.time_log, "a");
+    if (!log) {
+        perror(dsh_opts.time_log);
+        return;
+    }
+
+    fprintf(log, "dsh-time ts=%ld stages=%d wall_ms=%.3f user_ms=%.3f sys_ms=%.3f "
+                 "maxrss_kb=%ld nvcsw=%ld nivcsw=%ld minflt=%ld majflt=%ld rc=%d cmd=\"%s\"\n",
+            (long)time(NULL), job->num, total->wall_ms, total->user_ms, total->sys_ms,
+            total->maxrss_kb, total->nvcsw, total->nivcsw, total->minflt, total->majflt,
+            job->exit_code, job->cmd_line);
+    fclose(log);
+}
+
+void timing_report(job_t *job) {
+    stage_times_t st, total;
+    char label[16];
+
+    memset(&total, 0, sizeof(total));
+    fprintf(stderr, "%-6s %9s %9s %9s %9s %7s %7s %8s %7s  %s\n", "STAGE", "WALL(ms)",
+            "USER(ms)", "SYS(ms)", "MAXRSS(K)", "VCSW", "IVCSW", "MINFLT", "MAJFLT", "COMMAND");
+
+    for (int i = 0; i < job->num; i++) {
+        stage_times(job, i, &st);
+        add_times(&total, &st);
+        if (job->num > 1) {
+            snprintf(label, sizeof(label), "%d", i + 1);
+            print_row(label, &st, job->stage_cmds[i]);
+        }
+    }
+    print_row("total", &total, job->cmd_line);
+
+    if (dsh_opts.time_log[0] != '\0') {
+        append_time_log(job, &total);
+    }
+}
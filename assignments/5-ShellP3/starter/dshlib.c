@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -6,9 +7,13 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <stdio_ext.h>
 
 #include "dshlib.h"
 
+// exit code of the last command, what `set -e` and `dsh -c` look at
+int dsh_last_rc = 0;
+
 /*
  * Implement your exec_local_cmd_loop function by building a loop that prompts the 
  * user for input.  Use the SH_PROMPT constant from dshlib.h and then
@@ -52,63 +57,350 @@
  *  Standard Library Functions You Might Want To Consider Using (assignment 2+)
  *      fork(), execvp(), exit(), chdir()
  */
- int exec_local_cmd_loop() {
+//reads a line at the prompt, ctx says whether to use the editor
+static char *read_more_input(char *buff, int size, void *ctx) {
+    if (*(bool *)ctx) {
+        return hist_readline(HEREDOC_PROMPT, buff, size);
+    }
+    return ev_readline(HEREDOC_PROMPT, buff, size);
+}
+
+int exec_local_cmd_loop() {
     char cmd_buffer[SH_CMD_MAX];
-    command_list_t clist;
     int rc;
 
+    if (jobs_init(true) != OK || ev_init() != OK) {
+        return ERR_MEMORY;
+    }
+    hist_init();
+
+    // A terminal gets the line editor with history search
+    bool editor = hist_enabled() && isatty(STDIN_FILENO);
+    expand_set_source(read_more_input, &editor);
+
     while (1) {
-        printf("%s", SH_PROMPT);
-        if (fgets(cmd_buffer, SH_CMD_MAX, stdin) == NULL) {
+        // Report background jobs that finished while the last command ran
+        jobs_notify();
+
+        // Waits in the event loop, so jobs are reported while we sit here
+        ev_set_timeout(dsh_opts.tmout);
+        char *line = editor ? hist_readline(SH_PROMPT, cmd_buffer, SH_CMD_MAX)
+                            : ev_readline(SH_PROMPT, cmd_buffer, SH_CMD_MAX);
+        ev_set_timeout(0);
+        if (line == NULL) {
             printf("\n");
             break;
         }
 
-
         cmd_buffer[strcspn(cmd_buffer, "\n")] = '\0';
 
         if (*cmd_buffer == '\0') {
             printf(CMD_WARN_NO_CMD);
             continue;
         }
+        hist_add(cmd_buffer);
 
-        if (strcmp(cmd_buffer, EXIT_CMD) == 0) {
+        rc = exec_cmd_line(cmd_buffer);
+        if (rc == OK_EXIT || (dsh_opts.errexit && dsh_last_rc != 0)) {
             break;
         }
+    }
+
+    expand_set_source(NULL, NULL);
+    ev_close();
+    hist_close();
+    return OK;
+}
+
+static int run_cmd_line(char *cmd_line);
 
-        // Parse the command line into a command list
-        rc = build_cmd_list(cmd_buffer, &clist);
-        switch (rc) {
-            case WARN_NO_CMDS:
-                printf(CMD_WARN_NO_CMD);
-                continue;
-            case ERR_TOO_MANY_COMMANDS:
-                printf(CMD_ERR_PIPE_LIMIT, CMD_MAX);
-                continue;
-            case ERR_MEMORY:
-                fprintf(stderr, "Memory allocation error.\n");
-                continue;
-            default:
-                break;
+/*
+ * exec_cmd_line(cmd_line)
+ *      Parses and runs one line of input, shared by the interactive loop,
+ *      `dsh -c` and script mode.  cmd_line is modified in place.  The exit
+ *      code of the command is left in dsh_last_rc.
+ *
+ *  Returns:
+ *      OK_EXIT     the `exit` built-in was run
+ *      OK          anything else, including commands that failed
+ */
+int exec_cmd_line(char *cmd_line) {
+    expansion_t exp;
+    int rc;
+
+    if (!expand_needed(cmd_line)) {
+        return run_cmd_line(cmd_line);
+    }
+
+    // $(...), <<< and << are done before the line is parsed
+    rc = expand_line(cmd_line, &exp);
+    if (rc != OK) {
+        if (rc == ERR_MEMORY) fprintf(stderr, "Memory allocation error.\n");
+        dsh_last_rc = 2;
+        return OK;
+    }
+
+    rc = run_cmd_line(exp.line);
+    expand_free(&exp);
+    return rc;
+}
+
+static int run_cmd_line(char *cmd_line) {
+    command_list_t clist;
+    int rc;
+
+    // Parse the command line into a command list
+    rc = build_cmd_list(cmd_line, &clist);
+    switch (rc) {
+        case WARN_NO_CMDS:
+            printf(CMD_WARN_NO_CMD);
+            return OK;
+        case ERR_TOO_MANY_COMMANDS:
+            printf(CMD_ERR_PIPE_LIMIT, CMD_MAX);
+            dsh_last_rc = 2;
+            return OK;
+        case ERR_CMD_OR_ARGS_TOO_BIG:
+            // also what a $(...) that splits into too many words ends as
+            printf(CMD_ERR_ARGS_LIMIT, CMD_ARGV_MAX - 2);
+            dsh_last_rc = 2;
+            return OK;
+        case ERR_MEMORY:
+            fprintf(stderr, "Memory allocation error.\n");
+            dsh_last_rc = 2;
+            return OK;
+        default:
+            break;
+    }
+
+    // Built-in commands run inside the shell itself
+    if (clist.num == 1 && !clist.background) {
+        Built_In_Cmds bi = exec_built_in_cmd(&clist.commands[0]);
+
+        // So do the fast ones, unless there is a process to account for
+        const fast_bi_t *fast_bi;
+        if (bi == BI_NOT_BI && !clist.timed && !dsh_opts.timing &&
+            clist.commands[0].argc > 0 &&
+            (fast_bi = fast_bi_lookup(clist.commands[0].argv[0]))) {
+            dsh_last_rc = fast_bi_run(fast_bi, &clist.commands[0]);
+            bi = BI_EXECUTED;
         }
 
-        // Execute the parsed command pipeline
-        if (execute_pipeline(&clist) == ERR_EXEC_CMD) {
-            printf(CMD_ERR_EXECUTE);
+        if (bi == BI_CMD_EXIT || bi == BI_EXECUTED) {
+            free_cmd_list(&clist);
+            return bi == BI_CMD_EXIT ? OK_EXIT : OK;
         }
+    }
 
-        // Free allocated memory for the command list
-        free_cmd_list(&clist);
+    // Execute the parsed command pipeline
+    if (execute_pipeline(&clist) == ERR_EXEC_CMD) {
+        printf(CMD_ERR_EXECUTE);
+        dsh_last_rc = 126;
     }
 
+    // Free allocated memory for the command list
+    free_cmd_list(&clist);
     return OK;
 }
 
+/*
+ * match_command(input)
+ *      Maps a command name to one of the Built_In_Cmds values, BI_NOT_BI
+ *      is returned for anything that has to be fork/exec'd.
+ */
+Built_In_Cmds match_command(const char *input) {
+    if (strcmp(input, EXIT_CMD) == 0) {
+        return BI_CMD_EXIT;
+    } else if (strcmp(input, "cd") == 0) {
+        return BI_CMD_CD;
+    } else if (strcmp(input, "jobs") == 0) {
+        return BI_CMD_JOBS;
+    } else if (strcmp(input, "fg") == 0) {
+        return BI_CMD_FG;
+    } else if (strcmp(input, "bg") == 0) {
+        return BI_CMD_BG;
+    } else if (strcmp(input, "wait") == 0) {
+        return BI_CMD_WAIT;
+    } else if (strcmp(input, "parallel") == 0) {
+        return BI_CMD_PARALLEL;
+    } else if (strcmp(input, "set") == 0) {
+        return BI_CMD_SET;
+    } else if (strcmp(input, "history") == 0) {
+        return BI_CMD_HISTORY;
+    } else {
+        return BI_NOT_BI;
+    }
+}
+
+/*
+ * exec_built_in_cmd(cmd)
+ *      Runs cmd if it is a built-in.  Returns BI_NOT_BI when the command
+ *      still needs to be executed, BI_CMD_EXIT when the shell should quit
+ *      and BI_EXECUTED otherwise.
+ */
+Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd) {
+    if (cmd->argc == 0) return BI_NOT_BI;
+
+    Built_In_Cmds cmd_type = match_command(cmd->argv[0]);
+
+    switch (cmd_type) {
+        case BI_CMD_EXIT:
+            if (cmd->argc > 1) dsh_last_rc = atoi(cmd->argv[1]);
+            return BI_CMD_EXIT;
+
+        case BI_CMD_CD:
+            dsh_last_rc = 0;
+            if (chdir(cmd->argc > 1 ? cmd->argv[1] : getenv("HOME")) != 0) {
+                perror("cd");
+                dsh_last_rc = 1;
+            }
+            return BI_EXECUTED;
+
+        case BI_CMD_JOBS:
+        case BI_CMD_FG:
+        case BI_CMD_BG:
+        case BI_CMD_WAIT:
+            dsh_last_rc = jobs_builtin(cmd_type, cmd);
+            return BI_EXECUTED;
+
+        case BI_CMD_SET:
+            dsh_last_rc = set_builtin(cmd) == OK ? 0 : 2;
+            return BI_EXECUTED;
+
+        case BI_CMD_HISTORY:
+            if (cmd->output_file) return BI_NOT_BI;
+            dsh_last_rc = history_builtin(cmd);
+            return BI_EXECUTED;
+
+        case BI_CMD_PARALLEL:
+            // With redirections it is run as a forked pipeline stage
+            if (cmd->output_file) return BI_NOT_BI;
+            dsh_last_rc = parallel_builtin(cmd);
+            return BI_EXECUTED;
+
+        default:
+            return BI_NOT_BI;
+    }
+}
+
+/*
+ * set_pipe_size(fd, size)
+ *      Grows (or shrinks) the kernel buffer of a pipe with F_SETPIPE_SZ.
+ *      Bigger buffers let the writer run further ahead of the reader, which
+ *      means far fewer context switches on high-throughput pipelines.
+ *      Unprivileged processes cannot go past pipe-max-size, so the request
+ *      is capped at that.  Failure just leaves the default in place.
+ */
+void set_pipe_size(int fd, long size) {
+    static long max_size = 0;
+
+    if (max_size == 0) {
+        FILE *f = fopen(PIPE_MAX_SIZE_FILE, "r");
+        if (!f || fscanf(f, "%ld", &max_size) != 1) {
+            max_size = size;
+        }
+        if (f) fclose(f);
+    }
+
+    if (size > max_size) size = max_size;
+    fcntl(fd, F_SETPIPE_SZ, (int)size);
+}
+
+/*
+ * Runs cmd inside an already forked pipeline child if it is a built-in
+ * that works as a pipeline stage, never returns in that case.  The stdio
+ * buffers inherited from the shell are dropped first, they hold the
+ * prompt and read-ahead of the shell's own input.
+ */
+static void exec_stage_built_in(cmd_buff_t *cmd) {
+    if (cmd->argc == 0) return;
+
+    const fast_bi_t *fast_bi = fast_bi_lookup(cmd->argv[0]);
+    Built_In_Cmds bi = match_command(cmd->argv[0]);
+
+    if (!fast_bi && bi != BI_CMD_PARALLEL && bi != BI_CMD_HISTORY) return;
+
+    __fpurge(stdin);
+    __fpurge(stdout);
+    if (fast_bi) {
+        _exit(fast_bi_call(fast_bi, cmd));
+    }
+    if (bi == BI_CMD_HISTORY) {
+        int rc = history_builtin(cmd);
+        fflush(stdout);
+        _exit(rc);
+    }
+    exit(parallel_builtin(cmd));
+}
+
+/*
+ * zygote_stage(clist, i, pipes, flow, pgid)
+ *      Starts stage i through the zygote when `dsh -z` is in use.  The
+ *      redirections a forked child would set up for itself are opened here
+ *      and handed over as descriptors.  Returns the pid, or -1 when the
+ *      stage has to be forked as usual: no zygote, a stage without a
+ *      command, a built-in stage, a redirect that cannot be opened (the
+ *      forked child reports it) or a failed request.
+ */
+static pid_t zygote_stage(command_list_t *clist, int i, int pipes[][2], flow_t *flow, pid_t pgid) {
+    cmd_buff_t *cmd = &clist->commands[i];
+    zygote_req_t req;
+    int in_fd = -1, out_fd = -1;
+    pid_t pid = -1;
+
+    if (!zygote_running() || cmd->argc == 0 || fast_bi_lookup(cmd->argv[0]) ||
+        match_command(cmd->argv[0]) == BI_CMD_PARALLEL ||
+        match_command(cmd->argv[0]) == BI_CMD_HISTORY) {
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.argv = cmd->argv;
+    req.cwd_fd = -1;
+    req.pgid = pgid;
+    req.set_pgid = jobs_have_control();
+    req.foreground = !clist->background;
+
+    if (cmd->input_file) {
+        in_fd = open_input_file(cmd);
+        req.fds[0] = in_fd;
+    } else if (i > 0) {
+        req.fds[0] = flow_stage_input(flow, pipes, i - 1);
+    } else if (clist->background) {
+        in_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+        req.fds[0] = in_fd;
+    } else {
+        req.fds[0] = STDIN_FILENO;
+    }
+
+    if (cmd->output_file) {
+        out_fd = open_output_file(cmd);
+        req.fds[1] = out_fd;
+    } else {
+        req.fds[1] = i < clist->num - 1 ? pipes[i][1] : STDOUT_FILENO;
+    }
+    req.fds[2] = STDERR_FILENO;
+
+    if (req.fds[0] >= 0 && req.fds[1] >= 0) {
+        pid = zygote_spawn(&req);
+    }
+
+    if (in_fd >= 0) close(in_fd);
+    if (out_fd >= 0) close(out_fd);
+    return pid;
+}
+
 int execute_pipeline(command_list_t *clist) {
     if (clist->num == 0) return ERR_EXEC_CMD;
 
     int pipes[CMD_MAX - 1][2];
     pid_t pids[CMD_MAX];
+    pid_t pgid = 0, relay_pid;
+    job_t *job;
+    flow_t flow;
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (flow_setup(&flow, clist) != OK) return ERR_EXEC_CMD;
 
     for (int i = 0; i < clist->num; i++) {
         // Create pipe (except for the last command)
@@ -117,19 +409,25 @@ int execute_pipeline(command_list_t *clist) {
                 perror("pipe");
                 return ERR_EXEC_CMD;
             }
+            if (dsh_opts.pipe_size > 0) {
+                set_pipe_size(pipes[i][1], dsh_opts.pipe_size);
+            }
         }
 
-        // Fork a child process
-        pids[i] = fork();
+        // Fork a child process, unless the zygote can start it for us
+        pids[i] = zygote_stage(clist, i, pipes, &flow, pgid);
+        if (pids[i] == -1) pids[i] = fork();
         if (pids[i] == -1) {
             perror("fork");
             return ERR_EXEC_CMD;
         }
 
         if (pids[i] == 0) {  // Child process
+            jobs_child_setup(pgid, clist->background);
+
             // Handle input redirection
             if (clist->commands[i].input_file) {
-                int in_fd = open(clist->commands[i].input_file, O_RDONLY);
+                int in_fd = open_input_file(&clist->commands[i]);
                 if (in_fd == -1) {
                     perror("open input file");
                     exit(EXIT_FAILURE);
@@ -137,20 +435,19 @@ int execute_pipeline(command_list_t *clist) {
                 dup2(in_fd, STDIN_FILENO);
                 close(in_fd);
             } else if (i > 0) {
-                dup2(pipes[i - 1][0], STDIN_FILENO);
+                dup2(flow_stage_input(&flow, pipes, i - 1), STDIN_FILENO);
+            } else if (clist->background) {
+                // Background jobs must not compete with the shell for stdin
+                int null_fd = open("/dev/null", O_RDONLY);
+                if (null_fd != -1) {
+                    dup2(null_fd, STDIN_FILENO);
+                    close(null_fd);
+                }
             }
 
             // Handle output redirection
             if (clist->commands[i].output_file) {
-                int out_fd;
-                if (is_append_redirect(clist->commands[i].output_file)) {
-                    // Handle `>>` (append mode)
-                    out_fd = open(clist->commands[i].output_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
-                } else {
-                    // Handle `>` (overwrite mode)
-                    out_fd = open(clist->commands[i].output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                }
-
+                int out_fd = open_output_file(&clist->commands[i]);
                 if (out_fd == -1) {
                     perror("open output file");
                     exit(EXIT_FAILURE);
@@ -166,25 +463,55 @@ int execute_pipeline(command_list_t *clist) {
                 close(pipes[j][0]);
                 close(pipes[j][1]);
             }
+            flow_close(&flow);
+
+            // Built-ins that can act as a pipeline stage run in the child
+            exec_stage_built_in(&clist->commands[i]);
 
             // Execute command
             execvp(clist->commands[i].argv[0], clist->commands[i].argv);
             perror("execvp");
             exit(EXIT_FAILURE);
         }
+
+        // The first stage leads the process group for the whole pipeline,
+        // set it from the parent too so there is no race with the child
+        if (pgid == 0) pgid = pids[i];
+        jobs_set_pgid(pids[i], pgid);
     }
 
+    // Monitored junctions get a relay process between their two pipes
+    relay_pid = flow_start(&flow, pipes, pgid);
+
     // Close all pipes in the parent process
     for (int i = 0; i < clist->num - 1; i++) {
         close(pipes[i][0]);
         close(pipes[i][1]);
     }
+    flow_close(&flow);
 
-    // Wait for all child processes
-    for (int i = 0; i < clist->num; i++) {
-        waitpid(pids[i], NULL, 0);
+    job = job_add(clist, pids, pgid, &start);
+    if (!job) {
+        // No room to track it, fall back to waiting for it right here
+        for (int i = 0; i < clist->num; i++) {
+            waitpid(pids[i], NULL, 0);
+        }
+        return OK;
     }
 
+    // Background jobs are reaped later by jobs_reap()
+    if (clist->background) {
+        dsh_last_rc = 0;
+        return OK;
+    }
+
+    dsh_last_rc = job_wait_fg(job);
+
+    // The relay exits once every monitored junction saw EOF, if the job
+    // was stopped instead it is left for jobs_reap() to collect
+    if (relay_pid > 0 && job->state != JOB_STOPPED) {
+        waitpid(relay_pid, NULL, 0);
+    }
     return OK;
 }
 
@@ -194,6 +521,29 @@ _Bool is_append_redirect(const char *output_file) {
     return (output_file && output_file[0] == '>' && output_file[1] == '>');
 }
 
+/*
+ * open_input_file(cmd) / open_output_file(cmd)
+ *      Open the targets of < and > for cmd.  For `>>file` the parser leaves
+ *      the second '>' at the front of output_file, which selects append
+ *      mode and is not part of the file name.  Both return -1 with errno
+ *      set on failure, reporting it is up to the caller.
+ */
+int open_input_file(cmd_buff_t *cmd) {
+    return open(cmd->input_file, O_RDONLY | O_CLOEXEC);
+}
+
+int open_output_file(cmd_buff_t *cmd) {
+    const char *path = cmd->output_file;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+    if (path[0] == '>') {
+        path++;
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    }
+
+    return open(path, flags | O_CLOEXEC, 0644);
+}
+
 
 
 int free_cmd_buff(cmd_buff_t *cmd_buff) {
@@ -237,17 +587,19 @@ int build_cmd_buff(char *cmd_line, cmd_buff_t *cmd_buff) {
             trim_whitespace(token);
             cmd_buff->input_file = token;
             while (*token && !isspace((unsigned char)*token)) token++;
-            *token = '\0';
+            if (*token) *token++ = '\0';
             continue;
         }
 
 
         if (*token == '>') {
             token++;
-            trim_whitespace(token);
+            //`>> file`: the second '>' stays in front of the name, see open_output_file()
+            bool append = *token == '>';
+            trim_whitespace(token + append);
             cmd_buff->output_file = token;
             while (*token && !isspace((unsigned char)*token)) token++;
-            *token = '\0';
+            if (*token) *token++ = '\0';
             continue;
         }
 
@@ -287,6 +639,21 @@ int build_cmd_list(char *cmd_line, command_list_t *clist) {
 
     trim_whitespace(cmd_line);
 
+    // A trailing '&' runs the whole pipeline in the background
+    size_t len = strlen(cmd_line);
+    if (len > 0 && cmd_line[len - 1] == BG_CHAR) {
+        cmd_line[len - 1] = '\0';
+        clist->background = true;
+    }
+
+    // A leading `time` reports resource usage once the pipeline is done
+    len = strlen(TIME_CMD);
+    if (strncmp(cmd_line, TIME_CMD, len) == 0 && (cmd_line[len] == '\0' || isspace((unsigned char)cmd_line[len]))) {
+        memmove(cmd_line, cmd_line + len, strlen(cmd_line + len) + 1);
+        trim_whitespace(cmd_line);
+        clist->timed = true;
+    }
+
     char *token, *saveptr;
     int cmd_count = 0;
 
@@ -301,8 +668,17 @@ int build_cmd_list(char *cmd_line, command_list_t *clist) {
 
         if (cmd_count >= CMD_MAX) return ERR_TOO_MANY_COMMANDS;
 
-        if (build_cmd_buff(token, &clist->commands[cmd_count]) != OK)
-            return ERR_MEMORY;
+        // `a |~ b` asks for a flow meter on the junction into b
+        bool flow_in = false;
+        if (*token == FLOW_CHAR && cmd_count > 0) {
+            flow_in = true;
+            token++;
+            trim_whitespace(token);
+        }
+
+        int rc = build_cmd_buff(token, &clist->commands[cmd_count]);
+        if (rc != OK) return rc;
+        clist->commands[cmd_count].flow_in = flow_in;
 
         cmd_count++;
         token = strtok_r(NULL, PIPE_STRING, &saveptr);
@@ -1,12 +1,17 @@
 #ifndef __DSHLIB_H__
     #define __DSHLIB_H__
 
+#include <stdbool.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+
 
 //Constants for command structure sizes
 #define EXE_MAX 64
 #define ARG_MAX 256
 #define CMD_MAX 8
-#define CMD_ARGV_MAX (CMD_MAX + 1)
+#define CMD_ARGV_MAX 32
 // Longest command that can be read from the shell
 #define SH_CMD_MAX EXE_MAX + ARG_MAX
 
@@ -24,6 +29,7 @@ typedef struct cmd_buff
     char *_cmd_buffer;
     char *input_file;
     char *output_file;
+    bool flow_in;               // input junction written as |~
 } cmd_buff_t;
 
 /* WIP - Move to next assignment 
@@ -38,6 +44,8 @@ typedef struct command{
 
 typedef struct command_list{
     int num;
+    bool background;            // command line ended with '&'
+    bool timed;                 // command line started with `time`
     cmd_buff_t commands[CMD_MAX];
 }command_list_t;
 
@@ -45,6 +53,9 @@ typedef struct command_list{
 #define SPACE_CHAR  ' '
 #define PIPE_CHAR   '|'
 #define PIPE_STRING "|"
+#define FLOW_CHAR   '~'
+#define BG_CHAR     '&'
+#define TIME_CMD    "time"
 
 #define SH_PROMPT "dsh3> "
 #define EXIT_CMD "exit"
@@ -69,23 +80,239 @@ int close_cmd_buff(cmd_buff_t *cmd_buff);
 int build_cmd_list(char *cmd_line, command_list_t *clist);
 int free_cmd_list(command_list_t *cmd_lst);
 _Bool is_append_redirect(const char *output_file);
+int open_input_file(cmd_buff_t *cmd);
+int open_output_file(cmd_buff_t *cmd);
+void trim_whitespace(char *str);
 
 //built in command stuff
 typedef enum {
     BI_CMD_EXIT,
     BI_CMD_DRAGON,
     BI_CMD_CD,
+    BI_CMD_JOBS,
+    BI_CMD_FG,
+    BI_CMD_BG,
+    BI_CMD_WAIT,
+    BI_CMD_PARALLEL,
+    BI_CMD_SET,
+    BI_CMD_HISTORY,
     BI_NOT_BI,
     BI_EXECUTED,
 } Built_In_Cmds;
 Built_In_Cmds match_command(const char *input); 
 Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd);
 
+//in-process built-ins (echo, printf, pwd, test, ...) - see dsh_builtins.c
+#define FAST_BI_SLOTS   64              // hash table size, a power of 2
+#define PATH_BUFF_SZ    4096
+
+typedef int (*fast_bi_fn_t)(cmd_buff_t *cmd);
+typedef struct fast_bi fast_bi_t;
+
+//plugin ABI - see dsh_plugins.c and plugins/
+#define DSH_PLUGIN_ABI      1
+#define PLUGIN_DIR_ENV      "DSH_PLUGIN_DIR"
+#define PLUGIN_DIR_DEF      ".dsh/plugins"      // under $HOME
+#define PLUGIN_INIT_SYM     "dsh_plugin_init"
+
+typedef int (*dsh_plugin_fn_t)(cmd_buff_t *cmd, int in_fd, int out_fd);
+
+typedef struct dsh_plugin_api {
+    int     abi;                        // DSH_PLUGIN_ABI of the shell
+    int     (*register_builtin)(const char *name, dsh_plugin_fn_t fn);
+} dsh_plugin_api_t;
+
+// every plugin exports: int dsh_plugin_init(const dsh_plugin_api_t *api);
+typedef int (*dsh_plugin_init_fn_t)(const dsh_plugin_api_t *api);
+
+int fast_bi_register(const char *name, fast_bi_fn_t fn);
+int fast_bi_register_plugin(const char *name, dsh_plugin_fn_t fn);
+fast_bi_t *fast_bi_save(void);
+void fast_bi_restore(fast_bi_t *saved);
+const fast_bi_t *fast_bi_lookup(const char *name);
+int fast_bi_run(const fast_bi_t *bi, cmd_buff_t *cmd);
+int fast_bi_call(const fast_bi_t *bi, cmd_buff_t *cmd);
+void plugins_load(void);
+
+//command history - see dsh_history.c
+#define HIST_FILE_ENV       "DSH_HISTFILE"
+#define HIST_FILE_NAME      ".dsh_history"
+#define HIST_BATCH_LINES    16          // commands per append to the file
+#define HIST_ARENA_SZ       (1024*64)
+#define HIST_NGRAM          3
+#define HIST_GRAM_SLOTS     4096        // initial index size, a power of 2
+
+int hist_init(void);
+bool hist_enabled(void);
+void hist_add(const char *line);
+int hist_flush(void);
+void hist_close(void);
+int hist_count(void);
+const char *hist_line(int id, int *len);
+int hist_search(const char *q, int before);
+int history_builtin(cmd_buff_t *cmd);
+char *hist_readline(const char *prompt, char *buff, int size);
+
+//command substitution and here-documents - see dsh_expand.c
+#define SUBST_OPEN          "$("
+#define HERESTR_OP          "<<<"
+#define HEREDOC_OP          "<<"
+#define HEREDOC_PROMPT      "> "
+#define HEREDOC_MEMFD_NAME  "dsh-heredoc"
+#define SUBST_READ_SZ       (1024*16)   // first size of the capture buffer
+#define EXPAND_FDS_MAX      CMD_MAX     // here-strings/docs per command line
+
+// where the lines of a here-document come from, works like fgets()
+typedef char *(*line_source_fn)(char *buff, int size, void *ctx);
+
+typedef struct expansion {
+    char    *line;                      // the expanded command line
+    int     nfds;
+    int     fds[EXPAND_FDS_MAX];        // memfds behind the rewritten redirects
+} expansion_t;
+
+void expand_set_source(line_source_fn fn, void *ctx);
+bool expand_needed(const char *line);
+int expand_line(const char *line, expansion_t *exp);
+void expand_free(expansion_t *exp);
+
+//interactive event loop - see dsh_events.c
+#define EV_MAX_EVENTS   8
+#define EV_READ_SZ      (1024*4)        // input buffer when the editor is off
+
+#define EV_INPUT        0
+#define EV_REDRAW       1
+#define EV_TIMEOUT      2
+
+int ev_init(void);
+void ev_close(void);
+void ev_set_timeout(long secs);
+int ev_wait_input(void);
+char *ev_readline(const char *prompt, char *buff, int size);
+
+//pipe tuning
+#define PIPE_MAX_SIZE_FILE  "/proc/sys/fs/pipe-max-size"
+
+void set_pipe_size(int fd, long size);
+
 //main execution context
+extern int dsh_last_rc;
 int exec_local_cmd_loop();
+int exec_cmd_line(char *cmd_line);
 int exec_cmd(cmd_buff_t *cmd);
 int execute_pipeline(command_list_t *clist);
 
+//non-interactive execution - see dsh_script.c
+#define SCRIPT_COMMENT_CHAR '#'
+#define SCRIPT_READ_SZ      (1024*64)
+
+int exec_cmd_string(const char *cmds);
+int exec_script_file(const char *path);
+
+//job control stuff - see dsh_jobs.c
+#define JOBS_MAX        16
+
+typedef enum {
+    JOB_FREE,
+    JOB_RUNNING,
+    JOB_STOPPED,
+    JOB_DONE,
+} job_state_t;
+
+typedef struct job {
+    int         id;                 // 1-based job number shown to the user
+    job_state_t state;
+    bool        background;
+    bool        timed;              // report resource usage when done
+    pid_t       pgid;
+    int         num;                // number of stages in the pipeline
+    pid_t       pids[CMD_MAX];
+    int         status[CMD_MAX];    // raw wait status, valid once reaped
+    bool        reaped[CMD_MAX];
+    int         exit_code;          // of the last stage, valid once done
+    struct timespec start;          // just before the first fork
+    struct timespec end[CMD_MAX];   // when each stage was reaped
+    struct rusage rusage[CMD_MAX];  // from wait4()
+    char        cmd_line[SH_CMD_MAX];
+    char        stage_cmds[CMD_MAX][EXE_MAX];
+} job_t;
+
+int jobs_init(bool interactive);
+int jobs_signal_fd(void);
+void jobs_child_setup(pid_t pgid, bool background);
+void jobs_set_pgid(pid_t pid, pid_t pgid);
+void jobs_child_signals(void);
+bool jobs_have_control(void);
+job_t *job_add(command_list_t *clist, pid_t *pids, pid_t pgid, struct timespec *start);
+int job_wait_fg(job_t *job);
+void jobs_reap(void);
+bool jobs_pending(void);
+void jobs_notify(void);
+int jobs_builtin(Built_In_Cmds cmd_type, cmd_buff_t *cmd);
+
+//zygote spawn helper - see dsh_zygote.c
+#define ZYGOTE_MSG_MAX      (1024*128)  // argv + environment of one request
+#define ZYGOTE_ARGV_MAX     CMD_ARGV_MAX
+
+typedef struct zygote_req {
+    char    **argv;
+    char    **envp;                     // NULL for the caller's environ
+    int     fds[3];                     // become stdin, stdout, stderr
+    int     cwd_fd;                     // directory to run in, -1 for ours
+    pid_t   pgid;                       // group to join, 0 for a new one
+    bool    set_pgid;
+    bool    foreground;                 // also hand it the terminal
+} zygote_req_t;
+
+int zygote_start(void);
+bool zygote_running(void);
+pid_t zygote_spawn(zygote_req_t *req);
+
+//parallel fan-out stuff - see dsh_parallel.c
+#define PAR_ITEMS_SEP       ":::"
+#define PAR_ITEM_MARK       "{}"
+#define PAR_DEF_RETRIES     1
+#define PAR_READ_SZ         (1024*16)
+#define PAR_MAX_RC          101
+
+int parallel_builtin(cmd_buff_t *cmd);
+
+//shell options - see dsh_opts.c
+#define OPT_PATH_MAX    256
+
+typedef struct dsh_opts {
+    bool    errexit;                    // set -e, stop at the first failure
+    bool    timing;                     // set -o timing
+    char    time_log[OPT_PATH_MAX];     // set timelog=FILE
+    long    pipe_size;                  // set pipesz=SIZE, 0 keeps the default
+    bool    flowmeter;                  // set -o flowmeter, monitor every |
+    bool    forkall;                    // set -o forkall, no in-process fast path
+    long    tmout;                      // set tmout=SECONDS, idle prompt exits
+} dsh_opts_t;
+
+extern dsh_opts_t dsh_opts;
+int set_builtin(cmd_buff_t *cmd);
+
+//resource accounting - see dsh_timing.c
+void timing_report(job_t *job);
+
+//pipeline flow meter - see dsh_flow.c
+#define FLOW_SPLICE_SZ  (1024*1024)
+#define FLOW_STATUS_MS  500
+#define FLOW_LINE_MAX   512
+
+typedef struct flow {
+    int     num;                        // number of junctions
+    bool    active;                     // any junction monitored at all
+    bool    monitored[CMD_MAX - 1];
+    int     relay[CMD_MAX - 1][2];      // relay -> stage i+1 pipes
+} flow_t;
+
+bool flow_junction_monitored(command_list_t *clist, int i);
+int flow_setup(flow_t *flow, command_list_t *clist);
+int flow_stage_input(flow_t *flow, int pipes[][2], int junction);
+pid_t flow_start(flow_t *flow, int pipes[][2], pid_t pgid);
+void flow_close(flow_t *flow);
 
 
 
@@ -93,6 +320,19 @@ int execute_pipeline(command_list_t *clist);
 #define CMD_OK_HEADER       "PARSED COMMAND LINE - TOTAL COMMANDS %d\n"
 #define CMD_WARN_NO_CMD     "warning: no commands provided\n"
 #define CMD_ERR_PIPE_LIMIT  "error: piping limited to %d commands\n"
+#define CMD_ERR_ARGS_LIMIT  "error: a command is limited to %d words\n"
 #define CMD_ERR_EXECUTE     "error: failed to execute command\n"
+#define CMD_ERR_JOBS_FULL   "error: too many jobs, limit is %d\n"
+#define CMD_ERR_NO_JOB      "%s: no such job\n"
+#define CMD_ERR_SET_OPT     "set: bad option: %s\n"
+#define CMD_ERR_LINE_LONG   "%s: line %d: command longer than %d characters\n"
+#define CMD_ERR_SUBST       "dsh: missing ) in $(...)\n"
+#define CMD_ERR_HEREDOC_DELIM "dsh: << needs a delimiter\n"
+#define CMD_ERR_HEREDOC_MAX "dsh: at most %d here-documents per command line\n"
+#define CMD_WARN_HEREDOC_EOF "dsh: warning: here-document ended by end of input (wanted `%s')\n"
+#define CMD_MSG_TMOUT       "\ndsh: timed out waiting for input: auto-logout\n"
+#define CMD_ERR_PLUGIN      "dsh: plugin %s: %s\n"
+#define CMD_ERR_HIST_USAGE  "usage: history [N | -s TEXT]\n"
+#define CMD_ERR_PAR_USAGE   "usage: parallel [-j N] [-k] [-r RETRIES] cmd [args] [::: items]\n"
 
 #endif
\ No newline at end of file
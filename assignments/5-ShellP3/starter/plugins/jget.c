@@ -0,0 +1,244 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "../dshlib.h"
+
+/*
+ * jget - JSON field extractor plugin.
+ *
+ *      jget FIELD[.SUB...] [FIELD...]
+ *
+ * Reads one JSON object per line (NDJSON, the usual log format) and
+ * prints the named fields of each, tab separated.  Nested objects are
+ * reached with dots, e.g. `jget user.name status`.  Strings are printed
+ * without their quotes, everything else (numbers, true/false/null, whole
+ * objects and arrays) exactly as it appears.  A missing field prints as
+ * an empty string, a line that is not an object is skipped.
+ *
+ * Build with `make plugins` and point DSH_PLUGIN_DIR at plugins/, or copy
+ * jget.so to ~/.dsh/plugins.
+ */
+
+#define JGET_READ_SZ    (1024*64)
+#define JGET_LINE_MAX   (1024*1024)
+
+typedef struct out_buff {
+    int     fd;
+    size_t  len;
+    char    data[JGET_READ_SZ];
+} out_buff_t;
+
+static int out_flush(out_buff_t *out) {
+    size_t done = 0;
+
+    while (done < out->len) {
+        ssize_t n = write(out->fd, out->data + done, out->len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        done += n;
+    }
+    out->len = 0;
+    return 0;
+}
+
+static int out_put(out_buff_t *out, const char *p, size_t len) {
+    while (len > 0) {
+        size_t room = sizeof(out->data) - out->len;
+        size_t n = len < room ? len : room;
+        memcpy(out->data + out->len, p, n);
+        out->len += n;
+        p += n;
+        len -= n;
+        if (out->len == sizeof(out->data) && out_flush(out) < 0) return -1;
+    }
+    return 0;
+}
+
+static const char *skip_ws(const char *p, const char *end) {
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r')) p++;
+    return p;
+}
+
+//p is at an opening quote, returns the position after the closing one
+static const char *skip_string(const char *p, const char *end) {
+    for (p++; p < end; p++) {
+        if (*p == '\\') {
+            p++;
+        } else if (*p == '"') {
+            return p + 1;
+        }
+    }
+    return NULL;
+}
+
+//returns the position just after the value starting at p
+static const char *skip_value(const char *p, const char *end) {
+    int depth = 0;
+
+    if (p >= end) return NULL;
+    if (*p == '"') return skip_string(p, end);
+
+    for (; p < end; p++) {
+        if (*p == '"') {
+            p = skip_string(p, end);
+            if (!p) return NULL;
+            p--;
+        } else if (*p == '{' || *p == '[') {
+            depth++;
+        } else if (*p == '}' || *p == ']') {
+            if (depth == 0) return p;
+            if (--depth == 0) return p + 1;
+        } else if (depth == 0 && (*p == ',' || *p == ' ' || *p == '\t' || *p == '\r')) {
+            return p;
+        }
+    }
+    return depth == 0 ? p : NULL;
+}
+
+/*
+ * Finds the value of path (dotted, path_len long) in the object at p.
+ * On success val and val_end span the raw value.
+ */
+static bool find_field(const char *p, const char *end, const char *path, size_t path_len,
+                       const char **val, const char **val_end) {
+    const char *dot = memchr(path, '.', path_len);
+    size_t key_len = dot ? (size_t)(dot - path) : path_len;
+
+    p = skip_ws(p, end);
+    if (p >= end || *p != '{') return false;
+    p++;
+
+    while (1) {
+        p = skip_ws(p, end);
+        if (p >= end || *p != '"') return false;
+
+        const char *key = p + 1, *key_end = skip_string(p, end);
+        if (!key_end) return false;
+
+        p = skip_ws(key_end, end);
+        if (p >= end || *p != ':') return false;
+        p = skip_ws(p + 1, end);
+
+        const char *v_end = skip_value(p, end);
+        if (!v_end) return false;
+
+        if ((size_t)(key_end - 1 - key) == key_len && memcmp(key, path, key_len) == 0) {
+            if (dot) {
+                return find_field(p, v_end, dot + 1, path_len - key_len - 1, val, val_end);
+            }
+            *val = p;
+            *val_end = v_end;
+            return true;
+        }
+
+        p = skip_ws(v_end, end);
+        if (p >= end || *p != ',') return false;
+        p++;
+    }
+}
+
+//strings lose their quotes and the simple escapes are undone
+static int put_value(out_buff_t *out, const char *v, const char *v_end) {
+    if (*v != '"') return out_put(out, v, v_end - v);
+
+    for (const char *p = v + 1; p < v_end - 1; p++) {
+        char c = *p;
+        if (c == '\\' && p + 1 < v_end - 1) {
+            switch (*++p) {
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case 'u': c = '\\'; p--; break;     // left as is
+                default:  c = *p; break;
+            }
+        }
+        if (out_put(out, &c, 1) < 0) return -1;
+    }
+    return 0;
+}
+
+static int jget_line(cmd_buff_t *cmd, const char *line, const char *end, out_buff_t *out) {
+    line = skip_ws(line, end);
+    if (line >= end || *line != '{') return 0;
+
+    for (int a = 1; a < cmd->argc; a++) {
+        const char *v, *v_end;
+
+        if (a > 1 && out_put(out, "\t", 1) < 0) return -1;
+        if (find_field(line, end, cmd->argv[a], strlen(cmd->argv[a]), &v, &v_end) &&
+            put_value(out, v, v_end) < 0) {
+            return -1;
+        }
+    }
+    return out_put(out, "\n", 1);
+}
+
+static int jget(cmd_buff_t *cmd, int in_fd, int out_fd) {
+    static out_buff_t out;
+    size_t cap = JGET_READ_SZ, len = 0;
+    char *buff;
+    ssize_t n;
+    int rc = 0;
+
+    if (cmd->argc < 2) {
+        fprintf(stderr, "usage: jget FIELD[.SUB...] [FIELD...]\n");
+        return 2;
+    }
+
+    buff = malloc(cap);
+    if (!buff) return 1;
+    out.fd = out_fd;
+    out.len = 0;
+
+    while ((n = read(in_fd, buff + len, cap - len)) != 0) {
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            rc = 1;
+            break;
+        }
+        len += n;
+
+        //hand over every complete line, keep the partial one
+        char *start = buff, *nl;
+        while ((nl = memchr(start, '\n', buff + len - start))) {
+            if (jget_line(cmd, start, nl, &out) < 0) {
+                free(buff);
+                return 1;
+            }
+            start = nl + 1;
+        }
+        len -= start - buff;
+        memmove(buff, start, len);
+
+        if (len == cap) {
+            if (cap >= JGET_LINE_MAX) {
+                fprintf(stderr, "jget: line longer than %d bytes\n", JGET_LINE_MAX);
+                rc = 1;
+                break;
+            }
+            char *grown = realloc(buff, cap * 2);
+            if (!grown) {
+                rc = 1;
+                break;
+            }
+            buff = grown;
+            cap *= 2;
+        }
+    }
+
+    if (rc == 0 && len > 0 && jget_line(cmd, buff, buff + len, &out) < 0) rc = 1;
+    if (out_flush(&out) < 0) rc = 1;
+    free(buff);
+    return rc;
+}
+
+int dsh_plugin_init(const dsh_plugin_api_t *api) {
+    if (api->abi != DSH_PLUGIN_ABI) return -1;
+    return api->register_builtin("jget", jget);
+}
@@ -63,3 +63,267 @@ EOF
     # Assertions
     [ "$status" -ne 0 ]  # Check if the exit status is not 0 (failure)
 }
+
+@test "Test -z is only accepted in server mode" {
+    run $DSH -z
+
+    # Assertions
+    [ "$status" -ne 0 ]
+    [[ "$output" == *"-z can only be used with -s"* ]]
+}
+
+@test "Event-driven server (-e) serves several clients and stop-server" {
+    $DSH -s -i 127.0.0.1 -p 7741 -e > /dev/null 2>&1 &
+    sleep 0.5
+
+    run $DSH -c -i 127.0.0.1 -p 7741 <<EOF
+echo one
+ls | grep dshlib.c
+exit
+EOF
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"one"* ]]
+    [[ "$output" == *"dshlib.c"* ]]
+
+    run $DSH -c -i 127.0.0.1 -p 7741 <<EOF
+stop-server
+EOF
+    [ "$status" -eq 0 ]
+    wait
+}
+
+@test "-o help lists the server options, bad ones are refused" {
+    run $DSH -s -o help
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"workers="* ]]
+    [[ "$output" == *"overflow=block"* ]]
+
+    run $DSH -s -o nosuch=1
+    [ "$status" -ne 0 ]
+    [[ "$output" == *"bad option: nosuch=1"* ]]
+}
+
+@test "Threaded server (-x) worker pool serves clients and stops on stop-server" {
+    $DSH -s -i 127.0.0.1 -p 7742 -x -o workers=2 -o queue=4 > /dev/null 2>&1 &
+    sleep 0.5
+
+    run $DSH -c -i 127.0.0.1 -p 7742 <<EOF
+echo pooled
+stats
+exit
+EOF
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"pooled"* ]]
+    [[ "$output" == *"pool_active 1"* ]]
+    [[ "$output" == *"pool_queued 0"* ]]
+
+    run $DSH -c -i 127.0.0.1 -p 7742 <<EOF
+stop-server
+EOF
+    [ "$status" -eq 0 ]
+    wait
+}
+
+@test "Framed protocol carries output containing the EOF character" {
+    $DSH -s -i 127.0.0.1 -p 7743 -e > /dev/null 2>&1 &
+    sleep 0.5
+
+    run $DSH -c -i 127.0.0.1 -p 7743 <<EOF
+printf "a\004b\n"
+echo after
+stop-server
+EOF
+    [ "$status" -eq 0 ]
+    [[ "$output" == *$'a\004b'* ]]
+    [[ "$output" == *"after"* ]]
+    wait
+}
+
+@test "splice and copy relays return the same output" {
+    $DSH -s -i 127.0.0.1 -p 7744 -e > /dev/null 2>&1 &
+    $DSH -s -i 127.0.0.1 -p 7745 -e -o relay=copy > /dev/null 2>&1 &
+    sleep 0.5
+
+    spliced=$(printf 'cat dshlib.c\nstop-server\n' | $DSH -c -i 127.0.0.1 -p 7744)
+    copied=$(printf 'cat dshlib.c\nstop-server\n' | $DSH -c -i 127.0.0.1 -p 7745 | sed 's/7745/7744/')
+
+    [[ "$spliced" == *"$(cat dshlib.c)"* ]]
+    [ "$spliced" = "$copied" ]
+
+    run $DSH -s -o relay=bogus
+    [ "$status" -ne 0 ]
+    wait
+}
+
+@test "Remote stderr and exit status reach the client separately" {
+    $DSH -s -i 127.0.0.1 -p 7746 -e > /dev/null 2>&1 &
+    sleep 0.5
+
+    run bash -c "printf 'echo out\nls nosuchfile\n' | $DSH -c -i 127.0.0.1 -p 7746 2>/dev/null"
+    [ "$status" -eq 2 ]
+    [[ "$output" == *"out"* ]]
+    [[ "$output" != *"nosuchfile"* ]]
+
+    run bash -c "printf 'ls nosuchfile\n' | $DSH -c -i 127.0.0.1 -p 7746 2>&1 >/dev/null"
+    [[ "$output" == *"nosuchfile"* ]]
+
+    run $DSH -c -i 127.0.0.1 -p 7746 <<EOF
+sh -c "exit 7"
+stop-server
+EOF
+    [ "$status" -eq 7 ]
+    wait
+}
+
+@test "Batch mode (-b) pipelines a script and keeps its output in order" {
+    $DSH -s -i 127.0.0.1 -p 7747 -e -o session_jobs=4 > /dev/null 2>&1 &
+    sleep 0.5
+
+    script=$(mktemp)
+    cat > "$script" <<EOF
+# slow first, its output must still come first
+sh -c "sleep 0.3; echo first"
+echo second
+sh -c "exit 5"
+EOF
+    run $DSH -c -i 127.0.0.1 -p 7747 -b "$script"
+    [ "$status" -eq 5 ]
+    [[ "$output" == *$'first\nsecond'* ]]
+
+    echo stop-server > "$script"
+    run $DSH -c -i 127.0.0.1 -p 7747 -b "$script"
+    [ "$status" -eq 0 ]
+    rm -f "$script"
+    wait
+}
+
+@test "Compressed output (-C) arrives intact and is reported" {
+    $DSH -s -i 127.0.0.1 -p 7748 -e > /dev/null 2>&1 &
+    sleep 0.5
+
+    plain=$(printf 'cat dshlib.c dshlib.c\n' | $DSH -c -i 127.0.0.1 -p 7748 2>/dev/null)
+    run bash -c "printf 'cat dshlib.c dshlib.c\n' | $DSH -c -C -i 127.0.0.1 -p 7748 2>/dev/null"
+    [ "$status" -eq 0 ]
+    [ "$output" = "$plain" ]
+
+    run bash -c "printf 'cat dshlib.c\nstop-server\n' | $DSH -c -C -i 127.0.0.1 -p 7748 2>&1 >/dev/null"
+    [[ "$output" == *"rsh decompressed:"* ]]
+    wait
+
+    run $DSH -s -o compress=maybe
+    [ "$status" -ne 0 ]
+}
+
+@test "cd in one session does not move another session of the same server" {
+    $DSH -s -i 127.0.0.1 -p 7749 -x > /dev/null 2>&1 &
+    sleep 0.5
+
+    printf 'cd /tmp\nsleep 0.5\npwd\n' | $DSH -c -i 127.0.0.1 -p 7749 > "$BATS_TMPDIR/cd_a" &
+    client=$!
+    sleep 0.2
+    run $DSH -c -i 127.0.0.1 -p 7749 <<EOF
+pwd
+cd nosuchdir
+EOF
+    wait "$client"
+    [[ "$output" == *"$PWD"* ]]
+    [[ "$output" == *"cd: nosuchdir"* ]]
+    [ "$status" -eq 1 ]
+    [[ "$(cat "$BATS_TMPDIR/cd_a")" == *"/tmp"* ]]
+
+    run $DSH -c -i 127.0.0.1 -p 7749 <<EOF
+stop-server
+EOF
+    wait
+}
+
+@test "Prefork server (-f) serves clients and refuses a second server on its port" {
+    $DSH -s -i 127.0.0.1 -p 7750 -f -o procs=2 -o backlog=64 > /dev/null 2>&1 &
+    sleep 0.5
+
+    run $DSH -s -i 127.0.0.1 -p 7750 -f -o procs=2
+    [[ "$output" == *"Address already in use"* ]]
+    [ "$status" -ne 0 ]
+
+    run $DSH -c -i 127.0.0.1 -p 7750 <<EOF
+echo prefork
+EOF
+    [ "$status" -eq 0 ]
+    [[ "$output" == *"prefork"* ]]
+
+    run $DSH -c -i 127.0.0.1 -p 7750 <<EOF
+stop-server
+EOF
+    wait
+
+    run $DSH -s -f -z
+    [ "$status" -ne 0 ]
+}
+
+@test "stats reports the server's counters and -o stats_file keeps a copy" {
+    rm -f "$BATS_TMPDIR/rsh_stats"
+    $DSH -s -i 127.0.0.1 -p 7751 -e -o stats_file="$BATS_TMPDIR/rsh_stats" > /dev/null 2>&1 &
+    sleep 0.5
+
+    run $DSH -c -i 127.0.0.1 -p 7751 <<EOF
+echo counted
+cd nosuchdir
+stats
+EOF
+    [[ "$output" == *"conns_active 1"* ]]
+    [[ "$output" == *"cmds 2"* ]]
+    [[ "$output" == *"spawn_us n=1"* ]]
+    [[ "$output" == *"errors -6:1"* ]]
+
+    run $DSH -c -i 127.0.0.1 -p 7751 <<EOF
+stop-server
+EOF
+    wait
+    grep -q "conns_accepted 2" "$BATS_TMPDIR/rsh_stats"
+}
+
+@test "Full server says busy, silent clients and slow commands time out" {
+    $DSH -s -i 127.0.0.1 -p 7752 -e -o max_sessions=1 -o idle_timeout=1 \
+        -o cmd_timeout=1 -o session_children=2 > /dev/null 2>&1 &
+    sleep 0.5
+
+    sleep 4 | $DSH -c -i 127.0.0.1 -p 7752 > /dev/null 2>&1 &
+    sleep 0.3
+    run $DSH -c -i 127.0.0.1 -p 7752 <<EOF
+echo refused
+EOF
+    [[ "$output" == *"server busy"* ]]
+    [ "$status" -ne 0 ]
+    [[ "$output" != *"dsh4> refused"* ]]
+
+    # the silent client is dropped after idle_timeout, 1s ticks
+    sleep 2.5
+    run $DSH -c -i 127.0.0.1 -p 7752 <<EOF
+sleep 30
+echo after
+echo a | cat | cat
+stop-server
+EOF
+    [[ "$output" == *"command timed out after 1s"* ]]
+    [[ "$output" == *"dsh4> after"* ]]
+    [[ "$output" == *"a session may run 2"* ]]
+    wait
+}
+
+@test "A line of only a redirection is refused and the server keeps serving" {
+    $DSH -s -i 127.0.0.1 -p 7753 -e > /dev/null 2>&1 &
+    sleep 0.5
+
+    run $DSH -c -i 127.0.0.1 -p 7753 <<EOF
+> $BATS_TMPDIR/rsh_nocmd
+echo alive
+EOF
+    [[ "$output" == *"redirection without a command"* ]]
+    [[ "$output" == *"alive"* ]]
+
+    run $DSH -c -i 127.0.0.1 -p 7753 <<EOF
+stop-server
+EOF
+    [ "$status" -eq 0 ]
+    wait
+}
@@ -0,0 +1,53 @@
+#!/usr/bin/env bash
+#
+# accept_bench.sh - connection setup rate of the server modes
+#
+# Runs bench/rsh_bench -a against `dsh -s` in each mode: every client
+# connects, waits for the HELLO and closes, over and over, so what is
+# measured is accept() plus the per-connection setup of the mode:
+#
+#   single      one client at a time
+#   threaded    -x, the worker pool of rsh_pool.c
+#   epoll       -e, every client in one event loop (rsh_reactor.c)
+#   prefork-N   -f -o procs=N, N event loops on SO_REUSEPORT sockets
+#
+# The -e and -f modes are also run with a listen backlog of BACKLOG, a
+# queue too short for CONNS clients connecting at once shows up as
+# hello-p99 in the seconds (SYN retransmits).
+#
+# usage: bench/accept_bench.sh [conns] [reqs] [backlog]   (run from starter/)
+
+CONNS=${1:-64}
+REQS=${2:-200}
+BACKLOG=${3:-8}
+BENCH=bench/rsh_bench
+PORT=${RSH_BENCH_PORT:-7950}
+CPUS=$(nproc)
+
+MODES="single:
+threaded:-x -o workers=$CONNS
+epoll:-e
+epoll-bl$BACKLOG:-e -o backlog=$BACKLOG
+prefork-1:-f -o procs=1
+prefork-$CPUS:-f -o procs=$CPUS
+prefork-$CPUS-bl$BACKLOG:-f -o procs=$CPUS -o backlog=$BACKLOG"
+
+make -s dsh "$BENCH" || exit 1
+
+printf "%-16s %6s %8s %8s %9s | %8s %8s %8s %8s\n" "mode" "conns" \
+    "conns/s" "errors" "secs" "p50" "p99" "p999" "max"
+while IFS=: read -r name flags; do
+    PORT=$((PORT + 1))
+    ./dsh -s -i 127.0.0.1 -p "$PORT" $flags > /dev/null 2>&1 &
+    server=$!
+    sleep 0.3
+
+    read -r conns _ reqs errors secs rps _ p50 p99 p999 max _ <<< \
+        "$($BENCH -a -i 127.0.0.1 -p "$PORT" -c "$CONNS" -n "$REQS")"
+    printf "%-16s %6s %8s %8s %9s | %8s %8s %8s %8s\n" "$name" "$conns" \
+        "$rps" "$errors" "$secs" "$p50" "$p99" "$p999" "$max"
+
+    echo stop-server | ./dsh -c -i 127.0.0.1 -p "$PORT" > /dev/null
+    wait "$server"
+done <<< "$MODES"
+echo "(connect to HELLO in microseconds)"
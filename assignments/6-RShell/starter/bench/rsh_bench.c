@@ -0,0 +1,438 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/stat.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * rsh_bench - load generator for rsh_server
+ *
+ *      rsh_bench [-i IP] [-p PORT] [-c CONNS] [-d DEPTH] [-n REQS]
+ *                [-m FILE] [-s SIZES] [-a] [-C] [-v]
+ *
+ * Opens CONNS connections at once and sends REQS commands on each, with
+ * up to DEPTH of them sent ahead of their response (pipelining, the
+ * server runs them one after the other unless -o session_jobs says
+ * otherwise).  Commands are taken in turn from the mix, each connection
+ * starting at a different place in it.  The default mix is `echo`, `ls`
+ * and a `cat` of a file of every size in SIZES (default 1K,64K,1M),
+ * which are written to a temporary directory first, so the server has to
+ * run on this machine.  -m FILE replays the lines of FILE instead.
+ *
+ * Every connection is one non-blocking socket in a single epoll loop, so
+ * the bench itself does not get in the way at hundreds of connections.
+ * A command's latency runs from the moment its CMD frame is queued to
+ * its END frame.  Connections the server does not take right away (the
+ * single-threaded server serves one at a time) first wait for its HELLO,
+ * which is timed separately as the hello latency.
+ *
+ * Prints one line:
+ *
+ *      conns depth requests errors secs req/s MB/s p50 p99 p999 max hello-p99
+ *
+ * latencies in microseconds, MB/s counts command output after
+ * decompression.  -C asks for compressed output (dsh -c -C), -v also
+ * prints a histogram of the latencies.
+ *
+ * -a measures the accept rate instead: every connection is closed as
+ * soon as the HELLO arrives and the slot connects again, REQS times, no
+ * commands are sent.  A request is then one connection and its latency
+ * the time from connect() to the HELLO.
+ *
+ * Built by `make bench/rsh_bench`, bench/rsh_bench.sh drives it over the
+ * server modes and bench/accept_bench.sh measures accepts.
+ */
+
+#define MAX_MIX         256
+#define MAX_DEPTH       RSH_BATCH_WINDOW
+#define HIST_BUCKETS    32          // powers of two of microseconds
+
+typedef struct bconn {
+    int         fd;
+    bool        connected;
+    bool        ready;              // HELLO received
+    bool        closed;
+    double      t_connect;
+    char        *out;               // CMD frames not sent yet
+    size_t      out_len;
+    size_t      out_off;
+    size_t      out_cap;
+    char        *in;
+    size_t      in_len;
+    int         mix_pos;
+    uint32_t    next_id;
+    int         sent;
+    int         done;
+    double      t_sent[MAX_DEPTH];  // by request id % depth
+} bconn_t;
+
+static char *mix[MAX_MIX];
+static int nmix = 0;
+static char tmp_dir[] = "/tmp/rsh_bench.XXXXXX";
+static bool made_dir = false;
+
+static int depth = 1, reqs = 1000;
+static bool accept_mode = false;
+static double *lat, *hello_lat;
+static long nlat = 0, nhello = 0, errors = 0;
+static unsigned long long out_bytes = 0;
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b) {
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static double pct(double *v, long n, double p) {
+    long i = (long)(n * p);
+    if (n == 0) return 0;
+    return v[i >= n ? n - 1 : i];
+}
+
+//"64K", "1M", "512" -> bytes, -1 if it does not parse
+static long parse_size(const char *str) {
+    char *end;
+    long val = strtol(str, &end, 10);
+
+    if (end == str || val < 0) return -1;
+    switch (*end) {
+        case 'k': case 'K': val *= 1024; end++; break;
+        case 'm': case 'M': val *= 1024 * 1024; end++; break;
+        default: break;
+    }
+    return *end == '\0' ? val : -1;
+}
+
+static void cleanup(void) {
+    if (!made_dir) return;
+    for (int i = 0; i < nmix; i++) {
+        if (strncmp(mix[i], "cat ", 4) == 0) unlink(mix[i] + 4);
+    }
+    rmdir(tmp_dir);
+}
+
+//a text file of size bytes, something like what a shell prints
+static int make_file(const char *name, long size) {
+    char path[256], line[64];
+    FILE *f;
+
+    snprintf(path, sizeof(path), "%s/%s", tmp_dir, name);
+    if (!(f = fopen(path, "w"))) return -1;
+    for (long n = 0, i = 0; n < size; i++) {
+        int len = snprintf(line, sizeof(line), "%08ld rsh_bench line of output\n", i);
+        if (n + len > size) len = size - n;
+        fwrite(line, 1, len, f);
+        n += len;
+    }
+    fclose(f);
+
+    mix[nmix] = malloc(strlen(path) + 5);
+    sprintf(mix[nmix++], "cat %s", path);
+    return 0;
+}
+
+static int default_mix(char *sizes) {
+    if (!mkdtemp(tmp_dir)) {
+        perror("mkdtemp");
+        return -1;
+    }
+    made_dir = true;
+    atexit(cleanup);
+
+    mix[nmix++] = "echo hello";
+    mix[nmix++] = "ls";
+    for (char *s = strtok(sizes, ","); s && nmix < MAX_MIX; s = strtok(NULL, ",")) {
+        if (parse_size(s) < 0 || make_file(s, parse_size(s)) < 0) {
+            fprintf(stderr, "rsh_bench: bad size %s\n", s);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int load_mix(const char *path) {
+    char line[1024];
+    FILE *f = fopen(path, "r");
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    while (nmix < MAX_MIX && fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\n")] = '\0';
+        if (line[0] != '\0' && line[0] != '#') mix[nmix++] = strdup(line);
+    }
+    fclose(f);
+    return nmix > 0 ? 0 : -1;
+}
+
+static int out_append(bconn_t *c, const void *data, size_t len) {
+    if (c->out_len + len > c->out_cap) {
+        size_t cap = c->out_cap ? c->out_cap * 2 : RDSH_COMM_BUFF_SZ;
+        while (c->out_len + len > cap) cap *= 2;
+        char *grown = realloc(c->out, cap);
+        if (!grown) return -1;
+        c->out = grown;
+        c->out_cap = cap;
+    }
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+    return 0;
+}
+
+static int bconn_open(bconn_t *c, int epfd, struct sockaddr_in *addr, uint32_t features) {
+    struct epoll_event ev = {.events = EPOLLIN | EPOLLOUT | EPOLLET, .data.ptr = c};
+    char preface[RSH_PREFACE_MAX];
+    int one = 1;
+
+    //a server that is not accepting may take seconds, so connect in the loop
+    c->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
+    if (c->fd < 0 || (connect(c->fd, (struct sockaddr *)addr, sizeof(*addr)) < 0 &&
+                      errno != EINPROGRESS)) {
+        perror("connect");
+        return -1;
+    }
+    setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (accept_mode) {
+        //close with a reset, thousands of sockets in TIME_WAIT would run
+        //us out of local ports
+        struct linger lg = {.l_onoff = 1, .l_linger = 0};
+        setsockopt(c->fd, SOL_SOCKET, SO_LINGER, &lg, sizeof(lg));
+    }
+    epoll_ctl(epfd, EPOLL_CTL_ADD, c->fd, &ev);
+
+    if (!c->in) c->in = malloc(RDSH_COMM_BUFF_SZ);
+    c->next_id = 1;
+    c->t_connect = now_us();
+    int len = rsh_preface_format(preface, sizeof(preface), features);
+    return c->in && out_append(c, preface, len) == 0 ? 0 : -1;
+}
+
+//-a: the next connection of the same slot, buffers and counts stay
+static int bconn_reopen(bconn_t *c, int epfd, struct sockaddr_in *addr, uint32_t features) {
+    c->connected = c->ready = c->closed = false;
+    c->in_len = c->out_len = c->out_off = 0;
+    return bconn_open(c, epfd, addr, features);
+}
+
+static void bconn_close(bconn_t *c, int epfd, bool failed) {
+    if (c->closed) return;
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    c->closed = true;
+    if (failed) errors += reqs - c->done;
+}
+
+//queues commands until DEPTH are outstanding
+static void bconn_fill(bconn_t *c) {
+    char hdr[RSH_FRAME_HDR_SZ];
+
+    while (!accept_mode && c->ready && c->sent < reqs && c->sent - c->done < depth) {
+        const char *cmd = mix[c->mix_pos++ % nmix];
+        size_t len = strlen(cmd);
+
+        rsh_frame_pack(hdr, RSH_FT_CMD, RSH_CH_CTRL, 0, c->next_id, len);
+        if (out_append(c, hdr, sizeof(hdr)) < 0 || out_append(c, cmd, len) < 0) return;
+        c->t_sent[c->next_id++ % depth] = now_us();
+        c->sent++;
+    }
+}
+
+static int bconn_frame(bconn_t *c, const rsh_frame_t *frame, const char *payload) {
+    static char plain[RSH_FRAME_MAX];
+
+    if (!c->ready) {
+        if (frame->type != RSH_FT_HELLO) return -1;
+        c->ready = true;
+        hello_lat[nhello++] = now_us() - c->t_connect;
+        if (accept_mode) {
+            lat[nlat++] = hello_lat[nhello - 1];
+            c->done++;
+        }
+    } else if (frame->type == RSH_FT_DATA && (frame->flags & RSH_FF_LZ)) {
+        int n = rsh_lz_decompress(payload, frame->len, plain, sizeof(plain));
+        if (n < 0) return -1;
+        out_bytes += n;
+    } else if (frame->type == RSH_FT_DATA) {
+        out_bytes += frame->len;
+    } else if (frame->type == RSH_FT_END) {
+        lat[nlat++] = now_us() - c->t_sent[frame->req_id % depth];
+        c->done++;
+    }
+    return 0;
+}
+
+//sends what is queued and handles what arrived, -1 drops the connection
+static int bconn_io(bconn_t *c, uint32_t events) {
+    if (!c->connected) {
+        int err = 0;
+        socklen_t len = sizeof(err);
+
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP))) return 0;
+        getsockopt(c->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err) {
+            static bool warned = false;
+            if (!warned) fprintf(stderr, "rsh_bench: connect: %s\n", strerror(err));
+            warned = true;
+            return -1;
+        }
+        c->connected = true;
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        while (1) {
+            ssize_t n = recv(c->fd, c->in + c->in_len, RDSH_COMM_BUFF_SZ - c->in_len, 0);
+            if (n < 0 && errno == EAGAIN) break;
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return -1;
+            c->in_len += n;
+
+            rsh_frame_t frame;
+            size_t off = 0;
+            int rc;
+            while ((rc = rsh_frame_unpack(c->in + off, c->in_len - off, &frame)) == RSH_FRAME_OK) {
+                if (bconn_frame(c, &frame, c->in + off + RSH_FRAME_HDR_SZ) < 0) return -1;
+                off += RSH_FRAME_HDR_SZ + frame.len;
+            }
+            if (rc != RSH_FRAME_PARTIAL) {
+                static bool warned = false;
+                if (!warned) fprintf(stderr, "rsh_bench: not a frame, server busy or too old?\n");
+                warned = true;
+                return -1;
+            }
+            memmove(c->in, c->in + off, c->in_len - off);
+            c->in_len -= off;
+        }
+    }
+
+    bconn_fill(c);
+    while (c->out_off < c->out_len) {
+        ssize_t n = send(c->fd, c->out + c->out_off, c->out_len - c->out_off, MSG_NOSIGNAL);
+        if (n < 0 && errno == EAGAIN) break;
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) return -1;
+        c->out_off += n;
+    }
+    if (c->out_off == c->out_len) c->out_off = c->out_len = 0;
+    return 0;
+}
+
+static void print_hist(double *v, long n) {
+    long count[HIST_BUCKETS] = {0};
+    long most = 1;
+
+    for (long i = 0; i < n; i++) {
+        int b = 0;
+        while (b < HIST_BUCKETS - 1 && v[i] >= (double)(1L << (b + 1))) b++;
+        if (++count[b] > most) most = count[b];
+    }
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        if (count[b] == 0) continue;
+        printf("%9ldus %8ld |%.*s\n", 1L << b, count[b],
+               (int)(50 * count[b] / most), "##################################################");
+    }
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "usage: %s [-i IP] [-p PORT] [-c CONNS] [-d DEPTH] [-n REQS] "
+                    "[-m FILE] [-s SIZES] [-a] [-C] [-v]\n", prog);
+    exit(2);
+}
+
+int main(int argc, char *argv[]) {
+    char *ip = RDSH_DEF_CLI_CONNECT, *mix_file = NULL, sizes[256] = "1K,64K,1M";
+    int port = RDSH_DEF_PORT, conns = 8, opt;
+    uint32_t features = 0;
+    bool verbose = false;
+
+    while ((opt = getopt(argc, argv, "i:p:c:d:n:m:s:aCv")) != -1) {
+        switch (opt) {
+            case 'i': ip = optarg; break;
+            case 'p': port = atoi(optarg); break;
+            case 'c': conns = atoi(optarg); break;
+            case 'd': depth = atoi(optarg); break;
+            case 'n': reqs = atoi(optarg); break;
+            case 'm': mix_file = optarg; break;
+            case 's': snprintf(sizes, sizeof(sizes), "%s", optarg); break;
+            case 'a': accept_mode = true; break;
+            case 'C': features |= RSH_FEAT_LZ; break;
+            case 'v': verbose = true; break;
+            default: usage(argv[0]);
+        }
+    }
+    if (optind != argc || port <= 0 || conns < 1 || reqs < 1 ||
+        depth < 1 || depth > MAX_DEPTH) {
+        usage(argv[0]);
+    }
+    if (!accept_mode && (mix_file ? load_mix(mix_file) : default_mix(sizes)) < 0) return 1;
+
+    struct sockaddr_in addr = {.sin_family = AF_INET, .sin_port = htons(port)};
+    bconn_t *cs = calloc(conns, sizeof(bconn_t));
+    lat = malloc(sizeof(double) * conns * reqs);
+    hello_lat = malloc(sizeof(double) * conns * (accept_mode ? reqs : 1));
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (!cs || !lat || !hello_lat || epfd < 0 || inet_pton(AF_INET, ip, &addr.sin_addr) != 1) {
+        fprintf(stderr, "rsh_bench: cannot set up\n");
+        return 1;
+    }
+
+    double t0 = now_us();
+    for (int i = 0; i < conns; i++) {
+        if (bconn_open(&cs[i], epfd, &addr, features) < 0) return 1;
+        cs[i].mix_pos = i;
+    }
+
+    //edge triggered: every wakeup drains the socket and sends what it can
+    int open_conns = conns;
+    struct epoll_event evs[RSH_MAX_EVENTS];
+    while (open_conns > 0) {
+        int n = epoll_wait(epfd, evs, RSH_MAX_EVENTS, -1);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("epoll_wait");
+            return 1;
+        }
+        for (int i = 0; i < n; i++) {
+            bconn_t *c = evs[i].data.ptr;
+            if (c->closed) continue;
+            if (bconn_io(c, evs[i].events) < 0) {
+                bconn_close(c, epfd, true);
+                open_conns--;
+            } else if (c->done == reqs) {
+                bconn_close(c, epfd, false);
+                open_conns--;
+            } else if (accept_mode && c->ready) {
+                bconn_close(c, epfd, false);
+                if (bconn_reopen(c, epfd, &addr, features) < 0) return 1;
+            }
+        }
+    }
+    double secs = (now_us() - t0) / 1e6;
+
+    qsort(lat, nlat, sizeof(double), cmp_double);
+    qsort(hello_lat, nhello, sizeof(double), cmp_double);
+    if (verbose) print_hist(lat, nlat);
+    printf("%d %d %ld %ld %.3f %.0f %.1f %.0f %.0f %.0f %.0f %.0f\n",
+           conns, depth, nlat, errors, secs, nlat / secs, out_bytes / secs / 1e6,
+           pct(lat, nlat, 0.5), pct(lat, nlat, 0.99), pct(lat, nlat, 0.999),
+           nlat ? lat[nlat - 1] : 0, pct(hello_lat, nhello, 0.99));
+    return errors ? 1 : 0;
+}
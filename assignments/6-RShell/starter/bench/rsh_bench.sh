@@ -0,0 +1,48 @@
+#!/usr/bin/env bash
+#
+# rsh_bench.sh - the server modes side by side under the same load
+#
+# Starts `dsh -s` in each mode of process_cli_requests() on its own port,
+# runs bench/rsh_bench against it and stops it again:
+#
+#   single      one client at a time, the others wait in the listen backlog
+#   threaded    -x, the worker pool of rsh_pool.c
+#   epoll       -e, every client in one event loop (rsh_reactor.c)
+#   epoll-jobs  -e -o session_jobs=DEPTH, pipelined commands run at once
+#
+# Arguments after the first are passed to rsh_bench, e.g. -C or -m FILE.
+# Add a mode by adding a line to MODES.
+#
+# usage: bench/rsh_bench.sh [conns] [depth] [reqs] [rsh_bench options]   (run from starter/)
+
+CONNS=${1:-16}
+DEPTH=${2:-4}
+REQS=${3:-500}
+shift $(( $# < 3 ? $# : 3 ))
+BENCH=bench/rsh_bench
+PORT=${RSH_BENCH_PORT:-7900}
+
+MODES="single:
+threaded:-x -o workers=$CONNS
+epoll:-e
+epoll-jobs:-e -o session_jobs=$DEPTH"
+
+make -s dsh "$BENCH" || exit 1
+
+printf "%-11s %6s %6s %8s %8s %9s %8s | %8s %8s %8s %8s %9s\n" "mode" "conns" "depth" \
+    "reqs" "errors" "req/s" "MB/s" "p50" "p99" "p999" "max" "hello-p99"
+while IFS=: read -r name flags; do
+    PORT=$((PORT + 1))
+    ./dsh -s -i 127.0.0.1 -p "$PORT" $flags > /dev/null 2>&1 &
+    server=$!
+    sleep 0.3
+
+    read -r conns depth reqs errors _ rps mbs p50 p99 p999 max hello <<< \
+        "$($BENCH -i 127.0.0.1 -p "$PORT" -c "$CONNS" -d "$DEPTH" -n "$REQS" "$@")"
+    printf "%-11s %6s %6s %8s %8s %9s %8s | %8s %8s %8s %8s %9s\n" "$name" "$conns" "$depth" \
+        "$reqs" "$errors" "$rps" "$mbs" "$p50" "$p99" "$p999" "$max" "$hello"
+
+    echo stop-server | ./dsh -c -i 127.0.0.1 -p "$PORT" > /dev/null
+    wait "$server"
+done <<< "$MODES"
+echo "(latencies in microseconds)"
@@ -0,0 +1,49 @@
+#!/usr/bin/env bash
+#
+# startup_bench.sh - start-to-exit time of each build variant of dsh
+#
+# Starts the shell in local mode with a lone `exit` on stdin, which is all
+# loader and initialisation work, and compares the variants from
+# `make variants`:
+#
+#   dsh         default PIE, libc calls bound lazily through PLT stubs as
+#               demos/elf-comp-link/dl_printf.c shows
+#   dsh-now     -Wl,-z,now, every symbol bound at startup
+#   dsh-noplt   -fno-plt, calls through the GOT, also bound at startup
+#   dsh-lto     -O2 -flto, same dynamic linking as dsh
+#   dsh-static  -static, no ld.so and no relocations at all
+#
+# Relocations and ld.so time come from LD_DEBUG=statistics, latencies
+# from bench/startup_bench (see startup_bench.c for how cold runs evict
+# the page cache).
+#
+# usage: bench/startup_bench.sh [warm_runs] [cold_runs]    (run from starter/)
+
+WARM=${1:-2000}
+COLD=${2:-200}
+BENCH=bench/startup_bench
+VARIANTS="dsh dsh-now dsh-noplt dsh-lto dsh-static"
+
+make -s dsh variants "$BENCH" || exit 1
+
+INPUT=$(mktemp /tmp/rsh_startup.XXXXXX)
+trap 'rm -f "$INPUT"' EXIT
+echo exit > "$INPUT"
+
+ld_stats() {
+    LD_DEBUG=statistics "./$1" < "$INPUT" 2>&1 >/dev/null |
+        awk '/total startup time in dynamic loader/ { t = $(NF-1) }
+             /number of relocations:/ { r = $NF }
+             END { printf "%s %s", (r == "" ? 0 : r), (t == "" ? "-" : t) }'
+}
+
+printf "%-11s %7s %10s | %9s %9s %9s | %9s %9s %9s\n" "binary" "relocs" "ld.so" \
+    "warm-p50" "warm-p99" "warm-min" "cold-p50" "cold-p99" "cold-min"
+for bin in $VARIANTS; do
+    read -r relocs ld_time <<< "$(ld_stats "$bin")"
+    read -r _ wmin wmed wp99 _ <<< "$($BENCH -i "$INPUT" -n "$WARM" "./$bin")"
+    read -r _ cmin cmed cp99 _ <<< "$($BENCH -i "$INPUT" -c -n "$COLD" "./$bin")"
+    printf "%-11s %7s %10s | %9s %9s %9s | %9s %9s %9s\n" "$bin" "$relocs" "$ld_time" \
+        "$wmed" "$wp99" "$wmin" "$cmed" "$cp99" "$cmin"
+done
+echo "(latencies in microseconds, ld.so time in CPU cycles)"
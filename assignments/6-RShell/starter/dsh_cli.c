@@ -20,6 +20,9 @@ typedef struct cmd_args{
   char  ip[16];   //e.g., 192.168.100.101\0
   int   port;
   int   threaded_server;
+  int   zygote;
+  char  *batch;   //-b script
+  int   compress; //-C
 }cmd_args_t;
 
 
@@ -30,13 +33,19 @@ typedef struct cmd_args{
 //with passing optional connection parameters. 
 
 void print_usage(const char *progname) {
-  printf("Usage: %s [-c | -s] [-i IP] [-p PORT] [-x] [-h]\n", progname);
+  printf("Usage: %s [-c | -s] [-i IP] [-p PORT] [-b SCRIPT] [-C] [-x | -e | -f] [-z] [-o NAME=VALUE] [-h]\n", progname);
   printf("  Default is to run %s in local mode\n", progname);
   printf("  -c            Run as client\n");
   printf("  -s            Run as server\n");
   printf("  -i IP         Set IP/Interface address (only valid with -c or -s)\n");
   printf("  -p PORT       Set port number (only valid with -c or -s)\n");
+  printf("  -b SCRIPT     Run the commands in SCRIPT without waiting for each (only valid with -c)\n");
+  printf("  -C            Ask the server to compress large output (only valid with -c)\n");
   printf("  -x            Enable threaded mode (only valid with -s)\n");
+  printf("  -e            Serve all clients from one epoll event loop (only valid with -s)\n");
+  printf("  -f            Prefork worker processes sharing the port (only valid with -s)\n");
+  printf("  -z            Start commands from a zygote process (only valid with -s)\n");
+  printf("  -o NAME=VALUE Set a server option, -o help lists them (only valid with -s)\n");
   printf("  -h            Show this help message\n");
   exit(0);
 }
@@ -49,7 +58,7 @@ void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
   cargs->mode = MODE_LCLI;
   cargs->port = RDSH_DEF_PORT;
 
-  while ((opt = getopt(argc, argv, "csi:p:xh")) != -1) {
+  while ((opt = getopt(argc, argv, "csi:p:b:Cxefzo:h")) != -1) {
       switch (opt) {
           case 'c':
               if (cargs->mode != MODE_LCLI) {
@@ -86,12 +95,65 @@ void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
                   exit(EXIT_FAILURE);
               }
               break;
+          case 'b':
+              cargs->batch = optarg;
+              break;
+          case 'C':
+              cargs->compress = 1;
+              break;
           case 'x':
               if (cargs->mode != MODE_SSVR) {
                   fprintf(stderr, "Error: -x can only be used with -s\n");
                   exit(EXIT_FAILURE);
               }
-              cargs->threaded_server = 1;
+              if (cargs->threaded_server && cargs->threaded_server != RSH_MODE_THREADED) {
+                  fprintf(stderr, "Error: Use only one of -x, -e and -f\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->threaded_server = RSH_MODE_THREADED;
+              break;
+          case 'e':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -e can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              if (cargs->threaded_server && cargs->threaded_server != RSH_MODE_REACTOR) {
+                  fprintf(stderr, "Error: Use only one of -x, -e and -f\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->threaded_server = RSH_MODE_REACTOR;
+              break;
+          case 'f':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -f can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              if (cargs->threaded_server && cargs->threaded_server != RSH_MODE_PREFORK) {
+                  fprintf(stderr, "Error: Use only one of -x, -e and -f\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->threaded_server = RSH_MODE_PREFORK;
+              break;
+          case 'z':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -z can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              cargs->zygote = 1;
+              break;
+          case 'o':
+              if (cargs->mode != MODE_SSVR) {
+                  fprintf(stderr, "Error: -o can only be used with -s\n");
+                  exit(EXIT_FAILURE);
+              }
+              if (strcmp(optarg, "help") == 0) {
+                  printf("Server options and their defaults:\n");
+                  rsh_print_opts();
+                  exit(0);
+              }
+              if (rsh_set_opt(optarg) != OK) {
+                  exit(EXIT_FAILURE);
+              }
               break;
           case 'h':
               print_usage(argv[0]);
@@ -105,6 +167,28 @@ void parse_args(int argc, char *argv[], cmd_args_t *cargs) {
       fprintf(stderr, "Error: -x can only be used with -s\n");
       exit(EXIT_FAILURE);
   }
+
+  if (cargs->batch && cargs->mode != MODE_SCLI) {
+      fprintf(stderr, "Error: -b can only be used with -c\n");
+      exit(EXIT_FAILURE);
+  }
+
+  if (cargs->compress && cargs->mode != MODE_SCLI) {
+      fprintf(stderr, "Error: -C can only be used with -c\n");
+      exit(EXIT_FAILURE);
+  }
+
+  //the workers would share the zygote's socket without a lock between them
+  if (cargs->zygote && cargs->threaded_server == RSH_MODE_PREFORK) {
+      fprintf(stderr, "Error: -z cannot be used with -f\n");
+      exit(EXIT_FAILURE);
+  }
+
+  //fork the zygote now, while the server is as small as it will ever be
+  if (cargs->zygote && zygote_start() != OK) {
+      fprintf(stderr, "Error: could not start the zygote\n");
+      exit(EXIT_FAILURE);
+  }
 }
 
 
@@ -129,11 +213,20 @@ int main(int argc, char *argv[]){
       break;
     case MODE_SCLI:
       printf("socket client mode:  addr:%s:%d\n", cargs.ip, cargs.port);
-      rc = exec_remote_cmd_loop(cargs.ip, cargs.port);
+      rsh_client_compress(cargs.compress);
+      if (cargs.batch) {
+        rc = exec_remote_batch(cargs.ip, cargs.port, cargs.batch);
+      } else {
+        rc = exec_remote_cmd_loop(cargs.ip, cargs.port);
+      }
       break;
     case MODE_SSVR:
       printf("socket server mode:  addr:%s:%d\n", cargs.ip, cargs.port);
-      if (cargs.threaded_server){
+      if (cargs.threaded_server == RSH_MODE_PREFORK){
+        printf("-> Prefork Mode\n");
+      } else if (cargs.threaded_server == RSH_MODE_REACTOR){
+        printf("-> Event-Driven Mode\n");
+      } else if (cargs.threaded_server){
         printf("-> Multi-Threaded Mode\n");
       } else {
         printf("-> Single-Threaded Mode\n");
@@ -146,4 +239,9 @@ int main(int argc, char *argv[]){
   }
 
   printf("cmd loop returned %d\n", rc);
+  rsh_lz_report(stderr);
+
+  //scripts see the remote command's exit status, or that dsh itself failed
+  if (cargs.mode == MODE_SCLI && rc == OK) return rsh_remote_status();
+  return (rc == OK || rc == OK_EXIT) ? 0 : EXIT_FAILURE;
 }
\ No newline at end of file
@@ -0,0 +1,269 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#include "dshlib.h"
+
+/*
+ * Zygote spawn helper.
+ *
+ * fork() has to copy the page tables of the caller, so it gets slower as
+ * the shell (or the server) grows.  With `-z` a tiny helper process is
+ * forked during startup, while the caller is still small, and all later
+ * external commands are started by it instead:
+ *
+ *      caller  --request--> zygote --clone(CLONE_PARENT)--> child --exec
+ *
+ * A request is one SOCK_SEQPACKET message on a socketpair.  It carries the
+ * argv and environment strings in the data part and four descriptors,
+ * the child's stdin, stdout and stderr plus the caller's working
+ * directory, as SCM_RIGHTS ancillary data.  The zygote answers with the
+ * pid of the new process, or -errno.
+ *
+ * The child is created with CLONE_PARENT, which makes it a child of the
+ * caller rather than of the zygote.  waitpid(), wait4() rusage and SIGCHLD
+ * therefore behave exactly as if the caller had forked it itself.
+ *
+ * Callers fall back to a plain fork() whenever zygote_spawn() fails.
+ *
+ * 5-ShellP3/starter and 6-RShell/starter each carry this file, as they
+ * do dshlib.c: an assignment directory builds and is handed in on its
+ * own.  The two copies are kept identical, change both.
+ */
+
+typedef struct zyg_hdr {
+    int     argc;
+    int     envc;
+    pid_t   pgid;
+    int     flags;
+} zyg_hdr_t;
+
+#define ZYG_F_SETPGID       0x01
+#define ZYG_F_FOREGROUND    0x02
+#define ZYG_NFDS            4       // stdin, stdout, stderr, cwd
+
+static int   zyg_sock = -1;
+static pthread_mutex_t zyg_lock = PTHREAD_MUTEX_INITIALIZER;
+
+//appends the NULL terminated string array to buff, returns its length
+static int pack_strings(char *const *strs, char *buff, size_t *used, size_t cap) {
+    int n = 0;
+
+    for (; strs[n]; n++) {
+        size_t len = strlen(strs[n]) + 1;
+        if (*used + len > cap) return -1;
+        memcpy(buff + *used, strs[n], len);
+        *used += len;
+    }
+    return n;
+}
+
+//splits n strings back out of buff into vec, which is NULL terminated
+static char *unpack_strings(char *p, char *end, char **vec, int n) {
+    for (int i = 0; i < n; i++) {
+        if (p >= end) return NULL;
+        vec[i] = p;
+        p += strlen(p) + 1;
+    }
+    vec[n] = NULL;
+    return p;
+}
+
+static void zyg_child(zyg_hdr_t *hdr, char **argv, char **envp, int *fds) {
+    if (hdr->flags & ZYG_F_SETPGID) {
+        setpgid(0, hdr->pgid);
+        if (hdr->flags & ZYG_F_FOREGROUND) {
+            tcsetpgrp(STDIN_FILENO, hdr->pgid ? hdr->pgid : getpid());
+        }
+    }
+
+    //the zygote ignores the terminal signals, the command must not
+    signal(SIGINT, SIG_DFL);
+    signal(SIGQUIT, SIG_DFL);
+    signal(SIGTSTP, SIG_DFL);
+    signal(SIGTTIN, SIG_DFL);
+    signal(SIGTTOU, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+
+    for (int i = 0; i < 3; i++) {
+        dup2(fds[i], i);
+    }
+    if (fchdir(fds[3]) < 0) {
+        perror("fchdir");
+    }
+    for (int i = 0; i < ZYG_NFDS; i++) {
+        close(fds[i]);
+    }
+
+    execvpe(argv[0], argv, envp);
+    perror("execvp");
+    _exit(EXIT_FAILURE);
+}
+
+static void zyg_serve(int sock) {
+    static char buff[ZYGOTE_MSG_MAX];
+    char cbuf[CMSG_SPACE(sizeof(int) * ZYG_NFDS)];
+    char *argv[ZYGOTE_ARGV_MAX + 1], **envp;
+
+    signal(SIGINT, SIG_IGN);
+    signal(SIGQUIT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+    signal(SIGTTIN, SIG_IGN);
+    signal(SIGTTOU, SIG_IGN);
+    signal(SIGPIPE, SIG_IGN);
+
+    while (1) {
+        struct iovec iov = {buff, sizeof(buff)};
+        struct msghdr msg = {0};
+        int fds[ZYG_NFDS], nfds = 0;
+        pid_t reply;
+
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+
+        ssize_t n = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;      // caller went away
+        }
+
+        for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+            if (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+                nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                if (nfds > ZYG_NFDS) nfds = ZYG_NFDS;
+                memcpy(fds, CMSG_DATA(c), sizeof(int) * nfds);
+            }
+        }
+
+        zyg_hdr_t *hdr = (zyg_hdr_t *)buff;
+        char *p = buff + sizeof(zyg_hdr_t), *end = buff + n;
+        envp = NULL;
+
+        if ((size_t)n < sizeof(zyg_hdr_t) || nfds != ZYG_NFDS ||
+            hdr->argc < 1 || hdr->argc > ZYGOTE_ARGV_MAX || hdr->envc < 0 ||
+            !(p = unpack_strings(p, end, argv, hdr->argc)) ||
+            !(envp = malloc(sizeof(char *) * (hdr->envc + 1))) ||
+            !unpack_strings(p, end, envp, hdr->envc)) {
+            reply = -EINVAL;
+        } else {
+            //like fork(), but the new process becomes our parent's child
+            reply = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, NULL, NULL, 0);
+            if (reply == 0) {
+                zyg_child(hdr, argv, envp, fds);
+            }
+            if (reply < 0) reply = -errno;
+        }
+
+        free(envp);
+        for (int i = 0; i < nfds; i++) {
+            close(fds[i]);
+        }
+        if (send(sock, &reply, sizeof(reply), 0) < 0) break;
+    }
+    _exit(0);
+}
+
+/*
+ * zygote_start()
+ *      Forks the helper.  Call it as early as possible, the whole point is
+ *      that the caller is still small at this moment.
+ */
+int zygote_start(void) {
+    int sv[2];
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sv) < 0) {
+        perror("socketpair");
+        return ERR_EXEC_CMD;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        close(sv[0]);
+        close(sv[1]);
+        return ERR_EXEC_CMD;
+    }
+    if (pid == 0) {
+        close(sv[0]);
+        zyg_serve(sv[1]);
+    }
+
+    close(sv[1]);
+    zyg_sock = sv[0];
+    return OK;
+}
+
+bool zygote_running(void) {
+    return zyg_sock >= 0;
+}
+
+/*
+ * zygote_spawn(req)
+ *      Asks the zygote to start req->argv with req->fds as stdin, stdout
+ *      and stderr, in the caller's environment and in req->cwd_fd or, if
+ *      that is -1, the caller's current directory.  Safe to call from
+ *      several threads.  Returns the pid, or -1 in which case the caller
+ *      should fork() itself.
+ */
+pid_t zygote_spawn(zygote_req_t *req) {
+    extern char **environ;
+    static char buff[ZYGOTE_MSG_MAX];
+    char cbuf[CMSG_SPACE(sizeof(int) * ZYG_NFDS)];
+    int fds[ZYG_NFDS];
+    pid_t reply = -1;
+
+    if (zyg_sock < 0) return -1;
+
+    fds[3] = req->cwd_fd >= 0 ? req->cwd_fd : open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fds[3] < 0) return -1;
+    memcpy(fds, req->fds, sizeof(int) * 3);
+
+    pthread_mutex_lock(&zyg_lock);
+
+    zyg_hdr_t *hdr = (zyg_hdr_t *)buff;
+    size_t used = sizeof(zyg_hdr_t);
+    hdr->pgid = req->pgid;
+    hdr->flags = (req->set_pgid ? ZYG_F_SETPGID : 0) | (req->foreground ? ZYG_F_FOREGROUND : 0);
+    hdr->argc = pack_strings(req->argv, buff, &used, sizeof(buff));
+    hdr->envc = pack_strings(req->envp ? req->envp : environ, buff, &used, sizeof(buff));
+
+    if (hdr->argc > 0 && hdr->argc <= ZYGOTE_ARGV_MAX && hdr->envc >= 0) {
+        struct iovec iov = {buff, used};
+        struct msghdr msg = {0};
+
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cbuf;
+        msg.msg_controllen = sizeof(cbuf);
+
+        struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * ZYG_NFDS);
+        memcpy(CMSG_DATA(c), fds, sizeof(int) * ZYG_NFDS);
+
+        if (sendmsg(zyg_sock, &msg, MSG_NOSIGNAL) < 0 ||
+            recv(zyg_sock, &reply, sizeof(reply), 0) != sizeof(reply)) {
+            //the zygote died, stop using it
+            close(zyg_sock);
+            zyg_sock = -1;
+            reply = -1;
+        }
+    }
+
+    pthread_mutex_unlock(&zyg_lock);
+    if (fds[3] != req->cwd_fd) close(fds[3]);
+    return reply < 0 ? -1 : reply;
+}
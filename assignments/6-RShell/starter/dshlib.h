@@ -17,6 +17,7 @@ typedef struct command
 } command_t;
 
 #include <stdbool.h>
+#include <sys/types.h>
 
 typedef struct cmd_buff
 {
@@ -33,10 +34,6 @@ typedef struct command_list{
     cmd_buff_t commands[CMD_MAX];
 }command_list_t;
 
-typedef struct {
-    int client_socket;
-} thread_args_t;
-
 //Special character #defines
 #define SPACE_CHAR  ' '
 #define PIPE_CHAR   '|'
@@ -77,6 +74,7 @@ typedef enum {
     BI_CMD_CD,
     BI_CMD_RC,              //extra credit command
     BI_CMD_STOP_SVR,        //new command "stop-server"
+    BI_CMD_STATS,           //"stats", the server's counters
     BI_NOT_BI,
     BI_EXECUTED,
     BI_NOT_IMPLEMENTED,
@@ -84,6 +82,24 @@ typedef enum {
 Built_In_Cmds match_command(const char *input); 
 Built_In_Cmds exec_built_in_cmd(cmd_buff_t *cmd);
 
+//zygote spawn helper - see dsh_zygote.c
+#define ZYGOTE_MSG_MAX      (1024*128)  // argv + environment of one request
+#define ZYGOTE_ARGV_MAX     CMD_ARGV_MAX
+
+typedef struct zygote_req {
+    char    **argv;
+    char    **envp;                     // NULL for the caller's environ
+    int     fds[3];                     // become stdin, stdout, stderr
+    int     cwd_fd;                     // directory to run in, -1 for ours
+    pid_t   pgid;                       // group to join, 0 for a new one
+    bool    set_pgid;
+    bool    foreground;                 // also hand it the terminal
+} zygote_req_t;
+
+int zygote_start(void);
+bool zygote_running(void);
+pid_t zygote_spawn(zygote_req_t *req);
+
 //main execution context
 int exec_local_cmd_loop();
 int exec_cmd(cmd_buff_t *cmd);
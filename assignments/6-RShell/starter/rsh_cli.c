@@ -6,12 +6,182 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
 
 #include "dshlib.h"
 #include "rshlib.h"
 
 
+/*
+ * The receive side keeps what recv() returned in resp_buff and hands out
+ * complete frames, a recv() may end in the middle of one or hold several.
+ */
+typedef struct resp_state {
+    char    *buff;
+    size_t  len;
+} resp_state_t;
+
+//returns bytes received, 0 when the server closed, < 0 on error
+static ssize_t recv_more(int cli_socket, resp_state_t *rs) {
+    ssize_t n = recv(cli_socket, rs->buff + rs->len, RDSH_COMM_BUFF_SZ - rs->len, 0);
+    if (n > 0) rs->len += n;
+    return n;
+}
+
+static void resp_consume(resp_state_t *rs, size_t n) {
+    rs->len -= n;
+    memmove(rs->buff, rs->buff + n, rs->len);
+}
+
+/*
+ * recv_frame(cli_socket, rs, frame)
+ *      Waits until resp_buff starts with a whole frame.  The caller uses
+ *      the payload and then drops the frame with resp_consume().
+ *
+ *  Returns OK, OK_EXIT if the server closed the connection or
+ *  ERR_RDSH_COMMUNICATION.
+ */
+static int recv_frame(int cli_socket, resp_state_t *rs, rsh_frame_t *frame) {
+    while (1) {
+        int rc = rsh_frame_unpack(rs->buff, rs->len, frame);
+        if (rc == RSH_FRAME_OK) return OK;
+        if (rc != RSH_FRAME_PARTIAL) return ERR_RDSH_COMMUNICATION;
+
+        ssize_t n = recv_more(cli_socket, rs);
+        if (n == 0) return OK_EXIT;
+        if (n < 0) return ERR_RDSH_COMMUNICATION;
+    }
+}
+
+/*
+ * recv_legacy(cli_socket, rs, out)
+ *      Old protocol: everything up to RDSH_EOF_CHAR is the response, it is
+ *      written to out unless out is NULL.  Same returns as recv_frame().
+ */
+static int recv_legacy(int cli_socket, resp_state_t *rs, FILE *out) {
+    while (1) {
+        char *eof = memchr(rs->buff, RDSH_EOF_CHAR, rs->len);
+        size_t n = eof ? (size_t)(eof - rs->buff) : rs->len;
+
+        if (out) fwrite(rs->buff, 1, n, out);
+        resp_consume(rs, eof ? n + 1 : n);
+        if (eof) return OK;
+
+        ssize_t got = recv_more(cli_socket, rs);
+        if (got == 0) return OK_EXIT;
+        if (got < 0) return ERR_RDSH_COMMUNICATION;
+    }
+}
+
+//features for the preface, see rsh_client_compress()
+static uint32_t want_features = 0;
+
+/*
+ * Sends our preface.  A framing server answers with HELLO, an older one
+ * runs the preface as a command and its (error) response ends in
+ * RDSH_EOF_CHAR, which is dropped.  Sets framed if frames are on.
+ *
+ * Any server that has no room for us answers RCMD_ERR_SVR_BUSY the old
+ * way and hangs up: that is printed and ends the session with
+ * ERR_RDSH_SERVER.
+ */
+static int negotiate(int cli_socket, resp_state_t *rs, bool *framed) {
+    char preface[RSH_PREFACE_MAX];
+    rsh_frame_t frame;
+    int len = rsh_preface_format(preface, sizeof(preface), want_features);
+
+    if (send(cli_socket, preface, len, MSG_NOSIGNAL) < 0) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+    while (rs->len == 0) {
+        ssize_t n = recv_more(cli_socket, rs);
+        if (n == 0) return OK_EXIT;
+        if (n < 0) return ERR_RDSH_COMMUNICATION;
+    }
+
+    *framed = rs->buff[0] == RSH_PROTO_VERSION;
+    if (!*framed) {
+        size_t busy_len = strlen(RCMD_ERR_SVR_BUSY);
+        while (rs->len < busy_len && !memchr(rs->buff, RDSH_EOF_CHAR, rs->len)) {
+            if (recv_more(cli_socket, rs) <= 0) break;
+        }
+        bool busy = rs->len >= busy_len && memcmp(rs->buff, RCMD_ERR_SVR_BUSY, busy_len) == 0;
+        int rc = recv_legacy(cli_socket, rs, busy ? stderr : NULL);
+        return busy ? ERR_RDSH_SERVER : rc;
+    }
+
+    int rc = recv_frame(cli_socket, rs, &frame);
+    if (rc != OK) return rc;
+    if (frame.type != RSH_FT_HELLO) return ERR_RDSH_COMMUNICATION;
+    resp_consume(rs, RSH_FRAME_HDR_SZ + frame.len);
+    return OK;
+}
+
+//exit status of the last command, from its END frame
+static int remote_status = 0;
+
+/*
+ * Prints a DATA frame or takes the exit status from an END frame.  DATA
+ * on the STDERR channel goes to our stderr, after what is waiting on
+ * stdout so the two keep their order on a terminal.  A compressed DATA
+ * frame is decompressed first.
+ *
+ *  Returns OK, or ERR_RDSH_COMMUNICATION if it does not decompress.
+ */
+static int frame_output(const rsh_frame_t *frame, const char *payload) {
+    static char plain[RSH_FRAME_MAX];
+    int len = frame->len;
+
+    if (frame->type == RSH_FT_DATA) {
+        if (frame->flags & RSH_FF_LZ) {
+            len = rsh_lz_decompress(payload, len, plain, sizeof(plain));
+            if (len < 0) return ERR_RDSH_COMMUNICATION;
+            payload = plain;
+        }
+        if (frame->channel == RSH_CH_STDERR) {
+            fflush(stdout);
+            fwrite(payload, 1, len, stderr);
+        } else {
+            fwrite(payload, 1, len, stdout);
+        }
+    } else if (frame->type == RSH_FT_END && frame->channel == RSH_CH_STATUS &&
+               frame->len >= sizeof(uint32_t)) {
+        uint32_t status;
+        memcpy(&status, payload, sizeof(status));
+        remote_status = ntohl(status);
+    }
+    return OK;
+}
+
+//one command as a CMD frame, the response until its END frame
+static int run_framed(int cli_socket, resp_state_t *rs, char *request_buff, uint32_t req_id) {
+    char *cmd = request_buff + RSH_FRAME_HDR_SZ;
+    size_t len = strlen(cmd);
+    rsh_frame_t frame;
+
+    rsh_frame_pack(request_buff, RSH_FT_CMD, RSH_CH_CTRL, 0, req_id, len);
+    if (send(cli_socket, request_buff, RSH_FRAME_HDR_SZ + len, MSG_NOSIGNAL) < 0) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+
+    while (1) {
+        int rc = recv_frame(cli_socket, rs, &frame);
+        if (rc != OK) return rc;
+
+        bool done = frame.type == RSH_FT_END && frame.req_id == req_id;
+
+        if (frame.req_id == req_id) rc = frame_output(&frame, rs->buff + RSH_FRAME_HDR_SZ);
+        resp_consume(rs, RSH_FRAME_HDR_SZ + frame.len);
+        if (rc != OK || done) return rc;
+    }
+}
+
 /*
  * exec_remote_cmd_loop(server_ip, port)
  *      server_ip:  a string in ip address format, indicating the servers IP
@@ -76,6 +246,12 @@
  *          ERR_RDSH_COMMUNICATION: If there is a communication error, AKA
  *                                  any failures from send() or recv().
  * 
+ *   The steps above are the old protocol, still used when the server does
+ *   not answer our preface (see rsh_proto.c).  Against a server that does,
+ *   commands go out as CMD frames and the response is read frame by frame
+ *   until the END frame for that request, so output may contain any byte
+ *   including RDSH_EOF_CHAR.
+ *
  *   NOTE:  Since there are several exit points and each exit point must
  *          call free() on the buffers allocated, close the socket, and
  *          return an appropriate error code.  Its suggested you use the
@@ -88,11 +264,15 @@
  *   function after cleaning things up.  See the documentation for client_cleanup()
  *      
  */
+
 int exec_remote_cmd_loop(char *address, int port)
 {
-    int cli_socket;
+    int cli_socket, rc;
     char *request_buff = malloc(RDSH_COMM_BUFF_SZ);
     char *resp_buff = malloc(RDSH_COMM_BUFF_SZ);
+    resp_state_t rs = {resp_buff, 0};
+    uint32_t req_id = 0;
+    bool framed = false;
 
     if (!request_buff || !resp_buff) {
         return client_cleanup(-1, request_buff, resp_buff, ERR_MEMORY);
@@ -104,57 +284,303 @@ int exec_remote_cmd_loop(char *address, int port)
         return client_cleanup(cli_socket, request_buff, resp_buff, ERR_RDSH_CLIENT);
     }
 
+    rc = negotiate(cli_socket, &rs, &framed);
+    if (rc != OK) {
+        return client_cleanup(cli_socket, request_buff, resp_buff, rc == OK_EXIT ? OK : rc);
+    }
+
+    //the command is read in after room for the frame header
+    char *cmd = request_buff + RSH_FRAME_HDR_SZ;
+
     while (1) {
 
         printf(SH_PROMPT);
-        if (!fgets(request_buff, RDSH_COMM_BUFF_SZ, stdin)) {
+        if (!fgets(cmd, RDSH_COMM_BUFF_SZ - RSH_FRAME_HDR_SZ, stdin)) {
             break;
         }
 
 
-        request_buff[strcspn(request_buff, "\n")] = '\0';
+        cmd[strcspn(cmd, "\n")] = '\0';
 
-       
-        if (send(cli_socket, request_buff, strlen(request_buff), 0) < 0) {
-            return client_cleanup(cli_socket, request_buff, resp_buff, ERR_RDSH_COMMUNICATION);
+        //like sh, `exit` leaves the status of the command before it
+        bool leaving = strcmp(cmd, "exit") == 0 || strcmp(cmd, "stop-server") == 0;
+        int status = remote_status;
+
+        if (framed) {
+            rc = run_framed(cli_socket, &rs, request_buff, ++req_id);
+            if (leaving) remote_status = status;
+        } else if (send(cli_socket, cmd, strlen(cmd) + 1, MSG_NOSIGNAL) < 0) {
+            //the '\0' ends the command, the server may get several in one recv()
+            rc = ERR_RDSH_COMMUNICATION;
+        } else {
+            rc = recv_legacy(cli_socket, &rs, stdout);
         }
+        fflush(stdout);
 
+        if (rc == OK_EXIT) {
+            return client_cleanup(cli_socket, request_buff, resp_buff, OK);
+        } else if (rc != OK) {
+            return client_cleanup(cli_socket, request_buff, resp_buff, rc);
+        }
 
-        while (1) {
-            ssize_t bytes_received = recv(cli_socket, resp_buff, RDSH_COMM_BUFF_SZ - 1, 0);
-            if (bytes_received < 0) {
-                return client_cleanup(cli_socket, request_buff, resp_buff, ERR_RDSH_COMMUNICATION);
-            } else if (bytes_received == 0) {
 
-                return client_cleanup(cli_socket, request_buff, resp_buff, OK);
-            }
+        if (leaving) {
+            return client_cleanup(cli_socket, request_buff, resp_buff, OK);
+        }
+    }
 
+    return client_cleanup(cli_socket, request_buff, resp_buff, OK);
+}
 
-            resp_buff[bytes_received] = '\0';
+/*
+ * A command of a batch that was sent and has not finished printing.  Only
+ * the oldest one prints as its frames arrive, the frames of the others
+ * are kept in held until it is their turn, so the output comes out in
+ * script order however the server interleaves it.
+ */
+typedef struct batch_req {
+    bool    done;               // its END frame arrived
+    bool    leaving;            // exit or stop-server
+    char    *held;
+    size_t  held_len;
+    size_t  held_cap;
+} batch_req_t;
+
+typedef struct batch {
+    batch_req_t reqs[RSH_BATCH_WINDOW];     // by req_id % RSH_BATCH_WINDOW
+    uint32_t    oldest;         // the request printing now
+    uint32_t    next;           // request id of the next command
+    char        *send_buff;     // CMD frames not sent yet
+    size_t      send_len;
+    size_t      send_off;
+} batch_t;
+
+//grows *buff to hold len more bytes after *used
+static int buff_append(char **buff, size_t *used, size_t *cap, const void *data, size_t len) {
+    if (*used + len > *cap) {
+        size_t new_cap = *cap ? *cap : RDSH_COMM_BUFF_SZ;
+        while (*used + len > new_cap) new_cap *= 2;
+        char *grown = realloc(*buff, new_cap);
+        if (!grown) return ERR_MEMORY;
+        *buff = grown;
+        *cap = new_cap;
+    }
+    memcpy(*buff + *used, data, len);
+    *used += len;
+    return OK;
+}
 
+static int batch_print(batch_req_t *req, const rsh_frame_t *frame, const char *payload) {
+    //like sh, `exit` leaves the status of the command before it
+    if (frame->type == RSH_FT_END && req->leaving) return OK;
+    return frame_output(frame, payload);
+}
+
+static int batch_deliver(batch_t *b, const rsh_frame_t *frame, const char *frame_data) {
+    batch_req_t *req = &b->reqs[frame->req_id % RSH_BATCH_WINDOW];
+
+    if (frame->req_id - b->oldest >= b->next - b->oldest) {
+        return ERR_RDSH_COMMUNICATION;      // not one of ours
+    }
+    if (frame->type == RSH_FT_END) req->done = true;
 
-            int is_eof = (resp_buff[bytes_received - 1] == RDSH_EOF_CHAR);
-            if (is_eof) {
-                resp_buff[bytes_received - 1] = '\0'; 
+    if (frame->req_id != b->oldest) {
+        return buff_append(&req->held, &req->held_len, &req->held_cap,
+                           frame_data, RSH_FRAME_HDR_SZ + frame->len);
+    }
+    int rc = batch_print(req, frame, frame_data + RSH_FRAME_HDR_SZ);
+
+    //the next ones may have finished already
+    while (rc == OK && b->oldest != b->next && b->reqs[b->oldest % RSH_BATCH_WINDOW].done) {
+        free(req->held);
+        memset(req, 0, sizeof(batch_req_t));
+        if (++b->oldest == b->next) break;
+
+        req = &b->reqs[b->oldest % RSH_BATCH_WINDOW];
+        for (size_t off = 0; rc == OK && off < req->held_len; ) {
+            rsh_frame_t held;
+            if (rsh_frame_unpack(req->held + off, req->held_len - off, &held) != RSH_FRAME_OK) {
+                return ERR_RDSH_COMMUNICATION;
             }
+            rc = batch_print(req, &held, req->held + off + RSH_FRAME_HDR_SZ);
+            off += RSH_FRAME_HDR_SZ + held.len;
+        }
+        req->held_len = 0;
+    }
+    return rc;
+}
 
+//the next script line worth sending into cmd, false at end of file
+static bool batch_next_line(FILE *script, char *cmd, int size) {
+    while (fgets(cmd, size, script)) {
+        cmd[strcspn(cmd, "\n")] = '\0';
+        char *start = cmd + strspn(cmd, " \t");
+        if (*start != '\0' && *start != '#') return true;
+    }
+    return false;
+}
 
-            printf("%.*s", (int)bytes_received, resp_buff);
+/*
+ * The framed batch: keeps up to RSH_BATCH_WINDOW commands in flight and
+ * sends and receives at the same time, waiting in poll() for whichever
+ * can make progress.  A client that wrote everything first and read
+ * afterwards could deadlock with a server that stops reading while its
+ * output is not being taken.
+ */
+static int batch_framed(int cli_socket, resp_state_t *rs, FILE *script, char *request_buff) {
+    char *cmd = request_buff + RSH_FRAME_HDR_SZ;
+    batch_t b = {.oldest = 1, .next = 1};
+    size_t send_cap = 0;
+    bool script_done = false;
+    int rc = OK;
+
+    while (rc == OK) {
+        while (!script_done && b.next - b.oldest < RSH_BATCH_WINDOW) {
+            if (!batch_next_line(script, cmd, RDSH_COMM_BUFF_SZ - RSH_FRAME_HDR_SZ)) {
+                script_done = true;
+                break;
+            }
+            batch_req_t *req = &b.reqs[b.next % RSH_BATCH_WINDOW];
+            size_t len = strlen(cmd);
+
+            req->leaving = strcmp(cmd, "exit") == 0 || strcmp(cmd, "stop-server") == 0;
+            script_done = req->leaving;
+            rsh_frame_pack(request_buff, RSH_FT_CMD, RSH_CH_CTRL, 0, b.next++, len);
+            rc = buff_append(&b.send_buff, &b.send_len, &send_cap, request_buff, RSH_FRAME_HDR_SZ + len);
+            if (rc != OK) break;
+        }
+        if (rc != OK || b.oldest == b.next) break;
+
+        struct pollfd pfd = {.fd = cli_socket, .events = POLLIN};
+        if (b.send_off < b.send_len) pfd.events |= POLLOUT;
+        if (poll(&pfd, 1, -1) < 0) {
+            if (errno == EINTR) continue;
+            rc = ERR_RDSH_COMMUNICATION;
+            break;
+        }
 
-            if (is_eof) {
-                break; 
+        if (pfd.revents & POLLOUT) {
+            ssize_t n = send(cli_socket, b.send_buff + b.send_off, b.send_len - b.send_off,
+                             MSG_NOSIGNAL | MSG_DONTWAIT);
+            if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                rc = ERR_RDSH_COMMUNICATION;
+                break;
             }
+            if (n > 0) b.send_off += n;
+            if (b.send_off == b.send_len) b.send_off = b.send_len = 0;
         }
 
+        if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+            ssize_t n = recv_more(cli_socket, rs);
+            if (n <= 0) {
+                //after exit the server closes, anything else is an error
+                rc = n == 0 && b.reqs[b.oldest % RSH_BATCH_WINDOW].leaving ? OK : ERR_RDSH_COMMUNICATION;
+                break;
+            }
 
-        if (strcmp(request_buff, "exit") == 0) {
-            return client_cleanup(cli_socket, request_buff, resp_buff, OK);
-        } else if (strcmp(request_buff, "stop-server") == 0) {
-            return client_cleanup(cli_socket, request_buff, resp_buff, OK);
+            rsh_frame_t frame;
+            int got;
+            while (rc == OK && (got = rsh_frame_unpack(rs->buff, rs->len, &frame)) == RSH_FRAME_OK) {
+                rc = batch_deliver(&b, &frame, rs->buff);
+                resp_consume(rs, RSH_FRAME_HDR_SZ + frame.len);
+            }
+            if (rc == OK && got != RSH_FRAME_PARTIAL) rc = ERR_RDSH_COMMUNICATION;
         }
     }
 
-    return client_cleanup(cli_socket, request_buff, resp_buff, OK);
+    for (int i = 0; i < RSH_BATCH_WINDOW; i++) {
+        free(b.reqs[i].held);
+    }
+    free(b.send_buff);
+    return rc;
+}
+
+//an old server gets the script one command at a time
+static int batch_legacy(int cli_socket, resp_state_t *rs, FILE *script, char *cmd) {
+    while (batch_next_line(script, cmd, RDSH_COMM_BUFF_SZ)) {
+        if (send(cli_socket, cmd, strlen(cmd) + 1, MSG_NOSIGNAL) < 0) {
+            return ERR_RDSH_COMMUNICATION;
+        }
+        int rc = recv_legacy(cli_socket, rs, stdout);
+        if (rc != OK) return rc == OK_EXIT ? OK : rc;
+        if (strcmp(cmd, "exit") == 0 || strcmp(cmd, "stop-server") == 0) break;
+    }
+    return OK;
+}
+
+/*
+ * exec_remote_batch(server_ip, port, script)
+ *      The client's -b mode: runs the commands in the file script over one
+ *      connection without waiting for the response to each before sending
+ *      the next, which hides the round trip that exec_remote_cmd_loop()
+ *      pays per command.  Blank lines and lines starting with # are
+ *      skipped, exit or stop-server ends the batch.
+ *
+ *      How many of the commands run at the same time is up to the server
+ *      (-o session_jobs), their output is printed in script order either
+ *      way.  The exit status is that of the last command, as in
+ *      exec_remote_cmd_loop().
+ *
+ *   returns:
+ *          OK, ERR_MEMORY, ERR_RDSH_CLIENT or ERR_RDSH_COMMUNICATION as
+ *          exec_remote_cmd_loop() does, ERR_RDSH_CLIENT also when script
+ *          cannot be opened
+ */
+int exec_remote_batch(char *address, int port, const char *script)
+{
+    int cli_socket, rc;
+    char *request_buff = malloc(RDSH_COMM_BUFF_SZ);
+    char *resp_buff = malloc(RDSH_COMM_BUFF_SZ);
+    resp_state_t rs = {resp_buff, 0};
+    bool framed = false;
+    FILE *in;
+
+    if (!request_buff || !resp_buff) {
+        return client_cleanup(-1, request_buff, resp_buff, ERR_MEMORY);
+    }
+
+    in = fopen(script, "r");
+    if (!in) {
+        perror(script);
+        return client_cleanup(-1, request_buff, resp_buff, ERR_RDSH_CLIENT);
+    }
+
+    cli_socket = start_client(address, port);
+    if (cli_socket < 0) {
+        fclose(in);
+        return client_cleanup(cli_socket, request_buff, resp_buff, ERR_RDSH_CLIENT);
+    }
+
+    rc = negotiate(cli_socket, &rs, &framed);
+    if (rc == OK && framed) {
+        rc = batch_framed(cli_socket, &rs, in, request_buff);
+    } else if (rc == OK) {
+        rc = batch_legacy(cli_socket, &rs, in, request_buff);
+    }
+    fflush(stdout);
+    fclose(in);
+    return client_cleanup(cli_socket, request_buff, resp_buff, rc == OK_EXIT ? OK : rc);
+}
+
+/*
+ * rsh_remote_status()
+ *      Exit status of the last command the server ran, which is what
+ *      `dsh -c` exits with.  Always 0 against a server that does not
+ *      speak frames, the old protocol does not carry it.
+ */
+int rsh_remote_status(void) {
+    return remote_status;
+}
+
+/*
+ * rsh_client_compress(on)
+ *      The client's -C: ask the server to compress large responses.  Off
+ *      by default, it pays on bulk output over a slow link and only costs
+ *      CPU and latency on small interactive ones.  A server without
+ *      compression (or -o compress=off) just does not grant it.
+ */
+void rsh_client_compress(bool on) {
+    want_features = on ? RSH_FEAT_LZ : 0;
 }
 
 /*
@@ -207,6 +633,10 @@ int start_client(char *server_ip, int port){
         return ERR_RDSH_CLIENT;
     }
 
+    //commands are small and each one is waited for
+    int one = 1;
+    setsockopt(cli_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
     return cli_socket;
 }
 
@@ -0,0 +1,242 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * A small LZ4-style block compressor for DATA frames, negotiated with the
+ * RSH_FEAT_LZ feature bit (see rsh_proto.c).  The format is the LZ4 block
+ * format, a block is a series of sequences:
+ *
+ *      token   literals  offset   more match length
+ *      +----+  +------+  +----+   +----+
+ *      |L |M|  | .... |  |2 LE|   |... |
+ *      +----+  +------+  +----+   +----+
+ *
+ * The high nibble of the token is the number of literals, the low one the
+ * match length minus LZ_MINMATCH.  A nibble of 15 continues in the
+ * bytes that follow, each adding up to 255.  The match is copied from
+ * offset bytes back in the output and may overlap itself.  The last
+ * sequence has literals only, and, as in LZ4, the last LZ_LASTLITERALS
+ * bytes are always literals so the decoder never copies past its end.
+ *
+ * The compressor is greedy, one hash table probe per position, and gives
+ * up early on data that does not compress: after every 64 misses it takes
+ * bigger steps.  That is what makes it cheap enough to run on every frame.
+ *
+ * Both directions keep counters of bytes and CPU time for the compression
+ * ratio report, see rsh_lz_report().
+ */
+
+#define LZ_HASH_BITS        12
+#define LZ_MINMATCH         4
+#define LZ_LASTLITERALS     5
+#define LZ_MFLIMIT          12      // no match starts in the last 12 bytes
+#define LZ_SKIP_SHIFT       6
+#define LZ_MAX_OFFSET       65535
+
+typedef struct lz_stats {
+    atomic_ullong   blocks;
+    atomic_ullong   in;             // bytes offered
+    atomic_ullong   out;            // bytes produced
+    atomic_ullong   ns;             // thread CPU time spent
+} lz_stats_t;
+
+static lz_stats_t packed, unpacked;
+
+static uint64_t cpu_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void lz_account(lz_stats_t *st, size_t in, size_t out, uint64_t ns) {
+    atomic_fetch_add_explicit(&st->blocks, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->in, in, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->out, out, memory_order_relaxed);
+    atomic_fetch_add_explicit(&st->ns, ns, memory_order_relaxed);
+}
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static unsigned lz_hash(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+//a length nibble of 15 continues in bytes of up to 255 each
+static uint8_t *put_length(uint8_t *op, size_t len) {
+    for (; len >= 255; len -= 255) *op++ = 255;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+//worst case size of a sequence with lit literals and a match of mlen
+static size_t seq_bound(size_t lit, size_t mlen) {
+    return 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1;
+}
+
+static int lz_pack(const uint8_t *src, int src_len, uint8_t *dst, int dst_cap) {
+    const uint8_t *ip = src, *anchor = src, *end = src + src_len;
+    const uint8_t *mflimit = end - LZ_MFLIMIT, *matchlimit = end - LZ_LASTLITERALS;
+    uint8_t *op = dst, *oend = dst + dst_cap;
+    uint16_t table[1 << LZ_HASH_BITS];
+    unsigned misses = 0;
+    size_t lit;
+
+    memset(table, 0, sizeof(table));
+    if (src_len >= LZ_MFLIMIT) {
+        ip++;
+        while (ip < mflimit) {
+            unsigned h = lz_hash(read32(ip));
+            const uint8_t *ref = src + table[h];
+
+            table[h] = (uint16_t)(ip - src);
+            if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != read32(ip)) {
+                ip += 1 + (misses++ >> LZ_SKIP_SHIFT);
+                continue;
+            }
+            misses = 0;
+
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t *m = ip + LZ_MINMATCH, *r = ref + LZ_MINMATCH;
+            while (m < matchlimit && *m == *r) {
+                m++;
+                r++;
+            }
+
+            size_t mlen = m - ip - LZ_MINMATCH;
+            uint16_t offset = (uint16_t)(ip - ref);
+            lit = ip - anchor;
+            if (seq_bound(lit, mlen) > (size_t)(oend - op)) return 0;
+
+            uint8_t *token = op++;
+            *token = (lit >= 15 ? 15 : lit) << 4;
+            if (lit >= 15) op = put_length(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+            *op++ = offset & 0xff;
+            *op++ = offset >> 8;
+            *token |= mlen >= 15 ? 15 : mlen;
+            if (mlen >= 15) op = put_length(op, mlen - 15);
+
+            ip = anchor = m;
+        }
+    }
+
+    lit = end - anchor;
+    if (seq_bound(lit, 0) > (size_t)(oend - op)) return 0;
+    *op++ = (lit >= 15 ? 15 : lit) << 4;
+    if (lit >= 15) op = put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return op - dst;
+}
+
+/*
+ * rsh_lz_compress(src, src_len, dst, dst_cap)
+ *      Compresses src_len (at most RSH_LZ_MAX_IN) bytes into dst.
+ *      Returns the compressed size, or 0 when it would not be smaller
+ *      than dst_cap: pass src_len to only compress what gains something.
+ */
+int rsh_lz_compress(const char *src, int src_len, char *dst, int dst_cap) {
+    uint64_t start = cpu_ns();
+    int n = 0;
+
+    if (src_len > 0 && src_len <= RSH_LZ_MAX_IN) {
+        n = lz_pack((const uint8_t *)src, src_len, (uint8_t *)dst, dst_cap);
+    }
+    lz_account(&packed, src_len, n > 0 ? n : src_len, cpu_ns() - start);
+    return n;
+}
+
+/*
+ * rsh_lz_decompress(src, src_len, dst, dst_cap)
+ *      Returns the decompressed size, or -1 if src is not a valid block
+ *      or does not fit in dst_cap.  Every length and offset is checked,
+ *      the input comes from the network.
+ */
+int rsh_lz_decompress(const char *src_, int src_len, char *dst_, int dst_cap) {
+    const uint8_t *ip = (const uint8_t *)src_, *iend = ip + src_len;
+    uint8_t *dst = (uint8_t *)dst_, *op = dst, *oend = dst + dst_cap;
+    uint64_t start = cpu_ns();
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+        size_t lit = token >> 4, mlen = token & 15;
+        uint8_t b;
+
+        if (lit == 15) {
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;          // the last sequence has no match
+
+        if (iend - ip < 2) return -1;
+        size_t offset = ip[0] | ip[1] << 8;
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return -1;
+
+        if (mlen == 15) {
+            do {
+                if (ip >= iend) return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ_MINMATCH;
+        if (mlen > (size_t)(oend - op)) return -1;
+
+        const uint8_t *ref = op - offset;
+        if (offset >= mlen) {
+            memcpy(op, ref, mlen);
+        } else {
+            //overlapping: repeats the last offset bytes
+            for (size_t i = 0; i < mlen; i++) op[i] = ref[i];
+        }
+        op += mlen;
+    }
+
+    lz_account(&unpacked, src_len, op - dst, cpu_ns() - start);
+    return op - dst;
+}
+
+static void report_line(FILE *out, const char *what, lz_stats_t *st) {
+    unsigned long long blocks = atomic_load(&st->blocks);
+    unsigned long long in = atomic_load(&st->in), out_bytes = atomic_load(&st->out);
+    unsigned long long raw = st == &packed ? in : out_bytes;
+    unsigned long long wire = st == &packed ? out_bytes : in;
+
+    if (blocks == 0) return;
+    fprintf(out, "%s %llu frames, %llu -> %llu bytes (%.2f:1), %.1f ms CPU\n",
+            what, blocks, in, out_bytes, wire ? (double)raw / wire : 0.0,
+            atomic_load(&st->ns) / 1e6);
+}
+
+/*
+ * rsh_lz_report(out)
+ *      Prints the compression ratio and CPU time of the frames this
+ *      process compressed and decompressed, nothing if there were none.
+ */
+void rsh_lz_report(FILE *out) {
+    report_line(out, "rsh compressed:  ", &packed);
+    report_line(out, "rsh decompressed:", &unpacked);
+}
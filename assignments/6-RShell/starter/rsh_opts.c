@@ -0,0 +1,158 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Server tunables, set on the command line with -o:
+ *
+ *      dsh -s -x -o workers=32 -o queue=256 -o overflow=busy
+ *      dsh -s -o help          list every option and its default
+ *
+ * Sizes take a K/M/G suffix, options with a fixed set of values refuse
+ * anything else.  All options live in the global rsh_opts structure so
+ * the rest of the server can just read a field.  Adding an option means
+ * adding a field, its default and a row to opt_table below.
+ */
+
+rsh_opts_t rsh_opts = {
+    .workers = RSH_DEF_WORKERS,
+    .queue = RSH_DEF_QUEUE,
+    .overflow = RSH_OVERFLOW_BLOCK,
+    .relay = RSH_RELAY_SPLICE,
+    .session_jobs = RSH_DEF_SESSION_JOBS,
+    .compress = RSH_COMPRESS_ON,
+    .compress_min = RSH_DEF_COMPRESS_MIN,
+    .backlog = RSH_DEF_BACKLOG,
+    .procs = RSH_DEF_PROCS,
+    .stats_file = "",
+    .stats_interval = RSH_DEF_STATS_INTERVAL,
+    .max_sessions = RSH_DEF_MAX_SESSIONS,
+    .session_children = RSH_DEF_SESSION_CHILDREN,
+    .idle_timeout = RSH_DEF_IDLE_TIMEOUT,
+    .cmd_timeout = RSH_DEF_CMD_TIMEOUT,
+};
+
+typedef enum {
+    OPT_STR,
+    OPT_SIZE,
+    OPT_ENUM,               // OPT_STR limited to the '|' separated choices
+} opt_type_t;
+
+typedef struct opt_desc {
+    const char  *name;
+    opt_type_t  type;
+    void        *value;
+    size_t      size;       // buffer size for OPT_STR/OPT_ENUM
+    long        min;        // OPT_SIZE
+    const char  *choices;   // OPT_ENUM
+    const char  *help;
+} opt_desc_t;
+
+static const opt_desc_t opt_table[] = {
+    {"workers",  OPT_SIZE, &rsh_opts.workers, 0, 1, NULL, "-x worker threads"},
+    {"queue",    OPT_SIZE, &rsh_opts.queue, 0, 1, NULL, "-x accepted clients waiting for a worker"},
+    {"overflow", OPT_ENUM, rsh_opts.overflow, sizeof(rsh_opts.overflow), 0, "block|busy",
+                 "-x full queue: block (stop accepting) or busy (reject)"},
+    {"relay",    OPT_ENUM, rsh_opts.relay, sizeof(rsh_opts.relay), 0, "splice|copy",
+                 "command output to the client: splice (zero-copy) or copy"},
+    {"session_jobs", OPT_SIZE, &rsh_opts.session_jobs, 0, 1, NULL,
+                 "commands one client may have running at once"},
+    {"compress", OPT_ENUM, rsh_opts.compress, sizeof(rsh_opts.compress), 0, "on|off",
+                 "compress output for clients that ask (dsh -c -C)"},
+    {"compress_min", OPT_SIZE, &rsh_opts.compress_min, 0, 0, NULL,
+                 "smallest output chunk worth compressing"},
+    {"backlog",  OPT_SIZE, &rsh_opts.backlog, 0, 1, NULL,
+                 "connections waiting to be accepted, per listening socket"},
+    {"procs",    OPT_SIZE, &rsh_opts.procs, 0, 0, NULL, "-f worker processes, 0 = one per CPU"},
+    {"stats_file", OPT_STR, rsh_opts.stats_file, sizeof(rsh_opts.stats_file), 0, NULL,
+                 "write the `stats` output here every stats_interval seconds"},
+    {"stats_interval", OPT_SIZE, &rsh_opts.stats_interval, 0, 1, NULL,
+                 "seconds between stats_file updates"},
+    {"max_sessions", OPT_SIZE, &rsh_opts.max_sessions, 0, 1, NULL,
+                 "clients served at once, more are told the server is busy"},
+    {"session_children", OPT_SIZE, &rsh_opts.session_children, 0, 1, NULL,
+                 "processes one client may have running at once"},
+    {"idle_timeout", OPT_SIZE, &rsh_opts.idle_timeout, 0, 0, NULL,
+                 "seconds before a silent client is disconnected, 0 = never"},
+    {"cmd_timeout", OPT_SIZE, &rsh_opts.cmd_timeout, 0, 0, NULL,
+                 "seconds before a running command is killed, 0 = never"},
+};
+
+#define OPT_TABLE_SZ (int)(sizeof(opt_table) / sizeof(opt_table[0]))
+
+static const opt_desc_t *find_opt(const char *name, size_t len) {
+    for (int i = 0; i < OPT_TABLE_SZ; i++) {
+        if (strlen(opt_table[i].name) == len && strncmp(opt_table[i].name, name, len) == 0) {
+            return &opt_table[i];
+        }
+    }
+    return NULL;
+}
+
+void rsh_print_opts(void) {
+    for (int i = 0; i < OPT_TABLE_SZ; i++) {
+        const opt_desc_t *opt = &opt_table[i];
+        char val[64];
+
+        if (opt->type == OPT_SIZE) {
+            snprintf(val, sizeof(val), "%s=%ld", opt->name, *(long *)opt->value);
+        } else {
+            snprintf(val, sizeof(val), "%s=%s", opt->name, (char *)opt->value);
+        }
+        printf("  -o %-22s%s\n", val, opt->help);
+    }
+}
+
+//"64K", "1M", "65536" -> bytes, -1 if it does not parse
+static long parse_size(const char *str) {
+    char *end;
+    long val = strtol(str, &end, 10);
+
+    if (end == str || val < 0) return -1;
+    switch (*end) {
+        case 'k': case 'K': val *= 1024; end++; break;
+        case 'm': case 'M': val *= 1024 * 1024; end++; break;
+        case 'g': case 'G': val *= 1024 * 1024 * 1024; end++; break;
+        default: break;
+    }
+    return *end == '\0' ? val : -1;
+}
+
+static bool is_choice(const char *choices, const char *val) {
+    size_t len = strlen(val);
+
+    for (const char *p = choices; p; p = strchr(p, '|')) {
+        if (*p == '|') p++;
+        if (strncmp(p, val, len) == 0 && (p[len] == '|' || p[len] == '\0')) return true;
+    }
+    return false;
+}
+
+/*
+ * rsh_set_opt(assignment)
+ *      Applies one NAME=VALUE.  Returns OK or ERR_CMD_ARGS_BAD, which has
+ *      been reported.
+ */
+int rsh_set_opt(const char *assignment) {
+    const char *eq = strchr(assignment, '=');
+    const opt_desc_t *opt = eq ? find_opt(assignment, eq - assignment) : NULL;
+
+    if (opt && opt->type == OPT_SIZE) {
+        long val = parse_size(eq + 1);
+        if (val >= opt->min) {
+            *(long *)opt->value = val;
+            return OK;
+        }
+    } else if (opt && strlen(eq + 1) < opt->size &&
+               (opt->type != OPT_ENUM || is_choice(opt->choices, eq + 1))) {
+        strcpy((char *)opt->value, eq + 1);
+        return OK;
+    }
+
+    fprintf(stderr, CMD_ERR_RDSH_OPT, assignment);
+    return ERR_CMD_ARGS_BAD;
+}
@@ -0,0 +1,264 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <semaphore.h>
+#include <unistd.h>
+#include <sys/socket.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Worker pool of the threaded (-x) server.
+ *
+ * A fixed set of -o workers=N threads is started once.  The accept loop
+ * hands each new client socket to them through a bounded queue of
+ * -o queue=N entries, so there is no pthread_create() or malloc() per
+ * client and the number of threads never grows.
+ *
+ * The queue is a multi-producer multi-consumer ring in which every cell
+ * carries a sequence number (D. Vyukov's bounded MPMC queue): a producer
+ * or consumer claims a position with one compare-and-swap on the head or
+ * tail counter and then only touches its own cell, so pushes and pops
+ * never take a lock.  Two semaphores count the free and the filled cells,
+ * which is what idle workers sleep on and what bounds the queue to
+ * exactly the configured depth even though the ring is a power of two.
+ *
+ * When the queue is full, -o overflow decides:
+ *
+ *      block   the accept loop waits for a free cell, new clients pile
+ *              up in the kernel's listen backlog (backpressure)
+ *      busy    the client gets RCMD_ERR_SVR_BUSY and is disconnected
+ *              right away
+ *
+ * rsh_pool_active() and rsh_pool_queued() report the number of clients
+ * being served and waiting.
+ */
+
+typedef struct pool_cell {
+    atomic_size_t   seq;
+    int             fd;
+} pool_cell_t;
+
+static struct {
+    pool_cell_t     *cells;
+    size_t          mask;
+    _Alignas(64) atomic_size_t head;    // next push
+    _Alignas(64) atomic_size_t tail;    // next pop
+    sem_t           filled;
+    sem_t           free;
+    atomic_int      active;
+    atomic_int      queued;
+    atomic_bool     stopping;
+    bool            busy_reject;
+    int             svr_socket;
+    int             nthreads;
+    pthread_t       *threads;
+} pool;
+
+static bool queue_push(int fd) {
+    size_t pos = atomic_load_explicit(&pool.head, memory_order_relaxed);
+    pool_cell_t *cell;
+
+    while (1) {
+        cell = &pool.cells[pos & pool.mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&pool.head, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;       // full
+        } else {
+            pos = atomic_load_explicit(&pool.head, memory_order_relaxed);
+        }
+    }
+
+    cell->fd = fd;
+    atomic_store_explicit(&cell->seq, pos + 1, memory_order_release);
+    return true;
+}
+
+static bool queue_pop(int *fd) {
+    size_t pos = atomic_load_explicit(&pool.tail, memory_order_relaxed);
+    pool_cell_t *cell;
+
+    while (1) {
+        cell = &pool.cells[pos & pool.mask];
+        size_t seq = atomic_load_explicit(&cell->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&pool.tail, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            return false;       // empty
+        } else {
+            pos = atomic_load_explicit(&pool.tail, memory_order_relaxed);
+        }
+    }
+
+    *fd = cell->fd;
+    atomic_store_explicit(&cell->seq, pos + pool.mask + 1, memory_order_release);
+    return true;
+}
+
+/*
+ * stop-server from one of the sessions: wake the accept loop, which sees
+ * rsh_pool_stopping() and returns OK_EXIT.
+ */
+static void pool_request_stop(void) {
+    atomic_store(&pool.stopping, true);
+    shutdown(pool.svr_socket, SHUT_RDWR);
+}
+
+static void *pool_worker(void *arg) {
+    int fd;
+
+    (void)arg;
+    while (1) {
+        while (sem_wait(&pool.filled) < 0 && errno == EINTR) {
+            // keep waiting
+        }
+        //an earlier push may still be filling in its cell
+        while (!queue_pop(&fd)) {
+            sched_yield();
+        }
+        atomic_fetch_sub(&pool.queued, 1);
+        sem_post(&pool.free);
+
+        if (fd < 0) break;      // rsh_pool_stop()
+
+        atomic_fetch_add(&pool.active, 1);
+        int rc = exec_client_requests(fd);
+        atomic_fetch_sub(&pool.active, 1);
+
+        if (rc == OK_EXIT) pool_request_stop();
+    }
+    return NULL;
+}
+
+/*
+ * rsh_pool_start(svr_socket)
+ *      Starts the workers.  svr_socket is shut down when a client sends
+ *      `stop-server`, to get the accept loop out of accept().
+ *
+ *  Returns:
+ *      OK
+ *      ERR_CMD_ARGS_BAD        bad -o workers/queue/overflow, reported
+ *      ERR_RDSH_SERVER         could not allocate or start the threads
+ */
+int rsh_pool_start(int svr_socket) {
+    size_t cap = 1;
+
+    if (rsh_opts.workers < 1 || rsh_opts.queue < 1 ||
+        (strcmp(rsh_opts.overflow, RSH_OVERFLOW_BLOCK) != 0 &&
+         strcmp(rsh_opts.overflow, RSH_OVERFLOW_BUSY) != 0)) {
+        fprintf(stderr, CMD_ERR_RDSH_POOL_OPTS);
+        return ERR_CMD_ARGS_BAD;
+    }
+
+    //the sentinels rsh_pool_stop() pushes need room too
+    while (cap < (size_t)(rsh_opts.queue + rsh_opts.workers)) cap *= 2;
+
+    memset(&pool, 0, sizeof(pool));
+    pool.cells = calloc(cap, sizeof(pool_cell_t));
+    pool.threads = calloc(rsh_opts.workers, sizeof(pthread_t));
+    if (!pool.cells || !pool.threads) {
+        perror("calloc");
+        free(pool.cells);
+        free(pool.threads);
+        return ERR_RDSH_SERVER;
+    }
+
+    pool.mask = cap - 1;
+    for (size_t i = 0; i < cap; i++) {
+        atomic_init(&pool.cells[i].seq, i);
+    }
+    sem_init(&pool.filled, 0, 0);
+    sem_init(&pool.free, 0, rsh_opts.queue);
+    pool.busy_reject = strcmp(rsh_opts.overflow, RSH_OVERFLOW_BUSY) == 0;
+    pool.svr_socket = svr_socket;
+
+    for (int i = 0; i < rsh_opts.workers; i++) {
+        if (pthread_create(&pool.threads[i], NULL, pool_worker, NULL) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        pool.nthreads++;
+    }
+    return pool.nthreads > 0 ? OK : ERR_RDSH_SERVER;
+}
+
+/*
+ * rsh_pool_submit(fd)
+ *      Queues an accepted client.  With overflow=block this waits for room,
+ *      with overflow=busy a client that does not fit is rejected.  Either
+ *      way fd belongs to the pool afterwards.
+ */
+void rsh_pool_submit(int fd) {
+    if (pool.busy_reject) {
+        if (sem_trywait(&pool.free) < 0) {
+            rsh_reject_busy(fd);
+            return;
+        }
+    } else {
+        while (sem_wait(&pool.free) < 0 && errno == EINTR) {
+            // keep waiting
+        }
+    }
+
+    atomic_fetch_add(&pool.queued, 1);
+    queue_push(fd);             // cannot fail, we own a free cell
+    sem_post(&pool.filled);
+}
+
+bool rsh_pool_stopping(void) {
+    return atomic_load(&pool.stopping);
+}
+
+//only -x starts a pool
+bool rsh_pool_running(void) {
+    return pool.nthreads > 0;
+}
+
+int rsh_pool_active(void) {
+    return atomic_load(&pool.active);
+}
+
+int rsh_pool_queued(void) {
+    return atomic_load(&pool.queued);
+}
+
+/*
+ * rsh_pool_stop()
+ *      Drops the clients still waiting in the queue and lets the idle
+ *      workers exit.  Workers in the middle of a session are not waited
+ *      for, they end with the process.
+ */
+void rsh_pool_stop(void) {
+    int fd;
+
+    while (sem_trywait(&pool.filled) == 0) {
+        while (!queue_pop(&fd)) {
+            sched_yield();
+        }
+        atomic_fetch_sub(&pool.queued, 1);
+        close(fd);
+    }
+    for (int i = 0; i < pool.nthreads; i++) {
+        queue_push(-1);
+        sem_post(&pool.filled);
+    }
+}
@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Prefork (-f) server mode.
+ *
+ * One accept loop, however it is organised, takes every new connection
+ * off one listen queue.  Here -o procs=N worker processes each get their
+ * own listening socket, all bound to the same address with SO_REUSEPORT,
+ * and the kernel spreads incoming connections over the N queues.  Every
+ * worker runs the event loop of the -e mode (rsh_reactor_run()) on its
+ * socket, so nothing is shared between them and no lock is taken on the
+ * accept path.
+ *
+ * The parent does not serve clients, it supervises:
+ *
+ *      - it binds all N sockets before forking, so a port in use is an
+ *        error at startup and not a worker that dies over and over, and
+ *        not a port silently shared with another server either
+ *      - it keeps them open, so when a worker dies the connections
+ *        waiting in its queue are not lost, the replacement accepts them
+ *      - a worker that exits after `stop-server` stops the others, any
+ *        other exit or signal gets the worker restarted, after a pause
+ *        if it did not even live for RSH_PREFORK_MIN_LIFE seconds
+ *
+ * -z does not combine with -f, the zygote's socket would be shared by
+ * processes that cannot lock it against each other.
+ */
+
+#define RSH_PREFORK_MIN_LIFE    1       //seconds, died sooner: pause before restarting
+
+typedef struct prefork_worker {
+    pid_t   pid;
+    int     sock;
+    time_t  started;
+} prefork_worker_t;
+
+static prefork_worker_t *workers;
+static int nworkers;
+
+static int worker_procs(void) {
+    long n = rsh_opts.procs > 0 ? rsh_opts.procs : sysconf(_SC_NPROCESSORS_ONLN);
+    return n > 0 ? (int)n : 1;
+}
+
+static pid_t worker_start(int slot) {
+    prefork_worker_t *w = &workers[slot];
+
+    fflush(NULL);           // or the child writes out our buffered output again
+    w->pid = fork();
+    if (w->pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (w->pid == 0) {
+        for (int i = 0; i < nworkers; i++) {
+            if (i != slot) close(workers[i].sock);
+        }
+        int rc = rsh_reactor_run(w->sock);
+        _exit(rc == OK_EXIT ? EXIT_SUCCESS : EXIT_FAILURE);
+    }
+    w->started = time(NULL);
+    return w->pid;
+}
+
+static int worker_slot(pid_t pid) {
+    for (int i = 0; i < nworkers; i++) {
+        if (workers[i].pid == pid) return i;
+    }
+    return -1;
+}
+
+static void workers_stop(void) {
+    for (int i = 0; i < nworkers; i++) {
+        if (workers[i].pid > 0) kill(workers[i].pid, SIGTERM);
+    }
+    for (int i = 0; i < nworkers; i++) {
+        if (workers[i].pid > 0) waitpid(workers[i].pid, NULL, 0);
+        close(workers[i].sock);
+    }
+    free(workers);
+}
+
+/*
+ * rsh_prefork_run(ifaces, port)
+ *      The -f server mode: binds the sockets, starts the workers and
+ *      supervises them until one of them is told to `stop-server`.
+ *
+ *  Returns:
+ *      OK_EXIT                 stop-server
+ *      ERR_RDSH_COMMUNICATION  the sockets could not be set up
+ *      ERR_RDSH_SERVER         no worker could be started
+ */
+int rsh_prefork_run(char *ifaces, int port) {
+    nworkers = worker_procs();
+    workers = calloc(nworkers, sizeof(prefork_worker_t));
+    if (!workers) return ERR_MEMORY;
+
+    //SO_REUSEPORT would let us join another server already on the port,
+    //binding it once without makes sure there is none
+    int probe = boot_server(ifaces, port);
+    if (probe < 0) {
+        free(workers);
+        return probe;
+    }
+    close(probe);
+
+    for (int i = 0; i < nworkers; i++) {
+        workers[i].sock = rsh_boot_shared(ifaces, port);
+        if (workers[i].sock < 0) {
+            int rc = workers[i].sock;
+            while (i-- > 0) close(workers[i].sock);
+            free(workers);
+            return rc;
+        }
+    }
+
+    for (int i = 0; i < nworkers; i++) {
+        if (worker_start(i) < 0) {
+            workers_stop();
+            return ERR_RDSH_SERVER;
+        }
+    }
+    printf("-> %d worker processes\n", nworkers);
+    fflush(stdout);
+
+    int rc = OK_EXIT;
+    while (1) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
+        if (pid < 0) {
+            if (errno == EINTR) continue;
+            perror("waitpid");      // ECHILD: every restart failed
+            rc = ERR_RDSH_SERVER;
+            break;
+        }
+
+        int slot = worker_slot(pid);
+        if (slot < 0) continue;
+        workers[slot].pid = 0;
+        rsh_stats_release(pid);
+        if (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS) break;     // stop-server
+
+        if (WIFSIGNALED(status)) {
+            fprintf(stderr, "rsh: worker %d killed by signal %d, restarting\n", pid, WTERMSIG(status));
+        } else {
+            fprintf(stderr, "rsh: worker %d exited with %d, restarting\n", pid, WEXITSTATUS(status));
+        }
+        if (time(NULL) - workers[slot].started < RSH_PREFORK_MIN_LIFE) {
+            sleep(RSH_PREFORK_MIN_LIFE);
+        }
+        worker_start(slot);
+    }
+
+    workers_stop();
+    return rc;
+}
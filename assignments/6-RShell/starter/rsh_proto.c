@@ -0,0 +1,115 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <arpa/inet.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * The framed rsh protocol, shared by rsh_cli.c and rsh_server.c.
+ *
+ * A connection starts with a one line preface from the client:
+ *
+ *      "\x01RSH/<version> <features in hex>\n"
+ *
+ * A server that knows frames answers with a HELLO frame carrying the
+ * version it will speak and the features it granted, and from then on
+ * everything in both directions is a frame:
+ *
+ *       0        1        2        3        4            8            12
+ *      +--------+--------+--------+--------+------------+------------+---------
+ *      |version | type   |channel | flags  | request id |   length   | payload
+ *      +--------+--------+--------+--------+------------+------------+---------
+ *                                             (both 32 bit, network byte order)
+ *
+ *      HELLO   server -> client, payload: granted features (32 bit)
+ *      CMD     client -> server, payload: the command line, no '\0'
+ *      DATA    server -> client, output of request id on channel STDOUT
+ *              or STDERR
+ *      END     server -> client, request id is finished, payload on
+ *              channel STATUS: its exit status (32 bit)
+ *
+ * Output is no longer scanned for RDSH_EOF_CHAR, so it may contain any
+ * byte, and neither side assumes a recv() returns a whole message: both
+ * buffer what they received and take out complete frames only.
+ *
+ * Features are bits, the server grants the ones it supports of those the
+ * client asked for.  RSH_FEAT_LZ lets the server compress DATA frames:
+ * such a frame has RSH_FF_LZ in its flags and its payload is an LZ block
+ * (rsh_lz.c) of at most RSH_FRAME_MAX bytes once decompressed.  The
+ * server only does it for chunks of -o compress_min bytes or more, and
+ * only when the block comes out smaller, everything else is sent as is.
+ *
+ * A client may send further CMD frames before the END of the previous
+ * one.  The server can then run several at once (-o session_jobs), and
+ * the frames of their responses interleave: the request id says which
+ * command a frame belongs to.
+ *
+ * A client or a tool like nc that starts with anything but the preface
+ * gets the old protocol: commands end in '\0' or a newline and responses
+ * in RDSH_EOF_CHAR.  A server that predates frames runs the preface as a
+ * (failing) command and answers in that protocol, which tells the client
+ * to fall back.
+ */
+
+void rsh_frame_pack(char *hdr, uint8_t type, uint8_t channel, uint8_t flags,
+                    uint32_t req_id, uint32_t len) {
+    uint32_t n_req_id = htonl(req_id), n_len = htonl(len);
+
+    hdr[0] = RSH_PROTO_VERSION;
+    hdr[1] = type;
+    hdr[2] = channel;
+    hdr[3] = flags;
+    memcpy(hdr + 4, &n_req_id, sizeof(n_req_id));
+    memcpy(hdr + 8, &n_len, sizeof(n_len));
+}
+
+/*
+ * rsh_frame_unpack(buff, avail, frame)
+ *      Looks at the avail bytes received so far.
+ *
+ *  Returns:
+ *      RSH_FRAME_OK            a whole frame is there, its payload starts
+ *                              RSH_FRAME_HDR_SZ bytes into buff
+ *      RSH_FRAME_PARTIAL       receive more first
+ *      ERR_RDSH_COMMUNICATION  not a frame we understand
+ */
+int rsh_frame_unpack(const char *buff, size_t avail, rsh_frame_t *frame) {
+    uint32_t n_req_id, n_len;
+
+    if (avail < RSH_FRAME_HDR_SZ) return RSH_FRAME_PARTIAL;
+
+    frame->version = buff[0];
+    frame->type = buff[1];
+    frame->channel = buff[2];
+    frame->flags = buff[3];
+    memcpy(&n_req_id, buff + 4, sizeof(n_req_id));
+    memcpy(&n_len, buff + 8, sizeof(n_len));
+    frame->req_id = ntohl(n_req_id);
+    frame->len = ntohl(n_len);
+
+    if (frame->version != RSH_PROTO_VERSION || frame->len > RSH_FRAME_MAX) {
+        return ERR_RDSH_COMMUNICATION;
+    }
+    return avail - RSH_FRAME_HDR_SZ >= frame->len ? RSH_FRAME_OK : RSH_FRAME_PARTIAL;
+}
+
+int rsh_preface_format(char *buff, size_t size, uint32_t features) {
+    return snprintf(buff, size, RSH_PREFACE_FMT, RSH_PROTO_VERSION, features);
+}
+
+/*
+ * rsh_preface_parse(line, features)
+ *      line is the preface without its newline.  Returns the client's
+ *      version, or -1 if this is not a preface.
+ */
+int rsh_preface_parse(const char *line, uint32_t *features) {
+    int version;
+
+    if (sscanf(line, RSH_PREFACE_SCAN, &version, features) != 2 || version < 1) {
+        return -1;
+    }
+    return version;
+}
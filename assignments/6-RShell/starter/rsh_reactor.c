@@ -0,0 +1,1223 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <sys/timerfd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Event-driven core of rsh_server.
+ *
+ * Every client connection is a small state machine that is driven by
+ * epoll events instead of by a thread blocked in recv():
+ *
+ *      READ_CMD  --complete command-->  RUNNING  --all jobs done-->  READ_CMD
+ *          |                               |
+ *          +--- exit / stop-server / hangup / error ---> closed
+ *
+ * In RUNNING the last stage of the pipeline writes into a pipe, and the
+ * read end of that pipe is just another fd in the loop.  Every stage's
+ * stderr goes to a second pipe on framed connections, whose output then
+ * travels as its own channel, and into the same pipe on old style ones.
+ * Output is moved from the pipe into the connection's output buffer and
+ * from there to the non-blocking socket.  When the buffer is above
+ * RSH_OUT_HIWAT the pipe is taken out of the loop, so a slow client
+ * throttles its own command and nobody else.  With -o relay=splice (the
+ * default) the output does not pass through the buffer at all: splice()
+ * moves it from the pipe to the socket inside the kernel, see
+ * job_splice().  A client that negotiated compression always gets the
+ * copy, job_compress() needs the bytes.
+ *
+ * Commands the client sends ahead are read and queued meanwhile, up to
+ * RDSH_COMM_BUFF_SZ of them.  A framed client may have up to
+ * -o session_jobs of them running at once, each in a job slot and each
+ * answered in frames tagged with its request id, an old style client one
+ * at a time.  Built-ins wait until the jobs before them are done, so
+ * `cd`, `rc` and `exit` see the session as the client sent it.
+ *
+ * Each connection has its own working directory as an open descriptor,
+ * `cd` replaces it and commands run in it (rsh_change_dir(),
+ * rsh_execute_pipeline()).  The server process never changes directory,
+ * so clients sharing a threaded or -e server do not see each other's cd.
+ *
+ * Children are reaped through a pidfd per stage, also in the loop, so no
+ * SIGCHLD handling is needed and threads never reap each other's children.
+ * A command is finished once its pipes hit end of file and every stage
+ * was reaped, then the END frame with its exit status or the EOF
+ * character is sent.
+ *
+ * Nothing waits forever.  A loop has a timerfd that ticks every
+ * RSH_TIMER_TICK while timeouts are configured (on_timer()):
+ *
+ *      -o idle_timeout     a connection without a running command that
+ *                          moved no byte either way for that long is
+ *                          closed, a client that went quiet or left its
+ *                          last reply unread no longer holds a thread or
+ *                          a place.  One that stops reading while its
+ *                          command runs stalls that command, which only
+ *                          -o cmd_timeout ends.  Off by default, like
+ *                          cmd_timeout, an interactive user may think
+ *                          for a while
+ *      -o cmd_timeout      the stages of a command running that long are
+ *                          killed, the client gets CMD_ERR_RDSH_TIMEOUT
+ *
+ * A session is also limited to -o session_children running processes: a
+ * pipeline that would go over waits for the jobs before it, like a
+ * built-in does, and one that is too long on its own is refused.  How
+ * many sessions the server takes at all is -o max_sessions, checked when
+ * one starts, see rsh_session_admit() and rsh_reject_busy().
+ *
+ * The same machinery serves all server modes.  In -e mode one loop owns
+ * the listening socket and every connection (rsh_reactor_run()).  The
+ * single-threaded and threaded modes run a private loop for one client
+ * (rsh_session_run(), what exec_client_requests() calls).
+ *
+ * A connection is never freed from inside a handler: conn_close() parks
+ * it on the dead list and the loop frees it after the current batch of
+ * events, which may still hold pointers into it.
+ */
+
+typedef struct rsh_loop rsh_loop_t;
+typedef struct rsh_watch rsh_watch_t;
+typedef void (*watch_fn)(rsh_watch_t *w, uint32_t events);
+
+struct rsh_watch {
+    int         fd;
+    uint32_t    events;             // what it is registered for, 0 = not
+    watch_fn    fn;
+    void        *owner;
+};
+
+typedef struct rsh_buf {
+    char    *data;
+    size_t  len;
+    size_t  off;                    // consumed from the front
+    size_t  cap;
+} rsh_buf_t;
+
+typedef enum {
+    CONN_READ_CMD,
+    CONN_RUNNING,
+    CONN_CLOSED,
+} conn_state_t;
+
+typedef enum {
+    PROTO_UNKNOWN,                  // nothing received yet
+    PROTO_EOF,                      // '\0' ended commands, RDSH_EOF_CHAR ended output
+    PROTO_FRAMED,                   // rsh_frame_t both ways, see rsh_proto.c
+} conn_proto_t;
+
+//a pipeline the connection is running, one of its job slots
+typedef struct rsh_job {
+    struct rsh_conn *conn;
+    bool        busy;               // slot in use
+    uint32_t    req_id;             // of the command it runs
+    unsigned    seq;                // its place in the session
+    rsh_watch_t out;                // read end of the output pipe
+    rsh_watch_t err;                // stderr pipe, fd -1 if it goes to out
+    rsh_watch_t procs[CMD_MAX];     // one pidfd per stage, fd -1 if none
+    pid_t       pids[CMD_MAX];      // 0 once reaped
+    int         npids;
+    int         nrunning;
+    int         status;             // exit code of the last stage
+    uint64_t    started;            // rsh_stats_now() before the first fork
+    bool        timed_out;          // killed by -o cmd_timeout
+    size_t      splice_left;        // announced output still in the pipe
+} rsh_job_t;
+
+typedef struct rsh_conn {
+    struct rsh_conn *next;
+    rsh_loop_t      *loop;
+    rsh_watch_t     sock;
+    conn_state_t    state;
+    conn_proto_t    proto;
+    uint32_t        req_id;         // of the command being read
+    unsigned        seq;            // commands read so far
+    bool            closing;        // exit: close once the output is out
+    bool            stop_server;    // stop-server: stop the loop when closed
+    bool            peer_closed;    // client shut down its side
+    bool            splice;         // relay output with splice()
+    bool            sock_full;      // splice() waits for the socket
+    bool            compress;       // RSH_FEAT_LZ granted
+    int             dir_fd;         // its working directory, see rsh_change_dir()
+    uint64_t        last_active;    // rsh_stats_now() of the last byte in or out
+    int             last_rc;
+    unsigned        last_seq;       // the command last_rc belongs to
+    rsh_buf_t       in;
+    rsh_buf_t       out;
+    rsh_job_t       *splicing;      // its spliced frame is half sent
+    rsh_job_t       *jobs;          // max_jobs slots
+    int             max_jobs;
+    int             njobs;          // busy slots
+} rsh_conn_t;
+
+struct rsh_loop {
+    int         epfd;
+    rsh_watch_t listener;           // fd -1 when serving a single client
+    rsh_watch_t timer;              // timeout checks, fd -1 without timeouts
+    rsh_conn_t  *conns;
+    rsh_conn_t  *dead;
+    bool        stop;
+};
+
+static void conn_step(rsh_conn_t *c);
+static void conn_close(rsh_conn_t *c);
+static void conn_put(rsh_conn_t *c, const void *data, size_t len);
+static void on_timer(rsh_watch_t *w, uint32_t events);
+
+/********************  buffers  ********************/
+
+static int buf_reserve(rsh_buf_t *b, size_t extra) {
+    if (b->off > 0 && b->len + extra > b->cap) {
+        memmove(b->data, b->data + b->off, b->len - b->off);
+        b->len -= b->off;
+        b->off = 0;
+    }
+    if (b->len + extra <= b->cap) return OK;
+
+    size_t cap = b->cap ? b->cap : RSH_BUF_MIN;
+    while (b->len + extra > cap) cap *= 2;
+
+    char *grown = realloc(b->data, cap);
+    if (!grown) return ERR_MEMORY;
+    b->data = grown;
+    b->cap = cap;
+    return OK;
+}
+
+static size_t buf_pending(rsh_buf_t *b) {
+    return b->len - b->off;
+}
+
+static void buf_consume(rsh_buf_t *b, size_t n) {
+    b->off += n;
+    if (b->off == b->len) b->off = b->len = 0;
+}
+
+static void buf_free(rsh_buf_t *b) {
+    free(b->data);
+    memset(b, 0, sizeof(rsh_buf_t));
+}
+
+/********************  the loop  ********************/
+
+static void watch_init(rsh_watch_t *w, int fd, watch_fn fn, void *owner) {
+    w->fd = fd;
+    w->events = 0;
+    w->fn = fn;
+    w->owner = owner;
+}
+
+/*
+ * Registers w for events, or takes it out of the loop when events is 0.
+ * Taking it out matters for pipes: a hung up pipe reports EPOLLHUP even
+ * with an empty event mask, which would spin while the pipe is paused.
+ */
+static int watch_set(rsh_loop_t *loop, rsh_watch_t *w, uint32_t events) {
+    struct epoll_event ev = {.events = events, .data.ptr = w};
+    int op;
+
+    if (w->fd < 0 || w->events == events) return OK;
+
+    if (events == 0) {
+        op = EPOLL_CTL_DEL;
+    } else {
+        op = w->events ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    }
+    if (epoll_ctl(loop->epfd, op, w->fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return ERR_RDSH_SERVER;
+    }
+    w->events = events;
+    return OK;
+}
+
+static void watch_close(rsh_loop_t *loop, rsh_watch_t *w) {
+    if (w->fd < 0) return;
+    watch_set(loop, w, 0);
+    close(w->fd);
+    w->fd = -1;
+}
+
+static int set_nonblock(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) return -1;
+    return 0;
+}
+
+static int loop_init(rsh_loop_t *loop) {
+    memset(loop, 0, sizeof(rsh_loop_t));
+    watch_init(&loop->listener, -1, NULL, loop);
+
+    watch_init(&loop->timer, -1, on_timer, loop);
+
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epfd < 0) {
+        perror("epoll_create1");
+        return ERR_RDSH_SERVER;
+    }
+    if (rsh_opts.idle_timeout == 0 && rsh_opts.cmd_timeout == 0) return OK;
+
+    struct itimerspec tick = {
+        .it_interval = {.tv_sec = RSH_TIMER_TICK},
+        .it_value = {.tv_sec = RSH_TIMER_TICK},
+    };
+    loop->timer.fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (loop->timer.fd < 0 || timerfd_settime(loop->timer.fd, 0, &tick, NULL) < 0 ||
+        watch_set(loop, &loop->timer, EPOLLIN) != OK) {
+        perror("timerfd");
+        if (loop->timer.fd >= 0) close(loop->timer.fd);
+        close(loop->epfd);
+        return ERR_RDSH_SERVER;
+    }
+    return OK;
+}
+
+static void loop_reap_dead(rsh_loop_t *loop) {
+    while (loop->dead) {
+        rsh_conn_t *c = loop->dead;
+        loop->dead = c->next;
+        buf_free(&c->in);
+        buf_free(&c->out);
+        close(c->dir_fd);
+        free(c->jobs);
+        free(c);
+    }
+}
+
+static int loop_run(rsh_loop_t *loop) {
+    struct epoll_event evs[RSH_MAX_EVENTS];
+
+    while (!loop->stop && (loop->listener.fd >= 0 || loop->conns)) {
+        int n = epoll_wait(loop->epfd, evs, RSH_MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            perror("epoll_wait");
+            return ERR_RDSH_SERVER;
+        }
+
+        for (int i = 0; i < n; i++) {
+            rsh_watch_t *w = evs[i].data.ptr;
+            if (w->fd >= 0) w->fn(w, evs[i].events);
+        }
+        loop_reap_dead(loop);
+    }
+    return OK;
+}
+
+static void loop_close(rsh_loop_t *loop) {
+    while (loop->conns) {
+        conn_close(loop->conns);
+    }
+    loop_reap_dead(loop);
+    watch_close(loop, &loop->timer);
+    close(loop->epfd);
+}
+
+/********************  running a command  ********************/
+
+static int pidfd_open(pid_t pid) {
+    return syscall(SYS_pidfd_open, pid, 0);
+}
+
+static bool job_done(rsh_job_t *job) {
+    return job->out.fd < 0 && job->err.fd < 0 && job->nrunning == 0;
+}
+
+static void job_reaped(rsh_job_t *job, int i, int status) {
+    if (i == job->npids - 1) {
+        job->status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+    job->pids[i] = 0;
+    job->nrunning--;
+}
+
+//a stage exited, its pidfd became readable
+static void on_job_exit(rsh_watch_t *w, uint32_t events) {
+    rsh_job_t *job = w->owner;
+    rsh_conn_t *c = job->conn;
+    int i = w - job->procs, status;
+
+    (void)events;
+    if (waitpid(job->pids[i], &status, WNOHANG) <= 0) return;
+
+    watch_close(c->loop, w);
+    job_reaped(job, i, status);
+    conn_step(c);
+}
+
+/*
+ * One of the output pipes hit end of file.  After the last one, stages
+ * without a pidfd are reaped the old way.
+ */
+static void job_output_done(rsh_job_t *job, rsh_watch_t *w) {
+    watch_close(job->conn->loop, w);
+    if (job->out.fd >= 0 || job->err.fd >= 0) return;
+    for (int i = 0; i < job->npids; i++) {
+        int status;
+        if (job->pids[i] && job->procs[i].fd < 0 &&
+            waitpid(job->pids[i], &status, 0) > 0) {
+            job_reaped(job, i, status);
+        }
+    }
+}
+
+/*
+ * The zero-copy relay: output goes from the pipe to the socket with
+ * splice(), only its DATA frame header is written from user space.  The
+ * header is sent with MSG_MORE so it leaves in the same segment as the
+ * payload.  Each frame announces what FIONREAD says the pipe holds, and
+ * exactly that is spliced after it, splice_left keeps count when the
+ * socket fills up in the middle of a frame.
+ *
+ * Since the pipe is known to hold what is left, an EAGAIN from splice()
+ * always means the socket is full: the pipe is paused until EPOLLOUT.
+ * Only called with the output buffer empty and no other job in the
+ * middle of a frame (c->splicing), so nothing can get between a header
+ * and its payload.  With other jobs running it stops after a frame to
+ * let them have the socket too.
+ */
+static void job_splice(rsh_job_t *job, uint32_t events) {
+    rsh_conn_t *c = job->conn;
+    int frames = 0;
+
+    while (!c->sock_full) {
+        if (job->splice_left == 0) {
+            int avail = 0;
+
+            if (frames > 0 && c->njobs > 1) return;
+            if (ioctl(job->out.fd, FIONREAD, &avail) < 0 || avail == 0) {
+                //an empty pipe without writers is end of file
+                if (events & EPOLLHUP) job_output_done(job, &job->out);
+                return;
+            }
+            if (avail > RSH_FRAME_MAX) avail = RSH_FRAME_MAX;
+            job->splice_left = avail;
+            c->splicing = job;
+
+            if (c->proto == PROTO_FRAMED) {
+                char hdr[RSH_FRAME_HDR_SZ];
+
+                rsh_frame_pack(hdr, RSH_FT_DATA, RSH_CH_STDOUT, 0, job->req_id, avail);
+                ssize_t n = send(c->sock.fd, hdr, sizeof(hdr), MSG_MORE | MSG_NOSIGNAL | MSG_DONTWAIT);
+                if (n < 0 && errno != EAGAIN && errno != EINTR) {
+                    conn_close(c);
+                    return;
+                }
+                if (n > 0) rsh_stat_add(RSH_STAT_BYTES_OUT, n);
+                if (n < (ssize_t)sizeof(hdr)) {
+                    //the rest of the header goes out of the buffer first
+                    conn_put(c, hdr + (n > 0 ? n : 0), sizeof(hdr) - (n > 0 ? n : 0));
+                    return;
+                }
+            }
+        }
+
+        ssize_t n = splice(job->out.fd, NULL, c->sock.fd, NULL, job->splice_left,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n > 0) {
+            rsh_stat_add(RSH_STAT_BYTES_OUT, n);
+            job->splice_left -= n;
+            if (job->splice_left == 0) {
+                c->splicing = NULL;
+                frames++;
+            }
+        } else if (n < 0 && errno == EAGAIN) {
+            c->sock_full = true;
+        } else if (n < 0 && errno != EINTR) {
+            conn_close(c);
+            return;
+        }
+    }
+}
+
+/*
+ * Replaces the *len bytes of output at data by their LZ block if that is
+ * smaller, and returns the DATA frame flags to send them with.
+ */
+static uint8_t job_compress(char *data, ssize_t *len) {
+    char packed[RSH_IO_CHUNK];
+
+    if (*len < rsh_opts.compress_min) return 0;
+    int n = rsh_lz_compress(data, *len, packed, *len - 1);
+    if (n <= 0) return 0;
+    memcpy(data, packed, n);
+    *len = n;
+    return RSH_FF_LZ;
+}
+
+/*
+ * Moves output from a pipe to the output buffer.  Framed connections get
+ * every read() as one DATA frame on channel, its header is filled in once
+ * the length is known, and compressed if the client asked for it.
+ */
+static void job_copy(rsh_job_t *job, rsh_watch_t *w, uint8_t channel) {
+    rsh_conn_t *c = job->conn;
+    size_t hdr = c->proto == PROTO_FRAMED ? RSH_FRAME_HDR_SZ : 0;
+
+    while (buf_pending(&c->out) < RSH_OUT_HIWAT) {
+        if (buf_reserve(&c->out, hdr + RSH_IO_CHUNK) != OK) {
+            conn_close(c);
+            return;
+        }
+        ssize_t n = read(w->fd, c->out.data + c->out.len + hdr, RSH_IO_CHUNK);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno == EAGAIN) break;
+        if (n <= 0) {
+            job_output_done(job, w);
+            break;
+        }
+        if (hdr) {
+            uint8_t flags = c->compress ? job_compress(c->out.data + c->out.len + hdr, &n) : 0;
+            rsh_frame_pack(c->out.data + c->out.len, RSH_FT_DATA, channel, flags, job->req_id, n);
+        }
+        c->out.len += hdr + n;
+    }
+}
+
+/*
+ * Several jobs share the socket, an event that arrives after another job
+ * took it over in the same batch is left for conn_step() to re-arm.
+ */
+static void on_job_output(rsh_watch_t *w, uint32_t events) {
+    rsh_job_t *job = w->owner;
+    rsh_conn_t *c = job->conn;
+
+    if (c->splicing && c->splicing != job) {
+        // wait for that frame to finish
+    } else if (c->splice) {
+        if (buf_pending(&c->out) == 0) job_splice(job, events);
+    } else {
+        job_copy(job, w, RSH_CH_STDOUT);
+    }
+    if (c->state != CONN_CLOSED) conn_step(c);
+}
+
+//stderr is always copied, and never while a spliced frame is half sent
+static void on_job_err(rsh_watch_t *w, uint32_t events) {
+    rsh_job_t *job = w->owner;
+    rsh_conn_t *c = job->conn;
+
+    (void)events;
+    if (!c->splicing) job_copy(job, w, RSH_CH_STDERR);
+    if (c->state != CONN_CLOSED) conn_step(c);
+}
+
+//runs clist in a free job slot, the caller checked there is one
+static int job_start(rsh_conn_t *c, command_list_t *clist) {
+    rsh_job_t *job = c->jobs;
+    int fds[2], err_fds[2] = {-1, -1};
+
+    while (job->busy) job++;
+
+    if (pipe2(fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        return ERR_RDSH_CMD_EXEC;
+    }
+    if (c->proto == PROTO_FRAMED && pipe2(err_fds, O_CLOEXEC) < 0) {
+        perror("pipe");
+        close(fds[0]);
+        close(fds[1]);
+        return ERR_RDSH_CMD_EXEC;
+    }
+
+    uint64_t started = rsh_stats_now();
+    int rc = rsh_execute_pipeline(fds[1], err_fds[1] >= 0 ? err_fds[1] : fds[1], c->dir_fd,
+                                  clist, job->pids);
+    rsh_stat_time(RSH_HIST_SPAWN, rsh_stats_now() - started);
+    close(fds[1]);
+    if (err_fds[1] >= 0) close(err_fds[1]);
+    if (rc != OK) {
+        close(fds[0]);
+        if (err_fds[0] >= 0) close(err_fds[0]);
+        return rc;
+    }
+
+    job->busy = true;
+    job->req_id = c->req_id;
+    job->seq = c->seq;
+    job->npids = job->nrunning = clist->num;
+    job->status = 0;
+    job->started = started;
+    job->timed_out = false;
+    job->splice_left = 0;
+    c->njobs++;
+    watch_init(&job->out, fds[0], on_job_output, job);
+    if (set_nonblock(fds[0]) < 0 || watch_set(c->loop, &job->out, EPOLLIN) != OK) {
+        //still works, the output is then read when the loop comes around
+        perror("output pipe");
+    }
+    watch_init(&job->err, err_fds[0], on_job_err, job);
+    if (err_fds[0] >= 0 && (set_nonblock(err_fds[0]) < 0 ||
+                            watch_set(c->loop, &job->err, EPOLLIN) != OK)) {
+        perror("stderr pipe");
+    }
+
+    for (int i = 0; i < job->npids; i++) {
+        watch_init(&job->procs[i], pidfd_open(job->pids[i]), on_job_exit, job);
+        if (watch_set(c->loop, &job->procs[i], EPOLLIN) != OK) {
+            watch_close(c->loop, &job->procs[i]);
+        }
+    }
+    return OK;
+}
+
+//the client went away while the job runs
+static void job_kill(rsh_job_t *job) {
+    rsh_conn_t *c = job->conn;
+
+    watch_close(c->loop, &job->out);
+    watch_close(c->loop, &job->err);
+    for (int i = 0; i < job->npids; i++) {
+        watch_close(c->loop, &job->procs[i]);
+        if (job->pids[i]) {
+            kill(job->pids[i], SIGKILL);
+            waitpid(job->pids[i], NULL, 0);
+            job->pids[i] = 0;
+        }
+    }
+    job->npids = job->nrunning = 0;
+    job->busy = false;
+    c->njobs--;
+}
+
+/*
+ * -o cmd_timeout ran out: the stages are killed and their pipes closed,
+ * a grandchild holding them open cannot keep the job alive.  The job
+ * then ends the usual way once the stages are reaped.  A frame being
+ * spliced has to be finished first, that pipe stays open.
+ */
+static void job_timeout(rsh_job_t *job) {
+    rsh_conn_t *c = job->conn;
+
+    job->timed_out = true;
+    rsh_stat_add(RSH_STAT_CMD_TIMEOUTS, 1);
+    for (int i = 0; i < job->npids; i++) {
+        if (job->pids[i]) kill(job->pids[i], SIGKILL);
+    }
+    if (c->splicing == job) return;
+    if (job->out.fd >= 0) job_output_done(job, &job->out);
+    if (job->err.fd >= 0) job_output_done(job, &job->err);
+}
+
+//processes the connection's jobs have running
+static int conn_children(rsh_conn_t *c) {
+    int n = 0;
+
+    for (int i = 0; i < c->max_jobs; i++) {
+        if (c->jobs[i].busy) n += c->jobs[i].nrunning;
+    }
+    return n;
+}
+
+/********************  connections  ********************/
+
+static void conn_put(rsh_conn_t *c, const void *data, size_t len) {
+    if (buf_reserve(&c->out, len) != OK) {
+        conn_close(c);
+        return;
+    }
+    memcpy(c->out.data + c->out.len, data, len);
+    c->out.len += len;
+}
+
+static void conn_put_frame(rsh_conn_t *c, uint8_t type, uint8_t channel, uint32_t req_id,
+                           const void *data, size_t len) {
+    char hdr[RSH_FRAME_HDR_SZ];
+
+    rsh_frame_pack(hdr, type, channel, 0, req_id, len);
+    conn_put(c, hdr, sizeof(hdr));
+    if (len) conn_put(c, data, len);
+}
+
+//a short message as output of command req_id
+static void conn_reply_to(rsh_conn_t *c, uint32_t req_id, uint8_t channel, const char *msg) {
+    if (c->proto == PROTO_FRAMED) {
+        conn_put_frame(c, RSH_FT_DATA, channel, req_id, msg, strlen(msg));
+    } else {
+        conn_put(c, msg, strlen(msg));
+    }
+}
+
+//a short message as output of the current command
+static void conn_reply(rsh_conn_t *c, uint8_t channel, const char *msg) {
+    conn_reply_to(c, c->req_id, channel, msg);
+}
+
+static void conn_reply_str(rsh_conn_t *c, const char *msg) {
+    conn_reply(c, RSH_CH_STDOUT, msg);
+}
+
+static void conn_reply_err(rsh_conn_t *c, const char *msg) {
+    conn_reply(c, RSH_CH_STDERR, msg);
+}
+
+/*
+ * Ends the response to command seq.  rc is what `rc` prints next unless
+ * a later command already finished, the END frame carries it as an exit
+ * status: dsh's own (negative) error codes become 1.  Every command ends
+ * here, so this is where `stats` counts them.
+ */
+static void conn_end(rsh_conn_t *c, uint32_t req_id, unsigned seq, int rc) {
+    rsh_stat_add(RSH_STAT_CMDS, 1);
+    if (rc > 0) rsh_stat_add(RSH_STAT_CMDS_FAILED, 1);
+    rsh_stat_error(rc);
+
+    if (seq >= c->last_seq) {
+        c->last_rc = rc;
+        c->last_seq = seq;
+    }
+    if (c->proto == PROTO_FRAMED) {
+        uint32_t status = htonl(rc >= 0 ? rc : 1);
+        conn_put_frame(c, RSH_FT_END, RSH_CH_STATUS, req_id, &status, sizeof(status));
+    } else {
+        conn_put(c, &RDSH_EOF_CHAR, sizeof(RDSH_EOF_CHAR));
+    }
+}
+
+//ends the response to the command being read
+static void conn_reply_done(rsh_conn_t *c, int rc) {
+    conn_end(c, c->req_id, c->seq, rc);
+}
+
+/*
+ * Runs or starts one command.  Built-ins wait for the jobs before them:
+ * returns false, leaving the command where it is, while any are running.
+ */
+static bool conn_run_cmd(rsh_conn_t *c, char *line) {
+    command_list_t clist;
+    char msg[512];
+
+    int rc = build_cmd_list(line, &clist);
+    if (rc != OK) {
+        if (rc == WARN_NO_CMDS) {
+            conn_reply_str(c, CMD_WARN_NO_CMD);
+        } else if (rc == ERR_TOO_MANY_COMMANDS) {
+            snprintf(msg, sizeof(msg), CMD_ERR_PIPE_LIMIT, CMD_MAX);
+            conn_reply_err(c, msg);
+        } else {
+            conn_reply_err(c, CMD_ERR_RDSH_EXEC);
+        }
+        free_cmd_list(&clist);
+        conn_reply_done(c, rc);
+        return true;
+    }
+
+    //a line of only redirections, `> x`, has no command to run or look up
+    for (int i = 0; i < clist.num; i++) {
+        if (clist.commands[i].argc == 0) {
+            conn_reply_err(c, CMD_ERR_RDSH_NO_CMD);
+            free_cmd_list(&clist);
+            conn_reply_done(c, ERR_CMD_ARGS_BAD);
+            return true;
+        }
+    }
+
+    Built_In_Cmds bi = BI_NOT_BI;
+    if (clist.num == 1) bi = rsh_match_command(clist.commands[0].argv[0]);
+    if (bi != BI_NOT_BI && c->njobs > 0) {
+        free_cmd_list(&clist);
+        return false;
+    }
+    //a pipeline waits until -o session_children has room for its stages
+    if (bi == BI_NOT_BI && c->njobs > 0 &&
+        conn_children(c) + clist.num > rsh_opts.session_children) {
+        free_cmd_list(&clist);
+        return false;
+    }
+    if (bi != BI_NOT_BI) bi = rsh_built_in_cmd(&clist.commands[0]);
+
+    switch (bi) {
+        case BI_CMD_STOP_SVR:
+            c->stop_server = true;
+            //fall through
+        case BI_CMD_EXIT:
+            c->closing = true;
+            conn_reply_done(c, OK);
+            break;
+        case BI_CMD_CD:
+            rc = rsh_change_dir(&c->dir_fd, &clist.commands[0]);
+            if (rc != OK) {
+                snprintf(msg, sizeof(msg), CMD_ERR_RDSH_CD, clist.commands[0].argv[1], strerror(errno));
+                conn_reply_err(c, msg);
+            }
+            conn_reply_done(c, rc);
+            break;
+        case BI_CMD_RC:
+            snprintf(msg, sizeof(msg), "%d\n", c->last_rc);
+            conn_reply_str(c, msg);
+            conn_reply_done(c, OK);
+            break;
+        case BI_CMD_STATS: {
+            char report[RSH_STATS_MAX];
+            rsh_stats_format(report, sizeof(report));
+            conn_reply_str(c, report);
+            conn_reply_done(c, OK);
+            break;
+        }
+        case BI_NOT_BI:
+            if (clist.num > rsh_opts.session_children) {
+                snprintf(msg, sizeof(msg), CMD_ERR_RDSH_CHILDREN, clist.num, rsh_opts.session_children);
+                conn_reply_err(c, msg);
+                conn_reply_done(c, ERR_RDSH_CMD_EXEC);
+                break;
+            }
+            rc = job_start(c, &clist);
+            if (rc != OK) {
+                conn_reply_err(c, CMD_ERR_RDSH_EXEC);
+                conn_reply_done(c, rc);
+            }
+            break;
+        default:
+            conn_reply_done(c, OK);
+            break;
+    }
+    free_cmd_list(&clist);
+    return true;
+}
+
+/*
+ * The first bytes of a connection: rsh_cli's preface switches to frames
+ * and is answered with a HELLO, anything else is an old style client.
+ */
+static bool conn_hello(rsh_conn_t *c) {
+    char *line = c->in.data + c->in.off;
+    size_t avail = buf_pending(&c->in);
+    uint32_t features, granted = 0;
+
+    if (line[0] != RSH_PREFACE_BYTE) {
+        //its responses are not tagged, so they must not overlap
+        c->proto = PROTO_EOF;
+        c->max_jobs = 1;
+        return true;
+    }
+
+    char *nl = memchr(line, '\n', avail);
+    if (!nl) {
+        if (avail >= RSH_PREFACE_MAX) conn_close(c);
+        return false;
+    }
+    *nl = '\0';
+    int version = rsh_preface_parse(line, &features);
+    buf_consume(&c->in, nl + 1 - line);
+
+    if (version < 0) {
+        conn_close(c);
+        return false;
+    }
+
+    //we speak RSH_PROTO_VERSION, a newer client steps down to it
+    c->proto = PROTO_FRAMED;
+
+    //compressing needs the output in user space, so no splice() then
+    if ((features & RSH_FEAT_LZ) && strcmp(rsh_opts.compress, RSH_COMPRESS_ON) == 0) {
+        granted |= RSH_FEAT_LZ;
+        c->compress = true;
+        c->splice = false;
+    }
+    granted = htonl(granted);
+    conn_put_frame(c, RSH_FT_HELLO, RSH_CH_CTRL, 0, &granted, sizeof(granted));
+    return true;
+}
+
+/*
+ * Old style commands are terminated by '\0', or by a newline so a plain
+ * `nc` works too.
+ */
+static bool conn_next_line(rsh_conn_t *c) {
+    char *line = c->in.data + c->in.off;
+    size_t avail = buf_pending(&c->in), len = 0;
+
+    while (len < avail && line[len] != '\0' && line[len] != '\n') len++;
+
+    if (len == avail) {
+        if (avail >= RDSH_COMM_BUFF_SZ) {
+            buf_consume(&c->in, avail);
+            c->seq++;
+            conn_reply_err(c, CMD_ERR_RDSH_EXEC);
+            conn_reply_done(c, ERR_CMD_OR_ARGS_TOO_BIG);
+            return true;
+        }
+        return false;
+    }
+
+    line[len] = '\0';
+    c->seq++;
+    if (!conn_run_cmd(c, line)) {
+        c->seq--;
+        return false;
+    }
+    buf_consume(&c->in, len + 1);
+    return true;
+}
+
+static bool conn_next_frame(rsh_conn_t *c) {
+    rsh_frame_t frame;
+    char *data = c->in.data + c->in.off;
+
+    int rc = rsh_frame_unpack(data, buf_pending(&c->in), &frame);
+    if (rc == RSH_FRAME_PARTIAL) return false;
+    if (rc != RSH_FRAME_OK || frame.type != RSH_FT_CMD) {
+        conn_close(c);
+        return false;
+    }
+
+    char *line = strndup(data + RSH_FRAME_HDR_SZ, frame.len);
+    if (!line) {
+        conn_close(c);
+        return false;
+    }
+
+    c->req_id = frame.req_id;
+    c->seq++;
+    bool ran = conn_run_cmd(c, line);
+    free(line);
+    if (!ran) {
+        c->seq--;
+        return false;
+    }
+    buf_consume(&c->in, RSH_FRAME_HDR_SZ + frame.len);
+    return true;
+}
+
+/*
+ * Runs the next complete command from the input buffer.  Returns false
+ * if there is none yet or it has to wait.
+ */
+static bool conn_next_cmd(rsh_conn_t *c) {
+    if (buf_pending(&c->in) == 0) return false;
+
+    switch (c->proto) {
+        case PROTO_UNKNOWN:
+            return conn_hello(c);
+        case PROTO_EOF:
+            return conn_next_line(c);
+        default:
+            return conn_next_frame(c);
+    }
+}
+
+static void conn_flush(rsh_conn_t *c) {
+    if (c->state == CONN_CLOSED) return;
+    while (buf_pending(&c->out) > 0) {
+        ssize_t n = send(c->sock.fd, c->out.data + c->out.off, buf_pending(&c->out),
+                         MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) conn_close(c);
+            return;
+        }
+        buf_consume(&c->out, n);
+        rsh_stat_add(RSH_STAT_BYTES_OUT, n);
+        c->last_active = rsh_stats_now();
+    }
+}
+
+/*
+ * Advances the state machine after anything happened on the connection
+ * and re-arms its fds for what it waits for next.
+ */
+static void conn_step(rsh_conn_t *c) {
+    for (int i = 0; i < c->max_jobs; i++) {
+        rsh_job_t *job = &c->jobs[i];
+        if (job->busy && job_done(job)) {
+            job->busy = false;
+            c->njobs--;
+            rsh_stat_time(RSH_HIST_RUN, rsh_stats_now() - job->started);
+            if (job->timed_out) {
+                char msg[128];
+                snprintf(msg, sizeof(msg), CMD_ERR_RDSH_TIMEOUT, rsh_opts.cmd_timeout);
+                conn_reply_to(c, job->req_id, RSH_CH_STDERR, msg);
+            }
+            conn_end(c, job->req_id, job->seq, job->status);
+        }
+    }
+    if (c->state == CONN_CLOSED) return;
+
+    //commands sent ahead run as soon as a job slot is free
+    while (!c->closing && c->njobs < c->max_jobs && conn_next_cmd(c)) {
+        if (c->state == CONN_CLOSED) return;
+    }
+    c->state = c->njobs > 0 ? CONN_RUNNING : CONN_READ_CMD;
+
+    conn_flush(c);
+    if (c->state == CONN_CLOSED) return;
+
+    bool out_pending = buf_pending(&c->out) > 0;
+    if (c->state == CONN_READ_CMD && !out_pending && (c->closing || c->peer_closed)) {
+        conn_close(c);
+        return;
+    }
+
+    //commands sent ahead are read and queued while jobs run
+    uint32_t events = out_pending || c->sock_full ? EPOLLOUT : 0;
+    if (!c->closing && !c->peer_closed && buf_pending(&c->in) < RDSH_COMM_BUFF_SZ) {
+        events |= EPOLLIN;
+    }
+    watch_set(c->loop, &c->sock, events);
+
+    bool can_copy = !c->splicing && buf_pending(&c->out) < RSH_OUT_HIWAT;
+    bool can_splice = !out_pending && !c->sock_full;
+    for (int i = 0; i < c->max_jobs; i++) {
+        rsh_job_t *job = &c->jobs[i];
+        if (!job->busy) continue;
+
+        bool out_room = !c->splice ? can_copy :
+                        can_splice && (!c->splicing || c->splicing == job);
+        watch_set(c->loop, &job->out, out_room ? EPOLLIN : 0);
+        watch_set(c->loop, &job->err, can_copy ? EPOLLIN : 0);
+    }
+}
+
+static void on_sock(rsh_watch_t *w, uint32_t events) {
+    rsh_conn_t *c = w->owner;
+
+    if (events & EPOLLERR) {
+        conn_close(c);
+        return;
+    }
+    if (events & EPOLLOUT) c->sock_full = false;
+
+    if (events & EPOLLIN) {
+        while (1) {
+            if (buf_reserve(&c->in, RSH_IO_CHUNK) != OK) {
+                conn_close(c);
+                return;
+            }
+            ssize_t n = recv(w->fd, c->in.data + c->in.len, RSH_IO_CHUNK, MSG_DONTWAIT);
+            if (n < 0 && errno == EINTR) continue;
+            if (n < 0 && errno == EAGAIN) break;
+            if (n <= 0) {
+                c->peer_closed = true;
+                break;
+            }
+            c->in.len += n;
+            rsh_stat_add(RSH_STAT_BYTES_IN, n);
+            c->last_active = rsh_stats_now();
+            if (buf_pending(&c->in) >= RDSH_COMM_BUFF_SZ) break;
+        }
+    } else if (events & EPOLLHUP) {
+        conn_close(c);
+        return;
+    }
+
+    conn_step(c);
+}
+
+/*
+ * Takes over fd and the session's place from rsh_session_admit(), both
+ * are given back when it is closed, or right away if it cannot be set up.
+ */
+static rsh_conn_t *conn_new(rsh_loop_t *loop, int fd) {
+    rsh_conn_t *c = calloc(1, sizeof(rsh_conn_t));
+    if (!c) {
+        perror("calloc");
+        close(fd);
+        rsh_session_leave();
+        return NULL;
+    }
+
+    c->loop = loop;
+    c->state = CONN_READ_CMD;
+    c->last_active = rsh_stats_now();
+    c->splice = strcmp(rsh_opts.relay, RSH_RELAY_SPLICE) == 0;
+    c->max_jobs = rsh_opts.session_jobs;
+    c->jobs = calloc(c->max_jobs, sizeof(rsh_job_t));
+    //sessions start where the server was started, then go their own way
+    c->dir_fd = open(".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    watch_init(&c->sock, fd, on_sock, c);
+    for (int i = 0; c->jobs && i < c->max_jobs; i++) {
+        c->jobs[i].conn = c;
+        watch_init(&c->jobs[i].out, -1, on_job_output, &c->jobs[i]);
+        watch_init(&c->jobs[i].err, -1, on_job_err, &c->jobs[i]);
+    }
+
+    //a response often ends in a small END frame sent on its own, Nagle
+    //would hold it back until the client acknowledged the data before it
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (!c->jobs || c->dir_fd < 0 || set_nonblock(fd) < 0 ||
+        watch_set(loop, &c->sock, EPOLLIN) != OK) {
+        close(fd);
+        if (c->dir_fd >= 0) close(c->dir_fd);
+        free(c->jobs);
+        free(c);
+        rsh_session_leave();
+        return NULL;
+    }
+
+    c->next = loop->conns;
+    loop->conns = c;
+    rsh_stat_add(RSH_STAT_ACCEPTED, 1);
+    return c;
+}
+
+static void conn_close(rsh_conn_t *c) {
+    rsh_loop_t *loop = c->loop;
+
+    if (c->state == CONN_CLOSED) return;
+    for (int i = 0; i < c->max_jobs; i++) {
+        if (c->jobs[i].busy) job_kill(&c->jobs[i]);
+    }
+    c->state = CONN_CLOSED;
+    watch_close(loop, &c->sock);
+    rsh_stat_add(RSH_STAT_CLOSED, 1);
+    rsh_session_leave();
+
+    if (c->stop_server) loop->stop = true;
+
+    for (rsh_conn_t **p = &loop->conns; *p; p = &(*p)->next) {
+        if (*p == c) {
+            *p = c->next;
+            break;
+        }
+    }
+    c->next = loop->dead;
+    loop->dead = c;
+}
+
+static void on_accept(rsh_watch_t *w, uint32_t events) {
+    rsh_loop_t *loop = w->owner;
+
+    (void)events;
+    while (1) {
+        int fd = accept4(w->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            if (errno != EAGAIN) perror("accept");
+            return;
+        }
+        if (rsh_session_admit()) {
+            conn_new(loop, fd);
+        } else {
+            rsh_reject_busy(fd);
+        }
+    }
+}
+
+/*
+ * Checks the timeouts of one connection, see the top of the file.  A
+ * connection with a command running is never idle, its idle time starts
+ * when the last command is done.
+ */
+static void conn_timeouts(rsh_conn_t *c, uint64_t now) {
+    uint64_t cmd_ns = rsh_opts.cmd_timeout * 1000000000ull;
+    uint64_t idle_ns = rsh_opts.idle_timeout * 1000000000ull;
+    bool killed = false;
+
+    for (int i = 0; cmd_ns && i < c->max_jobs; i++) {
+        rsh_job_t *job = &c->jobs[i];
+        if (job->busy && !job->timed_out && now - job->started >= cmd_ns) {
+            job_timeout(job);
+            killed = true;
+        }
+    }
+
+    if (c->njobs > 0) {
+        c->last_active = now;
+    } else if (idle_ns && now - c->last_active >= idle_ns) {
+        rsh_stat_add(RSH_STAT_IDLE_CLOSED, 1);
+        conn_close(c);
+        return;
+    }
+    if (killed) conn_step(c);
+}
+
+static void on_timer(rsh_watch_t *w, uint32_t events) {
+    rsh_loop_t *loop = w->owner;
+    uint64_t ticks, now = rsh_stats_now();
+    rsh_conn_t *next;
+
+    (void)events;
+    if (read(w->fd, &ticks, sizeof(ticks)) < 0) return;
+    //conn_close() moves a connection to the dead list, next is saved first
+    for (rsh_conn_t *c = loop->conns; c; c = next) {
+        next = c->next;
+        if (c->state != CONN_CLOSED) conn_timeouts(c, now);
+    }
+}
+
+/********************  entry points  ********************/
+
+/*
+ * rsh_reactor_run(svr_socket)
+ *      The -e server mode: accepts and serves every client from this one
+ *      thread until a client sends `stop-server`.  Connections still open
+ *      at that point are closed, their commands killed.
+ *
+ *  Returns:
+ *      OK_EXIT                 stop-server
+ *      ERR_RDSH_SERVER         the loop could not be set up or failed
+ */
+int rsh_reactor_run(int svr_socket) {
+    rsh_loop_t loop;
+    int rc;
+
+    if (loop_init(&loop) != OK) return ERR_RDSH_SERVER;
+
+    watch_init(&loop.listener, svr_socket, on_accept, &loop);
+    if (set_nonblock(svr_socket) < 0 || watch_set(&loop, &loop.listener, EPOLLIN) != OK) {
+        watch_close(&loop, &loop.timer);
+        close(loop.epfd);
+        return ERR_RDSH_SERVER;
+    }
+
+    rc = loop_run(&loop);
+
+    watch_set(&loop, &loop.listener, 0);
+    loop_close(&loop);
+    return rc == OK ? OK_EXIT : rc;
+}
+
+/*
+ * rsh_session_run(cli_socket)
+ *      Serves one client with a private loop until it disconnects, sends
+ *      `exit` or sends `stop-server`.  Closes cli_socket.  A client over
+ *      -o max_sessions is rejected busy right away.
+ *
+ *  Returns:
+ *      OK                      the client is gone
+ *      OK_EXIT                 stop-server
+ *      ERR_RDSH_SERVER         the loop could not be set up or failed
+ */
+int rsh_session_run(int cli_socket) {
+    rsh_loop_t loop;
+    int rc;
+
+    if (!rsh_session_admit()) {
+        rsh_reject_busy(cli_socket);
+        return OK;
+    }
+    if (loop_init(&loop) != OK) {
+        close(cli_socket);
+        rsh_session_leave();
+        return ERR_RDSH_SERVER;
+    }
+    if (!conn_new(&loop, cli_socket)) {
+        watch_close(&loop, &loop.timer);
+        close(loop.epfd);
+        return ERR_RDSH_SERVER;
+    }
+
+    rc = loop_run(&loop);
+    loop_close(&loop);
+
+    if (rc != OK) return rc;
+    return loop.stop ? OK_EXIT : OK;
+}
@@ -1,4 +1,4 @@
-
+#define _GNU_SOURCE
 #include <sys/socket.h>
 #include <sys/wait.h>
 #include <arpa/inet.h>
@@ -9,6 +9,7 @@
 #include <sys/un.h>
 #include <fcntl.h>
 #include <ctype.h>
+#include <errno.h>
 
 
 //INCLUDES for extra credit
@@ -19,6 +20,8 @@
 #include "dshlib.h"
 #include "rshlib.h"
 
+static int rsh_listen(char *ifaces, int port, bool reuse_port);
+
 
 /*
  * start_server(ifaces, port, is_threaded)
@@ -34,7 +37,10 @@
  *              For example ./dsh -s 0.0.0.0:5678 where 5678 is the new port  
  * 
  *      is_threded:  Used for extra credit to indicate the server should implement
- *                   per thread connections for clients  
+ *                   per thread connections for clients.  Carries the server
+ *                   mode: RSH_MODE_SINGLE, RSH_MODE_THREADED (-x),
+ *                   RSH_MODE_REACTOR (-e, see rsh_reactor.c) or
+ *                   RSH_MODE_PREFORK (-f, see rsh_prefork.c)
  * 
  *      This function basically runs the server by: 
  *          1. Booting up the server
@@ -42,6 +48,9 @@
  *             server to stop by running the `stop-server` command
  *          3. Stopping the server. 
  * 
+ *      The counters `stats` reports are set up first, so every mode and
+ *      every -f worker counts into them (see rsh_stats.c).
+ * 
  *      This function is fully implemented for you and should not require
  *      any changes for basic functionality.  
  * 
@@ -57,15 +66,28 @@ int start_server(char *ifaces, int port, int is_threaded){
     //       to keep track of is_threaded to handle this feature
     //
 
+    if ((rc = rsh_stats_init()) != OK || (rc = rsh_stats_dump_start()) != OK) {
+        return rc;
+    }
+
+    //-f: a socket per worker process, see rsh_prefork.c
+    if (is_threaded == RSH_MODE_PREFORK) {
+        rc = rsh_prefork_run(ifaces, port);
+        rsh_stats_dump_stop();
+        return rc;
+    }
+
     svr_socket = boot_server(ifaces, port);
     if (svr_socket < 0) {
         int err_code = svr_socket;  // Server socket will carry error code
+        rsh_stats_dump_stop();
         return err_code;
     }
 
     rc = process_cli_requests(svr_socket, is_threaded);
 
     stop_server(svr_socket);
+    rsh_stats_dump_stop();
 
     return rc;
 }
@@ -116,12 +138,26 @@ int stop_server(int svr_socket){
  * 
  */
 int boot_server(char *ifaces, int port){
+    return rsh_listen(ifaces, port, false);
+}
+
+/*
+ * rsh_boot_shared(ifaces, port)
+ *      boot_server() for the -f mode: the socket has SO_REUSEPORT, so
+ *      every worker can bind its own to the same address and the kernel
+ *      balances new connections over them.  Same returns.
+ */
+int rsh_boot_shared(char *ifaces, int port){
+    return rsh_listen(ifaces, port, true);
+}
+
+static int rsh_listen(char *ifaces, int port, bool reuse_port){
     int svr_socket;
     struct sockaddr_in server_addr;
     int enable = 1;
 
     //Create socket
-    svr_socket = socket(AF_INET, SOCK_STREAM, 0);
+    svr_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
     if (svr_socket < 0) {
         perror("socket");
         return ERR_RDSH_COMMUNICATION;
@@ -134,6 +170,13 @@ int boot_server(char *ifaces, int port){
         return ERR_RDSH_COMMUNICATION;
     }
 
+    //Share the port with the other -f workers
+    if (reuse_port && setsockopt(svr_socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(int)) < 0){
+        perror("setsockopt");
+        close(svr_socket);
+        return ERR_RDSH_COMMUNICATION;
+    }
+
     //Bind socket to specific interface and port
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
@@ -146,8 +189,8 @@ int boot_server(char *ifaces, int port){
         return ERR_RDSH_COMMUNICATION;
     }
 
-    //Listen
-    if (listen(svr_socket, 5) < 0) {
+    //Listen, a connection storm waits in a backlog of -o backlog
+    if (listen(svr_socket, rsh_opts.backlog) < 0) {
         perror("listen");
         close(svr_socket);
         return ERR_RDSH_COMMUNICATION;
@@ -183,6 +226,12 @@ int boot_server(char *ifaces, int port){
  *          free the buffer you allocated in step #1.  Then call stop_server()
  *          to close the server socket. 
  * 
+ *  In RSH_MODE_THREADED step 1b hands the client to the worker pool in
+ *  rsh_pool.c instead, and a worker that sees `stop-server` shuts down
+ *  svr_socket so accept() fails and the loop ends.  In RSH_MODE_REACTOR
+ *  there is no such loop, rsh_reactor_run() accepts and serves every
+ *  client from a single epoll loop instead.
+ * 
  *  Returns:
  * 
  *      OK_EXIT:  When the client sends the `stop-server` command this function
@@ -198,57 +247,39 @@ int boot_server(char *ifaces, int port){
  * 
  */
 
- // Multiple threads helper
- void *client_handler(void *arg) {
-    thread_args_t *targs = (thread_args_t *)arg;
-    int client_socket = targs->client_socket;
-    free(targs);
-
-    exec_client_requests(client_socket);
-
-    close(client_socket);
-
-    return NULL;
-}
-
 int process_cli_requests(int svr_socket, int is_threaded) {
     int client_socket;
     struct sockaddr_in client_addr;
     socklen_t client_addr_len = sizeof(client_addr);
     int rc;
 
+    //-e: one thread, every client in one epoll loop
+    if (is_threaded == RSH_MODE_REACTOR) {
+        return rsh_reactor_run(svr_socket);
+    }
+
+    //-x: a fixed pool of workers, see rsh_pool.c
+    if (is_threaded && (rc = rsh_pool_start(svr_socket)) != OK) {
+        return rc;
+    }
+
     while (1) {
         // Step 1a: Accept a client connection
-        client_socket = accept(svr_socket, (struct sockaddr *)&client_addr, &client_addr_len);
+        client_socket = accept4(svr_socket, (struct sockaddr *)&client_addr, &client_addr_len, SOCK_CLOEXEC);
         if (client_socket < 0) {
+            if (is_threaded && rsh_pool_stopping()) break;  // stop-server
+            if (errno == EINTR || errno == ECONNABORTED) continue;
             perror("accept");
-            return ERR_RDSH_COMMUNICATION;
+            rc = ERR_RDSH_COMMUNICATION;
+            break;
         }
 
         if (is_threaded) {
-            // Step 1b: Multi-threaded - Create a new thread for each client
-            pthread_t thread_id;
-            thread_args_t *targs = malloc(sizeof(thread_args_t));
-            if (!targs) {
-                perror("malloc");
-                close(client_socket);
-                continue;
-            }
-
-            targs->client_socket = client_socket;
-            if (pthread_create(&thread_id, NULL, client_handler, targs) != 0) {
-                perror("pthread_create");
-                free(targs);
-                close(client_socket);
-                continue;
-            }
-
-            // Detach the thread to auto-cleanup when it exits
-            pthread_detach(thread_id);
+            // Step 1b: Multi-threaded - Hand the client to the worker pool
+            rsh_pool_submit(client_socket);
         } else {
             // Step 1c: Single-threaded - Process client requests sequentially
             rc = exec_client_requests(client_socket);
-            close(client_socket);
 
             // Step 1d: Check return code for stopping server
             if (rc == OK_EXIT) {
@@ -259,9 +290,13 @@ int process_cli_requests(int svr_socket, int is_threaded) {
         }
     }
 
-    // Step 2: Cleanup and stop the server
-    stop_server(svr_socket);
-    return OK_EXIT;
+    if (is_threaded) {
+        rsh_pool_stop();
+        if (rsh_pool_stopping()) rc = OK_EXIT;
+    }
+
+    // Step 2: start_server() closes the server socket
+    return rc == OK ? OK_EXIT : rc;
 }
 
 
@@ -291,11 +326,10 @@ int process_cli_requests(int svr_socket, int is_threaded) {
  *  command it sent is finished.  Use the send_message_eof() to accomplish 
  *  this. 
  * 
- *  Of final note, this function must allocate a buffer for storage to 
- *  store the data received by the client. For example:
- *     io_buff = malloc(RDSH_COMM_BUFF_SZ);
- *  And since it is allocating storage, it must also properly clean it up
- *  prior to exiting.
+ *  The work is done by the connection state machine in rsh_reactor.c,
+ *  driven by a private epoll loop for this one client, so the blocking
+ *  server modes and the -e mode share one implementation.  cli_socket is
+ *  closed when this function returns.
  * 
  *  Returns:
  * 
@@ -307,58 +341,7 @@ int process_cli_requests(int svr_socket, int is_threaded) {
  *                or receive errors. 
  */
 int exec_client_requests(int cli_socket) {
-    char *io_buff = malloc(RDSH_COMM_BUFF_SZ);
-    if (!io_buff) {
-        perror("malloc");
-        return ERR_RDSH_COMMUNICATION;
-    }
-
-    while (1) {
-        // Receive the command from the client
-        ssize_t bytes_received = recv(cli_socket, io_buff, RDSH_COMM_BUFF_SZ - 1, 0);
-        if (bytes_received < 0) {
-            perror("recv");
-            break;
-        } else if (bytes_received == 0) {
-            // Client disconnected
-            break;
-        }
-
-        // Null-terminate the received command
-        io_buff[bytes_received] = '\0';
-
-        // Parse the command into a command list
-        command_list_t cmd_list;
-        if (build_cmd_list(io_buff, &cmd_list) < 0) {
-            // Handle command parsing errors
-            break;
-        }
-
-        // Execute the command pipeline
-        int rc = rsh_execute_pipeline(cli_socket, &cmd_list);
-
-        // Free allocated memory for the command list
-        free_cmd_list(&cmd_list);
-
-        // Send EOF to the client
-        if (send_message_eof(cli_socket) < 0) {
-            free(io_buff);
-            return ERR_RDSH_COMMUNICATION;
-        }
-
-        // Check for special commands
-        if (rc == OK_EXIT) {
-            // Client sent `stop-server`
-            break;
-        } else if (rc == OK) {
-            // Client sent `exit`
-            break;
-        }
-    }
-
-    // Cleanup
-    free(io_buff);
-    return OK;
+    return rsh_session_run(cli_socket);
 }
 
 int free_cmd_list(command_list_t *cmd_lst) {
@@ -371,9 +354,8 @@ int free_cmd_list(command_list_t *cmd_lst) {
 }
 
 int build_cmd_list(char *cmd_line, command_list_t *clist) {
-    if (!cmd_line || *cmd_line == '\0') return WARN_NO_CMDS;
-
     memset(clist, 0, sizeof(command_list_t));
+    if (!cmd_line || *cmd_line == '\0') return WARN_NO_CMDS;
 
     trim_whitespace(cmd_line);
 
@@ -391,10 +373,11 @@ int build_cmd_list(char *cmd_line, command_list_t *clist) {
 
         if (cmd_count >= CMD_MAX) return ERR_TOO_MANY_COMMANDS;
 
-        if (build_cmd_buff(token, &clist->commands[cmd_count]) != OK)
+        //counted first, so free_cmd_list() also frees a failed one
+        clist->num = ++cmd_count;
+        if (build_cmd_buff(token, &clist->commands[cmd_count - 1]) != OK)
             return ERR_MEMORY;
 
-        cmd_count++;
         token = strtok_r(NULL, PIPE_STRING, &saveptr);
     }
 
@@ -445,7 +428,7 @@ int build_cmd_buff(char *cmd_line, cmd_buff_t *cmd_buff) {
             trim_whitespace(token);
             cmd_buff->input_file = token;
             while (*token && !isspace((unsigned char)*token)) token++;
-            *token = '\0';
+            if (*token) *token++ = '\0';
             continue;
         }
 
@@ -455,7 +438,7 @@ int build_cmd_buff(char *cmd_line, cmd_buff_t *cmd_buff) {
             trim_whitespace(token);
             cmd_buff->output_file = token;
             while (*token && !isspace((unsigned char)*token)) token++;
-            *token = '\0';
+            if (*token) *token++ = '\0';
             continue;
         }
 
@@ -555,142 +538,221 @@ int send_message_string(int cli_socket, char *buff){
     return OK;
 }
 
+/*
+ * rsh_reject_busy(cli_socket)
+ *      cli_socket:  A client the server will not serve
+ *
+ *  The fast way out for a client there is no room for: it gets
+ *  RCMD_ERR_SVR_BUSY followed by the EOF character and the socket is
+ *  closed, without waiting for anything.  A framed client takes the
+ *  message for an old server's answer to its preface and prints it too.
+ *  What the client already sent is read first, closing a socket with
+ *  unread input resets the connection and the message could be lost.
+ */
+void rsh_reject_busy(int cli_socket){
+    char drain[RSH_PREFACE_MAX];
+
+    send(cli_socket, RCMD_ERR_SVR_BUSY, strlen(RCMD_ERR_SVR_BUSY), MSG_NOSIGNAL | MSG_DONTWAIT);
+    send(cli_socket, &RDSH_EOF_CHAR, sizeof(RDSH_EOF_CHAR), MSG_NOSIGNAL | MSG_DONTWAIT);
+    shutdown(cli_socket, SHUT_WR);
+    while (recv(cli_socket, drain, sizeof(drain), MSG_DONTWAIT) > 0) {
+        // discard
+    }
+    close(cli_socket);
+    rsh_stat_add(RSH_STAT_REJECTED, 1);
+}
+
 
 /*
- * rsh_execute_pipeline(int cli_sock, command_list_t *clist)
- *      cli_sock:    The server-side socket that is connected to the client
+ * rsh_execute_pipeline(out_fd, err_fd, dir_fd, clist, pids)
+ *      out_fd:      Where the output of the pipeline goes, the write end of
+ *                   a pipe the connection's event loop reads from
+ *      err_fd:      Where stderr of every stage goes, a second pipe or
+ *                   out_fd itself
+ *      dir_fd:      The session's working directory.  The stages run in
+ *                   it and redirections are opened relative to it, the
+ *                   server's own current directory is never changed
  *      clist:       The command_list_t structure that we implemented in
  *                   the last shell. 
+ *      pids:        Gets the pid of every stage, clist->num of them
  *   
- *  This function executes the command pipeline.  It should basically be a
- *  replica of the execute_pipeline() function from the last deliverable. 
- *  The only thing different is that you will be using the cli_sock as the
- *  main file descriptor on the first executable in the pipeline for STDIN,
- *  and the cli_sock for the file descriptor for STDOUT, and STDERR for the
- *  last executable in the pipeline.  See picture below:  
+ *  This function starts the command pipeline.  It is basically a replica
+ *  of the execute_pipeline() function from the last deliverable, except
+ *  that stdin of the first stage is /dev/null, the client's commands share
+ *  one socket so a child cannot read from it, and that stdout of the last
+ *  stage goes to out_fd and stderr of every stage to err_fd.  See picture
+ *  below, where err_fd is out_fd:
  * 
  *      
  *┌───────────┐                                                    ┌───────────┐
- *│ cli_sock  │                                                    │ cli_sock  │
+ *│ /dev/null │                                                    │  out_fd   │
  *└─────┬─────┘                                                    └────▲──▲───┘
  *      │   ┌──────────────┐     ┌──────────────┐     ┌──────────────┐  │  │    
  *      │   │   Process 1  │     │   Process 2  │     │   Process N  │  │  │    
  *      │   │              │     │              │     │              │  │  │    
- *      └───▶stdin   stdout├─┬──▶│stdin   stdout├─┬──▶│stdin   stdout├──┘  │    
- *          │              │ │   │              │ │   │              │     │    
- *          │        stderr├─┘   │        stderr├─┘   │        stderr├─────┘    
- *          └──────────────┘     └──────────────┘     └──────────────┘   
- *                                                      WEXITSTATUS()
- *                                                      of this last
- *                                                      process to get
- *                                                      the return code
- *                                                      for this function       
+ *      └───▶stdin   stdout├────▶│stdin   stdout├────▶│stdin   stdout├──┘  │    
+ *          │              │     │              │     │              │     │    
+ *          │        stderr├──┐  │        stderr├──┐  │        stderr├─────┤    
+ *          └──────────────┘  │  └──────────────┘  │  └──────────────┘     │    
+ *                            └────────────────────┴───────────────────────┘    
+ * 
+ *  It does not wait, the caller reaps the stages (rsh_reactor.c watches a
+ *  pidfd per stage) and takes the return code from the last one.
  * 
  *  Returns:
  * 
- *      EXIT_CODE:  This function returns the exit code of the last command
- *                  executed in the pipeline.  If only one command is executed
- *                  that value is returned.  Remember, use the WEXITSTATUS()
- *                  macro that we discussed during our fork/exec lecture to
- *                  get this value. 
+ *      OK:                 Every stage was started
+ *      ERR_RDSH_CMD_EXEC:  A pipe or fork failed, stages already started
+ *                          were reaped
+ */
+/*
+ * rsh_zygote_stage(out_fd, err_fd, dir_fd, null_fd, clist, i, pipes)
+ *      Starts stage i through the zygote when the server runs with -z,
+ *      wiring up the same descriptors the forked child below would.
+ *      Returns the pid, or -1 when the stage should be forked instead.
  */
-int rsh_execute_pipeline(int socket_fd, command_list_t *clist) {
-    if (clist->num == 0) return ERR_EXEC_CMD;
+static pid_t rsh_zygote_stage(int out_fd, int err_fd, int dir_fd, int null_fd, command_list_t *clist, int i, int pipes[][2]) {
+    cmd_buff_t *cmd = &clist->commands[i];
+    zygote_req_t req;
+    int in_file = -1, out_file = -1;
+    pid_t pid = -1;
+
+    if (!zygote_running()) return -1;
+
+    memset(&req, 0, sizeof(req));
+    req.argv = cmd->argv;
+    req.fds[0] = i > 0 ? pipes[i - 1][0] : null_fd;
+    req.fds[1] = i < clist->num - 1 ? pipes[i][1] : out_fd;
+    req.fds[2] = err_fd;
+    req.cwd_fd = dir_fd;
+
+    if (cmd->input_file) {
+        in_file = openat(dir_fd, cmd->input_file, O_RDONLY | O_CLOEXEC);
+        req.fds[0] = in_file;
+    }
+
+    if (cmd->output_file) {
+        bool append = is_append_redirect(cmd->output_file);
+        out_file = openat(dir_fd, cmd->output_file + append, O_WRONLY | O_CREAT | O_CLOEXEC |
+                        (append ? O_APPEND : O_TRUNC), 0644);
+        req.fds[1] = out_file;
+    }
+
+    //a redirect that cannot be opened is left to the forked child to report
+    if (req.fds[0] >= 0 && req.fds[1] >= 0) {
+        pid = zygote_spawn(&req);
+    }
+
+    if (in_file >= 0) close(in_file);
+    if (out_file >= 0) close(out_file);
+    return pid;
+}
+
+static void rsh_close_pipes(int pipes[][2], int n) {
+    for (int i = 0; i < n; i++) {
+        close(pipes[i][0]);
+        close(pipes[i][1]);
+    }
+}
+
+int rsh_execute_pipeline(int out_fd, int err_fd, int dir_fd, command_list_t *clist, pid_t *pids) {
+    if (clist->num == 0) return ERR_RDSH_CMD_EXEC;
 
     int pipes[CMD_MAX - 1][2];
-    pid_t pids[CMD_MAX];
+    int null_fd = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int started = 0;
 
-    for (int i = 0; i < clist->num; i++) {
-        // Create pipe (except for the last command)
-        if (i < clist->num - 1) {
-            if (pipe(pipes[i]) == -1) {
-                perror("pipe");
-                return ERR_EXEC_CMD;
-            }
+    if (null_fd < 0) {
+        perror("/dev/null");
+        return ERR_RDSH_CMD_EXEC;
+    }
+
+    for (int i = 0; i < clist->num - 1; i++) {
+        if (pipe2(pipes[i], O_CLOEXEC) == -1) {
+            perror("pipe");
+            rsh_close_pipes(pipes, i);
+            close(null_fd);
+            return ERR_RDSH_CMD_EXEC;
         }
+    }
 
-        // Fork a child process
-        pids[i] = fork();
+    for (int i = 0; i < clist->num; i++) {
+        // Fork a child process, unless the zygote can start it for us
+        pids[i] = rsh_zygote_stage(out_fd, err_fd, dir_fd, null_fd, clist, i, pipes);
+        if (pids[i] == -1) pids[i] = fork();
         if (pids[i] == -1) {
             perror("fork");
-            return ERR_EXEC_CMD;
+            break;
         }
+        started++;
 
         if (pids[i] == 0) {  // Child process
+            // The session's directory, not the server's
+            if (fchdir(dir_fd) < 0) {
+                perror("fchdir");
+                _exit(EXIT_FAILURE);
+            }
+
             // Handle input redirection
             if (clist->commands[i].input_file) {
-                int in_fd = open(clist->commands[i].input_file, O_RDONLY);
+                int in_fd = openat(dir_fd, clist->commands[i].input_file, O_RDONLY);
                 if (in_fd == -1) {
                     perror("open input file");
-                    exit(EXIT_FAILURE);
+                    _exit(EXIT_FAILURE);
                 }
                 dup2(in_fd, STDIN_FILENO);
                 close(in_fd);
-            } else if (i > 0) {
-                dup2(pipes[i - 1][0], STDIN_FILENO);
+            } else {
+                dup2(i > 0 ? pipes[i - 1][0] : null_fd, STDIN_FILENO);
             }
 
             // Handle output redirection
+            dup2(err_fd, STDERR_FILENO);
             if (clist->commands[i].output_file) {
-                int out_fd;
+                int out_file;
                 if (is_append_redirect(clist->commands[i].output_file)) {
-                    // Handle `>>` (append mode)
-                    out_fd = open(clist->commands[i].output_file, O_WRONLY | O_CREAT | O_APPEND, 0644);
+                    // Handle `>>` (append mode), the parser left one '>'
+                    out_file = openat(dir_fd, clist->commands[i].output_file + 1, O_WRONLY | O_CREAT | O_APPEND, 0644);
                 } else {
                     // Handle `>` (overwrite mode)
-                    out_fd = open(clist->commands[i].output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+                    out_file = openat(dir_fd, clist->commands[i].output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
                 }
 
-                if (out_fd == -1) {
+                if (out_file == -1) {
                     perror("open output file");
-                    exit(EXIT_FAILURE);
+                    _exit(EXIT_FAILURE);
                 }
-                dup2(out_fd, STDOUT_FILENO);
-                close(out_fd);
-            } else if (i < clist->num - 1) {
-                dup2(pipes[i][1], STDOUT_FILENO);
-                dup2(socket_fd, STDERR_FILENO);
-            }
-
-            // Close all pipes in child process
-            for (int j = 0; j < clist->num - 1; j++) {
-                close(pipes[j][0]);
-                close(pipes[j][1]);
+                dup2(out_file, STDOUT_FILENO);
+                close(out_file);
+            } else {
+                dup2(i < clist->num - 1 ? pipes[i][1] : out_fd, STDOUT_FILENO);
             }
 
-            // Execute command
+            // Everything else is close-on-exec
             execvp(clist->commands[i].argv[0], clist->commands[i].argv);
             perror("execvp");
-            exit(EXIT_FAILURE);
+            _exit(EXIT_FAILURE);  // _exit: the server's stdio buffers are not ours to flush
         }
     }
 
     // Close all pipes in the parent process
-    for (int i = 0; i < clist->num - 1; i++) {
-        close(pipes[i][0]);
-        close(pipes[i][1]);
-    }
+    rsh_close_pipes(pipes, clist->num - 1);
+    close(null_fd);
 
-    // Wait for all child processes
-    for (int i = 0; i < clist->num; i++) {
-        waitpid(pids[i], NULL, 0);
-    }
-
-    // Send EOF message to indicate end of command execution
-    int rc = send_message_eof(socket_fd);
-    if (rc != OK) {
-        printf(CMD_ERR_RDSH_COMM);
-        close(socket_fd);
-        return ERR_RDSH_COMMUNICATION;
+    if (started < clist->num) {
+        for (int i = 0; i < started; i++) {
+            waitpid(pids[i], NULL, 0);
+        }
+        return ERR_RDSH_CMD_EXEC;
     }
-
     return OK;
 }
 
 
 
+//build_cmd_buff() leaves the second '>' of `>>file` in front of the name
 _Bool is_append_redirect(const char *output_file) {
-    return (output_file && output_file[0] == '>' && output_file[1] == '>');
+    return (output_file && output_file[0] == '>');
 }
 
 /**************   OPTIONAL STUFF  ***************/
@@ -714,6 +776,7 @@ _Bool is_append_redirect(const char *output_file) {
  *      Input             Output
  *      exit              BI_CMD_EXIT
  *      dragon            BI_CMD_DRAGON
+ *      stats             BI_CMD_STATS
  * 
  *  This function is entirely optional to implement if you want to handle
  *  processing built-in commands differently in your implementation. 
@@ -738,6 +801,8 @@ Built_In_Cmds rsh_match_command(const char *input)
         return BI_CMD_RC;
     } else if (strcmp(input, "stop-server") == 0) {
         return BI_CMD_STOP_SVR;
+    } else if (strcmp(input, "stats") == 0) {
+        return BI_CMD_STATS;
     } else {
         return BI_NOT_BI; // Not a built-in command
     }
@@ -763,31 +828,29 @@ Built_In_Cmds rsh_match_command(const char *input)
  *                   in so it should be sent to your fork/exec logic
  *      BI_EXECUTED: Indicates that this function handled the direct execution
  *                   of the command and there is nothing else to do, consider
- *                   it executed.  For example the cmd of "cd" gets the value of
- *                   BI_CMD_CD from rsh_match_command().  It then makes the libc
- *                   call to chdir(cmd->argv[1]); and finally returns BI_EXECUTED
+ *                   it executed, for example "dragon".
  *      BI_CMD_*     Indicates that a built-in command was matched and the caller
  *                   is responsible for executing it.  For example if this function
  *                   returns BI_CMD_STOP_SVR the caller of this function is
  *                   responsible for stopping the server.  If BI_CMD_EXIT is returned
  *                   the caller is responsible for closing the client connection.
+ *                   BI_CMD_CD changes the session's directory, which only the
+ *                   caller has, with rsh_change_dir().  BI_CMD_STATS is
+ *                   answered with rsh_stats_format().
  * 
  *   AGAIN - THIS IS TOTALLY OPTIONAL IF YOU HAVE OR WANT TO HANDLE BUILT-IN
  *   COMMANDS DIFFERENTLY. 
  */
 Built_In_Cmds rsh_built_in_cmd(cmd_buff_t *cmd)
 {
+    if (cmd->argc == 0) return BI_NOT_BI;
+
     Built_In_Cmds cmd_type = rsh_match_command(cmd->argv[0]);
 
     switch (cmd_type) {
         case BI_CMD_CD:
-            if (cmd->argc < 2) {
-                // No directory provided, default to home directory
-                chdir(getenv("HOME"));
-            } else {
-                chdir(cmd->argv[1]);
-            }
-            return BI_EXECUTED;
+            // Every session has its own directory, see rsh_change_dir()
+            return BI_CMD_CD;
 
         case BI_CMD_EXIT:
             return BI_CMD_EXIT;
@@ -795,8 +858,15 @@ Built_In_Cmds rsh_built_in_cmd(cmd_buff_t *cmd)
         case BI_CMD_STOP_SVR:
             return BI_CMD_STOP_SVR;
 
-        case BI_CMD_DRAGON:
         case BI_CMD_RC:
+            // The session knows the last return code, not us
+            return BI_CMD_RC;
+
+        case BI_CMD_STATS:
+            // The output goes to the session, not to our stdout
+            return BI_CMD_STATS;
+
+        case BI_CMD_DRAGON:
             // Handle other built-in commands here
             return BI_EXECUTED;
 
@@ -804,3 +874,31 @@ Built_In_Cmds rsh_built_in_cmd(cmd_buff_t *cmd)
             return BI_NOT_BI; // Not a built-in command
     }
 }
+
+/*
+ * rsh_change_dir(dir_fd, cmd)
+ *      dir_fd:  The session's working directory, replaced on success
+ *      cmd:     The parsed `cd [DIR]`, without DIR it goes to $HOME
+ *
+ *  `cd` for one session.  chdir() would move the whole server, and with
+ *  it every other client of a threaded or event-driven server, so the
+ *  new directory is opened relative to the old one instead and the
+ *  session keeps the descriptor.
+ *
+ *  Returns:
+ *
+ *      OK:            *dir_fd is the new directory
+ *      ERR_EXEC_CMD:  It cannot be opened, errno says why, *dir_fd is
+ *                     unchanged
+ */
+int rsh_change_dir(int *dir_fd, cmd_buff_t *cmd) {
+    const char *path = cmd->argc < 2 ? getenv("HOME") : cmd->argv[1];
+
+    if (!path) return OK;       // like chdir(NULL) did: nowhere to go
+
+    int fd = openat(*dir_fd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) return ERR_EXEC_CMD;
+    close(*dir_fd);
+    *dir_fd = fd;
+    return OK;
+}
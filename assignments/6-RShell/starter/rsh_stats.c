@@ -0,0 +1,337 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/wait.h>
+
+#include "dshlib.h"
+#include "rshlib.h"
+
+/*
+ * Server counters, what the `stats` built-in and -o stats_file report.
+ *
+ * Every thread that records something claims a slot of its own the
+ * first time and from then on only touches that slot, so the request
+ * path never shares a cache line with another thread and takes no lock.
+ * The adds are still atomic (relaxed, on a line nobody else writes) for
+ * the rare case that more than RSH_STATS_SLOTS threads record and the
+ * last slot is shared.  Reading sums up all slots; the totals are not a
+ * snapshot of one instant, each counter is just never torn.
+ *
+ * The slots live in a shared anonymous mapping set up by start_server()
+ * before anything is forked, so the -f worker processes all count into
+ * the same table and `stats` on any of them shows the whole server.  A
+ * slot belongs to a process, not a thread id: the -f supervisor frees
+ * the slots of a worker that died (rsh_stats_release()) and the worker
+ * that replaces it carries on with them.  The counters are totals since
+ * the server started, only the gauges of the dead worker are reset.
+ *
+ * Latencies go into histograms of log2 microsecond buckets:
+ *
+ *      spawn   rsh_execute_pipeline(), fork (or zygote) and exec of
+ *              every stage of a pipeline
+ *      run     from there until the last stage exited and its output
+ *              was read
+ *
+ * The number of sessions being served lives here too, for the same
+ * reason: -o max_sessions is a limit for the whole server, and only
+ * this mapping is shared by the -f workers.  It is the one counter
+ * every thread writes, but only when a session starts or ends
+ * (rsh_session_admit()).
+ */
+
+typedef struct stats_slot {
+    _Alignas(64) atomic_int owner;      // pid, 0 = free
+    atomic_ullong   count[RSH_STAT_NCOUNTERS];
+    atomic_ullong   hist[RSH_NHISTS][RSH_STATS_BUCKETS];
+    atomic_ullong   errors[RSH_STATS_ERRS];     // by -rc
+} stats_slot_t;
+
+typedef struct stats_shm {
+    uint64_t        started;            // rsh_stats_now()
+    _Alignas(64) atomic_long sessions;  // admitted and not left yet
+    stats_slot_t    slots[RSH_STATS_SLOTS];
+} stats_shm_t;
+
+static stats_shm_t *shm;
+static _Thread_local stats_slot_t *my_slot;
+static pid_t dumper;
+
+static const char *counter_names[RSH_STAT_NCOUNTERS] = {
+    "conns_accepted", "conns_closed", "conns_rejected", "cmds", "cmds_failed",
+    "bytes_in", "bytes_out", "idle_closed", "cmd_timeouts",
+};
+
+static const char *hist_names[RSH_NHISTS] = {"spawn_us", "run_us"};
+
+uint64_t rsh_stats_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+/*
+ * rsh_stats_init()
+ *      Maps the counters, once, before the server forks or starts
+ *      threads.  Until then recording does nothing, so the client side
+ *      of dsh never pays for it.
+ *
+ *  Returns:
+ *      OK
+ *      ERR_RDSH_SERVER         mmap() failed, reported
+ */
+int rsh_stats_init(void) {
+    if (shm) return OK;
+
+    void *p = mmap(NULL, sizeof(stats_shm_t), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED) {
+        perror("mmap");
+        return ERR_RDSH_SERVER;
+    }
+    shm = p;
+    shm->started = rsh_stats_now();
+    return OK;
+}
+
+static stats_slot_t *slot_get(void) {
+    if (my_slot || !shm) return my_slot;
+
+    int pid = getpid();
+    for (int i = 0; i < RSH_STATS_SLOTS - 1; i++) {
+        int free_slot = 0;
+        if (atomic_load_explicit(&shm->slots[i].owner, memory_order_relaxed) == 0 &&
+            atomic_compare_exchange_strong(&shm->slots[i].owner, &free_slot, pid)) {
+            return my_slot = &shm->slots[i];
+        }
+    }
+    //out of slots: the last one is shared, which the atomic adds allow
+    atomic_store(&shm->slots[RSH_STATS_SLOTS - 1].owner, pid);
+    return my_slot = &shm->slots[RSH_STATS_SLOTS - 1];
+}
+
+static void slot_add(atomic_ullong *counter, uint64_t n) {
+    atomic_fetch_add_explicit(counter, n, memory_order_relaxed);
+}
+
+void rsh_stat_add(rsh_stat_t what, uint64_t n) {
+    stats_slot_t *s = slot_get();
+    if (s) slot_add(&s->count[what], n);
+}
+
+void rsh_stat_time(rsh_hist_t which, uint64_t ns) {
+    stats_slot_t *s = slot_get();
+    uint64_t us = ns / 1000;
+    int b = us ? 64 - __builtin_clzll(us) : 0;
+
+    if (!s) return;
+    if (b >= RSH_STATS_BUCKETS) b = RSH_STATS_BUCKETS - 1;
+    slot_add(&s->hist[which][b], 1);
+}
+
+//a command that ended in one of dsh's own (negative) return codes
+void rsh_stat_error(int rc) {
+    stats_slot_t *s = slot_get();
+    int i = -rc;
+
+    if (!s || rc >= 0) return;
+    if (i >= RSH_STATS_ERRS) i = RSH_STATS_ERRS - 1;
+    slot_add(&s->errors[i], 1);
+}
+
+/*
+ * rsh_stats_release(pid)
+ *      The -f supervisor's part: worker pid is gone, the connections it
+ *      counted as open are closed now and its slots are free again.
+ */
+void rsh_stats_release(pid_t pid) {
+    if (!shm) return;
+    for (int i = 0; i < RSH_STATS_SLOTS; i++) {
+        stats_slot_t *s = &shm->slots[i];
+        if (atomic_load(&s->owner) != pid) continue;
+
+        unsigned long long open = atomic_load(&s->count[RSH_STAT_ACCEPTED]) -
+                                  atomic_load(&s->count[RSH_STAT_CLOSED]);
+        slot_add(&s->count[RSH_STAT_CLOSED], open);
+        atomic_fetch_sub(&shm->sessions, open);
+        if (i < RSH_STATS_SLOTS - 1) atomic_store(&s->owner, 0);
+    }
+}
+
+/*
+ * rsh_session_admit()
+ *      Takes one of the -o max_sessions places for a new client.  Returns
+ *      false when they are all taken, the client is then turned away
+ *      with rsh_reject_busy().  Every admitted session must call
+ *      rsh_session_leave() once it is over.
+ */
+bool rsh_session_admit(void) {
+    if (!shm) return true;
+    if (atomic_fetch_add(&shm->sessions, 1) < rsh_opts.max_sessions) return true;
+    atomic_fetch_sub(&shm->sessions, 1);
+    return false;
+}
+
+void rsh_session_leave(void) {
+    if (shm) atomic_fetch_sub(&shm->sessions, 1);
+}
+
+//the upper bound of the bucket holding fraction q of n samples
+static unsigned long long hist_pct(unsigned long long *hist, unsigned long long n, double q) {
+    unsigned long long seen = 0;
+
+    for (int b = 0; b < RSH_STATS_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen > 0 && seen >= q * n) return 1ull << b;
+    }
+    return 0;
+}
+
+#define APPEND(...) do { \
+        if (len < size) len += snprintf(buff + len, size - len, __VA_ARGS__); \
+    } while (0)
+
+/*
+ * rsh_stats_format(buff, size)
+ *      The totals of all slots as "name value" lines, histograms as
+ *      n=, p50=, p99= and max= bucket bounds and a line of the non-empty
+ *      buckets, "bound:count" each, a bucket counting the samples below
+ *      its bound.  Errors are "code:count".  With -x the worker pool's
+ *      pool_active and pool_queued gauges follow the connection counts.
+ *      Returns the length, cut short to what fits.
+ */
+int rsh_stats_format(char *buff, size_t size) {
+    unsigned long long count[RSH_STAT_NCOUNTERS] = {0};
+    unsigned long long hist[RSH_NHISTS][RSH_STATS_BUCKETS] = {{0}};
+    unsigned long long errors[RSH_STATS_ERRS] = {0};
+    int threads = 0;
+    size_t len = 0;
+
+    if (size == 0) return 0;
+    buff[0] = '\0';
+    if (!shm) return 0;
+
+    for (int i = 0; i < RSH_STATS_SLOTS; i++) {
+        stats_slot_t *s = &shm->slots[i];
+        if (atomic_load_explicit(&s->owner, memory_order_relaxed) != 0) threads++;
+        for (int c = 0; c < RSH_STAT_NCOUNTERS; c++) {
+            count[c] += atomic_load_explicit(&s->count[c], memory_order_relaxed);
+        }
+        for (int h = 0; h < RSH_NHISTS; h++) {
+            for (int b = 0; b < RSH_STATS_BUCKETS; b++) {
+                hist[h][b] += atomic_load_explicit(&s->hist[h][b], memory_order_relaxed);
+            }
+        }
+        for (int e = 0; e < RSH_STATS_ERRS; e++) {
+            errors[e] += atomic_load_explicit(&s->errors[e], memory_order_relaxed);
+        }
+    }
+
+    APPEND("uptime_s %llu\n", (unsigned long long)((rsh_stats_now() - shm->started) / 1000000000ull));
+    APPEND("threads %d\n", threads);
+    for (int c = 0; c < RSH_STAT_NCOUNTERS; c++) {
+        APPEND("%s %llu\n", counter_names[c], count[c]);
+        //closed is only there to work out the gauge
+        if (c == RSH_STAT_CLOSED) {
+            APPEND("conns_active %llu\n", count[RSH_STAT_ACCEPTED] - count[RSH_STAT_CLOSED]);
+        }
+    }
+    //-x: sessions on a worker and clients waiting for one
+    if (rsh_pool_running()) {
+        APPEND("pool_active %d\n", rsh_pool_active());
+        APPEND("pool_queued %d\n", rsh_pool_queued());
+    }
+
+    for (int h = 0; h < RSH_NHISTS; h++) {
+        unsigned long long n = 0;
+        for (int b = 0; b < RSH_STATS_BUCKETS; b++) n += hist[h][b];
+
+        APPEND("%s n=%llu p50=%llu p99=%llu max=%llu\n", hist_names[h], n,
+               hist_pct(hist[h], n, 0.5), hist_pct(hist[h], n, 0.99), hist_pct(hist[h], n, 1.0));
+        APPEND("%s_hist", hist_names[h]);
+        for (int b = 0; b < RSH_STATS_BUCKETS; b++) {
+            if (hist[h][b]) APPEND(" %llu:%llu", 1ull << b, hist[h][b]);
+        }
+        APPEND("\n");
+    }
+
+    APPEND("errors");
+    for (int e = 1; e < RSH_STATS_ERRS; e++) {
+        if (errors[e]) APPEND(" %d:%llu", -e, errors[e]);
+    }
+    APPEND("\n");
+
+    return len < size ? (int)len : (int)size - 1;
+}
+
+//replaces -o stats_file in one step, a reader never sees half of it
+static void stats_write(void) {
+    char buff[RSH_STATS_MAX], tmp[sizeof(rsh_opts.stats_file) + 8];
+    int len = rsh_stats_format(buff, sizeof(buff));
+
+    snprintf(tmp, sizeof(tmp), "%s.tmp", rsh_opts.stats_file);
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        perror(tmp);
+        return;
+    }
+    bool ok = write(fd, buff, len) == len;
+    close(fd);
+    if (!ok || rename(tmp, rsh_opts.stats_file) < 0) {
+        perror(rsh_opts.stats_file);
+        unlink(tmp);
+    }
+}
+
+/*
+ * rsh_stats_dump_start()
+ *      With -o stats_file=PATH starts a process that writes the stats to
+ *      PATH every -o stats_interval seconds.  A process and not a thread
+ *      so the -f supervisor can still fork safely, it reads the shared
+ *      counters all the same.  It dies with the server.
+ *
+ *  Returns:
+ *      OK
+ *      ERR_RDSH_SERVER         fork() failed, reported
+ */
+int rsh_stats_dump_start(void) {
+    if (!shm || rsh_opts.stats_file[0] == '\0') return OK;
+
+    fflush(NULL);
+    dumper = fork();
+    if (dumper < 0) {
+        perror("fork");
+        dumper = 0;
+        return ERR_RDSH_SERVER;
+    }
+    if (dumper == 0) {
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+        if (getppid() == 1) _exit(EXIT_SUCCESS);        // already gone
+        while (1) {
+            sleep(rsh_opts.stats_interval);
+            stats_write();
+        }
+    }
+    return OK;
+}
+
+/*
+ * rsh_stats_dump_stop()
+ *      Stops the dump process and writes the final numbers.
+ */
+void rsh_stats_dump_stop(void) {
+    if (dumper <= 0) return;
+    kill(dumper, SIGTERM);
+    waitpid(dumper, NULL, 0);
+    dumper = 0;
+    stats_write();
+}
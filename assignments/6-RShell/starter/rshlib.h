@@ -1,6 +1,9 @@
 #ifndef __RSH_LIB_H__
     #define __RSH_LIB_H__
 
+#include <stdio.h>
+#include <stdint.h>
+
 #include "dshlib.h"
 
 //common remote shell client and server constants and definitions
@@ -21,6 +24,62 @@
                                             //server.  See documentation for 
                                             //exec_client_requests() for more info
 
+//server modes, passed to start_server() as is_threaded
+#define RSH_MODE_SINGLE         0           //one client at a time
+#define RSH_MODE_THREADED       1           //-x, a thread per client
+#define RSH_MODE_REACTOR        2           //-e, one epoll loop, see rsh_reactor.c
+#define RSH_MODE_PREFORK        3           //-f, SO_REUSEPORT processes, see rsh_prefork.c
+
+//event loop tuning, see rsh_reactor.c
+#define RSH_MAX_EVENTS          64          //epoll_wait() batch
+#define RSH_IO_CHUNK            (1024*16)   //bytes per read()/recv()
+#define RSH_BUF_MIN             1024        //first allocation of a buffer
+#define RSH_OUT_HIWAT           RDSH_COMM_BUFF_SZ   //stop reading command output
+                                            //while this much waits for the client
+
+//client -b batch mode, see exec_remote_batch()
+#define RSH_BATCH_WINDOW        64          //commands sent ahead of their response
+
+//server tunables, set with -o NAME=VALUE - see rsh_opts.c
+#define RSH_DEF_WORKERS         16          //-x worker threads
+#define RSH_DEF_QUEUE           64          //-x clients waiting for a worker
+#define RSH_OVERFLOW_BLOCK      "block"     //full queue: stop accepting
+#define RSH_OVERFLOW_BUSY       "busy"      //full queue: reject the client
+#define RSH_RELAY_SPLICE        "splice"    //output pipe to socket in the kernel
+#define RSH_RELAY_COPY          "copy"      //read() and send() through a buffer
+#define RSH_DEF_SESSION_JOBS    1           //commands a client runs at once
+#define RSH_COMPRESS_ON         "on"        //grant RSH_FEAT_LZ to clients asking
+#define RSH_COMPRESS_OFF        "off"
+#define RSH_DEF_COMPRESS_MIN    512         //smaller DATA frames go out as they are
+#define RSH_DEF_BACKLOG         128         //listen() backlog
+#define RSH_DEF_PROCS           0           //-f worker processes, 0: one per CPU
+#define RSH_DEF_STATS_INTERVAL  10          //seconds between -o stats_file dumps
+#define RSH_DEF_MAX_SESSIONS    512         //clients served at once, all -f workers together
+#define RSH_DEF_SESSION_CHILDREN 32         //processes one client may have running
+#define RSH_DEF_IDLE_TIMEOUT    0           //seconds a session may wait for a command, 0: forever
+#define RSH_DEF_CMD_TIMEOUT     0           //seconds a command may run, 0: forever
+#define RSH_TIMER_TICK          1           //seconds between timeout checks
+
+typedef struct rsh_opts {
+    long    workers;
+    long    queue;
+    char    overflow[8];
+    char    relay[8];
+    long    session_jobs;
+    char    compress[4];
+    long    compress_min;
+    long    backlog;
+    long    procs;
+    char    stats_file[256];
+    long    stats_interval;
+    long    max_sessions;
+    long    session_children;
+    long    idle_timeout;
+    long    cmd_timeout;
+} rsh_opts_t;
+
+extern rsh_opts_t rsh_opts;
+
 //end of message delimiter.  This is super important.  TCP is a stream, therefore
 //the protocol designer is responsible for managing where messages begin and end
 //there are many common techniques for this, but one of the simplest ways is to
@@ -29,6 +88,68 @@
 //linux based systems. 
 static const char RDSH_EOF_CHAR = 0x04;    
 
+//framed protocol - see rsh_proto.c for the layout
+#define RSH_PROTO_VERSION       1
+#define RSH_PREFACE_FMT         "\x01RSH/%d %x\n"   //client's first line
+#define RSH_PREFACE_SCAN        "\x01RSH/%d %x"
+#define RSH_PREFACE_BYTE        0x01
+#define RSH_PREFACE_MAX         32
+#define RSH_FRAME_HDR_SZ        12
+#define RSH_FRAME_MAX           (RDSH_COMM_BUFF_SZ - RSH_FRAME_HDR_SZ)
+
+#define RSH_FT_HELLO            1           //frame types
+#define RSH_FT_CMD              2
+#define RSH_FT_DATA             3
+#define RSH_FT_END              4
+
+#define RSH_CH_CTRL             0           //channels
+#define RSH_CH_STDOUT           1
+#define RSH_CH_STDERR           2
+#define RSH_CH_STATUS           3           //END: exit status (32 bit)
+
+#define RSH_FEAT_LZ             0x1         //features: DATA may be compressed
+
+#define RSH_FF_LZ               0x1         //frame flags: payload is an LZ block
+
+#define RSH_LZ_MAX_IN           65535       //see rsh_lz.c
+
+#define RSH_FRAME_PARTIAL       0           //rsh_frame_unpack()
+#define RSH_FRAME_OK            1
+
+typedef struct rsh_frame {
+    uint8_t     version;
+    uint8_t     type;
+    uint8_t     channel;
+    uint8_t     flags;
+    uint32_t    req_id;
+    uint32_t    len;
+} rsh_frame_t;
+
+//server counters - see rsh_stats.c
+#define RSH_STATS_SLOTS         256         //threads counting on their own
+#define RSH_STATS_BUCKETS       32          //log2 microsecond latency buckets
+#define RSH_STATS_ERRS          100         //error codes counted, by -code
+#define RSH_STATS_MAX           4096        //the formatted report
+
+typedef enum {
+    RSH_STAT_ACCEPTED,                      //sessions started
+    RSH_STAT_CLOSED,                        //sessions ended
+    RSH_STAT_REJECTED,                      //turned away busy
+    RSH_STAT_CMDS,                          //commands answered, built-ins too
+    RSH_STAT_CMDS_FAILED,                   //ended with a non-zero exit status
+    RSH_STAT_BYTES_IN,                      //from clients
+    RSH_STAT_BYTES_OUT,                     //to clients
+    RSH_STAT_IDLE_CLOSED,                   //sessions closed by -o idle_timeout
+    RSH_STAT_CMD_TIMEOUTS,                  //commands killed by -o cmd_timeout
+    RSH_STAT_NCOUNTERS,
+} rsh_stat_t;
+
+typedef enum {
+    RSH_HIST_SPAWN,                         //fork/exec of a pipeline
+    RSH_HIST_RUN,                           //a pipeline from start to END
+    RSH_NHISTS,
+} rsh_hist_t;
+
 //rdsh specific error codes for functions
 #define ERR_RDSH_COMMUNICATION  -50     //Used for communication errors
 #define ERR_RDSH_SERVER         -51     //General server errors
@@ -42,6 +163,13 @@ static const char RDSH_EOF_CHAR = 0x04;
 #define CMD_ERR_RDSH_ITRNL  "rdsh-error: internal server error - %d\n"
 #define CMD_ERR_RDSH_SEND   "rdsh-error: partial send.  Sent %d, expected to send %d\n"
 #define RCMD_SERVER_EXITED  "server appeared to terminate - exiting\n"
+#define RCMD_ERR_SVR_BUSY   "rdsh-error: server busy, try again later\n"
+#define CMD_ERR_RDSH_OPT    "rdsh-error: bad option: %s\n"
+#define CMD_ERR_RDSH_CD     "cd: %s: %s\n"
+#define CMD_ERR_RDSH_TIMEOUT "rdsh-error: command timed out after %lds, killed\n"
+#define CMD_ERR_RDSH_NO_CMD "rdsh-error: redirection without a command\n"
+#define CMD_ERR_RDSH_CHILDREN "rdsh-error: %d processes, a session may run %ld\n"
+#define CMD_ERR_RDSH_POOL_OPTS "rdsh-error: need workers >= 1, queue >= 1, overflow=block|busy\n"
 
 //Output message constants for client
 #define RCMD_MSG_CLIENT_EXITED  "client exited: getting next connection...\n"
@@ -54,18 +182,69 @@ static const char RDSH_EOF_CHAR = 0x04;
 int start_client(char *address, int port);
 int client_cleanup(int cli_socket, char *cmd_buff, char *rsp_buff, int rc);
 int exec_remote_cmd_loop(char *address, int port);
+int exec_remote_batch(char *address, int port, const char *script);
+int rsh_remote_status(void);
+void rsh_client_compress(bool on);
     
 
 //server prototypes for rsh_server.c - see documentation for each function to
 //see what they do
 int start_server(char *ifaces, int port, int is_threaded);
 int boot_server(char *ifaces, int port);
+int rsh_boot_shared(char *ifaces, int port);
 int stop_server(int svr_socket);
 int send_message_eof(int cli_socket);
 int send_message_string(int cli_socket, char *buff);
+void rsh_reject_busy(int cli_socket);
 int process_cli_requests(int svr_socket, int is_threaded);
 int exec_client_requests(int cli_socket);
-int rsh_execute_pipeline(int socket_fd, command_list_t *clist);
+int rsh_execute_pipeline(int out_fd, int err_fd, int dir_fd, command_list_t *clist, pid_t *pids);
+int rsh_change_dir(int *dir_fd, cmd_buff_t *cmd);
+
+//framing - see rsh_proto.c
+void rsh_frame_pack(char *hdr, uint8_t type, uint8_t channel, uint8_t flags,
+                    uint32_t req_id, uint32_t len);
+int rsh_frame_unpack(const char *buff, size_t avail, rsh_frame_t *frame);
+int rsh_preface_format(char *buff, size_t size, uint32_t features);
+int rsh_preface_parse(const char *line, uint32_t *features);
+
+//LZ4-style frame compression - see rsh_lz.c
+int rsh_lz_compress(const char *src, int src_len, char *dst, int dst_cap);
+int rsh_lz_decompress(const char *src, int src_len, char *dst, int dst_cap);
+void rsh_lz_report(FILE *out);
+
+//server counters - see rsh_stats.c
+int rsh_stats_init(void);
+uint64_t rsh_stats_now(void);
+void rsh_stat_add(rsh_stat_t what, uint64_t n);
+void rsh_stat_time(rsh_hist_t which, uint64_t ns);
+void rsh_stat_error(int rc);
+void rsh_stats_release(pid_t pid);
+bool rsh_session_admit(void);
+void rsh_session_leave(void);
+int rsh_stats_format(char *buff, size_t size);
+int rsh_stats_dump_start(void);
+void rsh_stats_dump_stop(void);
+
+//server tunables - see rsh_opts.c
+int rsh_set_opt(const char *assignment);
+void rsh_print_opts(void);
+
+//worker pool of the threaded server - see rsh_pool.c
+int rsh_pool_start(int svr_socket);
+void rsh_pool_submit(int fd);
+void rsh_pool_stop(void);
+bool rsh_pool_stopping(void);
+bool rsh_pool_running(void);
+int rsh_pool_active(void);
+int rsh_pool_queued(void);
+
+//prefork server mode - see rsh_prefork.c
+int rsh_prefork_run(char *ifaces, int port);
+
+//event-driven connection handling - see rsh_reactor.c
+int rsh_reactor_run(int svr_socket);
+int rsh_session_run(int cli_socket);
 
 // SEE COMMENTS IN THE CODE, THESE ARE OPTIONAL IN CASE YOU WANT TO PROVIDE
 // SUPPORT FOR BUILT-IN FUNCTIONS DIFFERENTLY 